@@ -56,7 +56,7 @@ int get_request(char *req_buffer, int *p_req_size, int max_req_size, int cycle)
     return *p_req_size;
 }
 
-int handle_response(const char *res_buffer, int res_size, int cycle)
+int handle_response(const char *res_buffer, int res_size, int cycle, bool more)
 {
     int result;
     char res_str[DEFAULT_BUFFER_CAPACITY];
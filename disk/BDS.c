@@ -3,77 +3,267 @@
 #include "error_type.h"
 #include "buffer.h"
 #include "server.h"
-
-int diskfile_fd = -1;
-char *diskfile = NULL;
+#include "protocol.h"
+#include "scheduler.h"
+#include "clock.h"
+#include "model.h"
+#include "storage.h"
+#include "log.h"
+#include "stats.h"
+#include "shm.h"
+#include "pool.h"
+
+enum storage_backend_t backend = STORAGE_BACKEND_MMAP;
 sem_t diskfile_mutex;
-int disk_arm_loc = 0;
 
 char *filename;
 int n_cylinders = 512;
 int n_sectors = 16;
 int delay = 20;
+int rpm = 0;
+int n_track_buffers = 0;
+char *stats_filename = NULL;
+
+enum sched_policy_t sched_policy = SCHED_POLICY_NONE;
+
+// concurrent mode: the arm is reserved on a simulated timeline, and the data
+// is transferred under reader/writer locks, each guarding a range of cylinders
+bool concurrent = false;
+pthread_mutex_t arm_mutex = PTHREAD_MUTEX_INITIALIZER;
+long arm_free_us = 0;
+pthread_rwlock_t *range_locks = NULL;
+int n_range_locks = 0;
+
+// group commit: a flush is served by the first sync that starts after it
+// arrives. The leader of a sync waits flush_window_us for the flushes of other
+// clients to join it. Barriers drain the writes in progress and hold off new
+// ones, but not each other, so concurrent barriers share their syncs too. On
+// shutdown, the gate is closed to all accesses and flushes, and the storage is
+// closed once those in progress are over.
+int flush_window_us = 500;
+pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+bool sync_leader = false;
+long n_syncs_started = 0;
+long n_syncs_done = 0;
+int sync_result = SUCCESS;
+long n_flushes = 0;
+pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+int n_active_writes = 0;
+int n_active_barriers = 0;
+int n_active_accesses = 0; // accesses and flushes to the storage in progress
+bool gate_closed = false;
 
 const int sector_size = 256;
 
+#define MAX_RANGE_LOCKS 4096
+
 void diskfile_init()
 {
-    long filesize = n_cylinders * n_sectors * sector_size;
+    long filesize = (long)n_cylinders * n_sectors * sector_size;
     printf("Init: filesize = %ld bytes\n", filesize);
 
-    // filename -> diskfile_fd
-    diskfile_fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    EXIT_IF(diskfile_fd < 0, , "Error: Could not open file '%s'.\n", filename);
-
-    // stretch diskfile_fd
-    int result = lseek(diskfile_fd, filesize - 1, SEEK_SET);
-    EXIT_IF(result < 0, close(diskfile_fd), "Error: Could not stretch file '%s'.\n", filename);
+    storage_init(filename, filesize, backend);
 
-    // write to diskfile_fd
-    result = write(diskfile_fd, "", 1);
-    EXIT_IF(result != 1, close(diskfile_fd), "Error: Could not write last byte of file '%s'.\n", filename);
+    sem_init(&diskfile_mutex, 0, 1);
 
-    // diskfile_fd -> diskfile
-    diskfile = (char *)mmap(NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile_fd, 0);
-    EXIT_IF(diskfile == MAP_FAILED, close(diskfile_fd), "Error: Could not map file '%s'.\n", filename);
+    stats_init(n_cylinders, n_sectors, stats_filename);
+    model_init(n_sectors, delay, rpm, n_track_buffers);
 
-    sem_init(&diskfile_mutex, 0, 1);
-    disk_arm_loc = 0;
-    printf("Init: disk_arm_loc = cylinder 0.\n");
+    if (concurrent)
+    {
+        n_range_locks = (n_cylinders < MAX_RANGE_LOCKS) ? n_cylinders : MAX_RANGE_LOCKS;
+        range_locks = (pthread_rwlock_t *)malloc(n_range_locks * sizeof(pthread_rwlock_t));
+        EXIT_IF(range_locks == NULL, storage_close(), "Error: Bad alloc.\n");
+        for (int i = 0; i < n_range_locks; i++)
+            pthread_rwlock_init(&range_locks[i], NULL);
+        arm_free_us = now_us();
+        printf("Init: concurrent mode, %d range locks.\n", n_range_locks);
+    }
 }
 
 void diskfile_close()
 {
-    long filesize = n_cylinders * n_sectors * sector_size;
     sem_destroy(&diskfile_mutex);
-    int result = munmap(diskfile, filesize);
-    EXIT_IF(result < 0, close(diskfile_fd), "Error: Could not unmap file '%s'.\n", filename);
+    model_close();
+    stats_close();
+    if (range_locks != NULL)
+    {
+        for (int i = 0; i < n_range_locks; i++)
+            pthread_rwlock_destroy(&range_locks[i]);
+        free(range_locks);
+        range_locks = NULL;
+    }
+    storage_sync();
+    storage_close();
+}
 
-    close(diskfile_fd);
-    diskfile = NULL;
+// Returns the time the arm needs to serve the request, starting at start_us.
+// Must only be called by the owner of the arm: the holder of diskfile_mutex,
+// the dispatcher of the scheduler, or the holder of arm_mutex.
+long arm_service_time(const struct sched_req_t *req, long start_us)
+{
+    if (req->op == SCHED_OP_DISCARD)
+        return 0;
+    long service_us = 0;
+    if (req->src_lba >= 0)
+        service_us += model_access(true, req->src_lba, req->count, start_us);
+    service_us += model_access(req->op == SCHED_OP_READ, req->lba, req->count, start_us + service_us);
+    return service_us;
+}
+
+// Serves the request with the arm, sleeping for its service time.
+void arm_serve(const struct sched_req_t *req)
+{
+    long start = now_us();
+    sleep_until_us(start + arm_service_time(req, start));
+}
+
+// Reserves the arm on the simulated timeline: the request is served once all
+// earlier requests are over. Only the caller sleeps, so nothing is held while
+// the data is transferred.
+void arm_reserve(struct sched_req_t *req)
+{
+    pthread_mutex_lock(&arm_mutex);
+    long now = now_us();
+    long start = (arm_free_us > now) ? arm_free_us : now;
+    req->start_us = start;
+    arm_free_us = start + arm_service_time(req, start);
+    long deadline = arm_free_us;
+    pthread_mutex_unlock(&arm_mutex);
+
+    sleep_until_us(deadline);
 }
 
-void arm_delay(int cylinder_1, int cylinder_2)
+int range_lock_index(long lba)
 {
-    usleep(delay * abs(cylinder_1 - cylinder_2));
+    return (lba / n_sectors) * n_range_locks / n_cylinders;
+}
+
+// Locks (or unlocks) the ranges of cylinders touched by the request, in
+// ascending order. The destination is locked for writing unless the request is
+// a read, the source of a copy is locked for reading.
+void range_lock(const struct sched_req_t *req, bool lock)
+{
+    int dst_lo = range_lock_index(req->lba);
+    int dst_hi = range_lock_index(req->lba + req->count - 1);
+    int src_lo = dst_lo;
+    int src_hi = -1;
+    if (req->src_lba >= 0)
+    {
+        src_lo = range_lock_index(req->src_lba);
+        src_hi = range_lock_index(req->src_lba + req->count - 1);
+    }
+
+    int lo = (src_lo < dst_lo) ? src_lo : dst_lo;
+    int hi = (src_hi > dst_hi) ? src_hi : dst_hi;
+    for (int i = lo; i <= hi; i++)
+    {
+        bool in_dst = i >= dst_lo && i <= dst_hi;
+        bool in_src = i >= src_lo && i <= src_hi;
+        if (!in_dst && !in_src)
+            continue;
+        if (!lock)
+            pthread_rwlock_unlock(&range_locks[i]);
+        else if (in_dst && req->op != SCHED_OP_READ)
+            pthread_rwlock_wrlock(&range_locks[i]);
+        else
+            pthread_rwlock_rdlock(&range_locks[i]);
+    }
+}
+
+// Registers an access to the storage. A write also waits until no barrier is
+// in progress. Once the gate is closed, the caller waits until the process
+// exits.
+void gate_enter(bool write)
+{
+    pthread_mutex_lock(&flush_mutex);
+    while (gate_closed || (write && n_active_barriers > 0))
+        pthread_cond_wait(&gate_cond, &flush_mutex);
+    n_active_accesses++;
+    if (write)
+        n_active_writes++;
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+void gate_leave(bool write)
+{
+    pthread_mutex_lock(&flush_mutex);
+    n_active_accesses--;
+    if (write)
+        n_active_writes--;
+    if (n_active_accesses == 0 || (write && n_active_writes == 0))
+        pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+// Closes the gate and waits until the accesses in progress are over, so that
+// the storage can be closed under no one.
+void diskfile_drain()
+{
+    pthread_mutex_lock(&flush_mutex);
+    gate_closed = true;
+    while (n_active_accesses > 0)
+        pthread_cond_wait(&gate_cond, &flush_mutex);
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+// Positions the arm over the sectors of the request and gives the caller
+// access to them until disk_access_end(). The access is exclusive, except in
+// concurrent mode, where it is shared with the readers of the same sectors.
+void disk_access_begin(struct sched_req_t *req)
+{
+    req->arrive_us = now_us();
+    gate_enter(req->op != SCHED_OP_READ);
+
+    if (sched_policy != SCHED_POLICY_NONE)
+        sched_submit(req);
+    else if (concurrent)
+        arm_reserve(req);
+    else
+    {
+        sem_wait(&diskfile_mutex);
+        req->start_us = now_us();
+        arm_serve(req);
+    }
+
+    if (concurrent)
+        range_lock(req, true);
+}
+
+void disk_access_end(struct sched_req_t *req)
+{
+    if (concurrent)
+        range_lock(req, false);
+
+    if (sched_policy != SCHED_POLICY_NONE)
+        sched_complete(req);
+    else if (!concurrent)
+        sem_post(&diskfile_mutex);
+
+    stats_record_request(req, req->start_us - req->arrive_us, now_us() - req->start_us);
+    gate_leave(req->op != SCHED_OP_READ);
+}
+
+bool sectors_in_range(long lba, long count)
+{
+    return lba >= 0 && count > 0 && lba + count <= (long)n_cylinders * n_sectors;
 }
 
 int diskfile_read(char *buffer, int *p_size, int max_size, int cylinder, int sector)
 {
     RET_ERR_IF(cylinder >= n_cylinders || sector >= n_sectors || cylinder < 0 || sector < 0, , INVALID_ARG_ERROR);
 
-    RET_ERR_IF(diskfile == NULL, , DEFAULT_ERROR);
-
     RET_ERR_IF(sector_size > max_size, , BUFFER_OVERFLOW);
 
-    long start = (cylinder * n_sectors + sector) * sector_size;
+    long start = ((long)cylinder * n_sectors + sector) * sector_size;
 
-    sem_wait(&diskfile_mutex);
-    arm_delay(disk_arm_loc, cylinder);
-    disk_arm_loc = cylinder;
-    printf("Read: cylinder = %d, sector = %d.\n", cylinder, sector);
-    memcpy(buffer, &diskfile[start], sector_size);
-    sem_post(&diskfile_mutex);
+    LOG_DEBUG("Read: cylinder = %d, sector = %d.\n", cylinder, sector);
+    struct sched_req_t req = {SCHED_OP_READ, start / sector_size, 1, -1};
+    disk_access_begin(&req);
+    int result = storage_read(buffer, start, sector_size);
+    disk_access_end(&req);
+    RET_ERR_RESULT(result);
 
     *p_size = sector_size;
     return sector_size;
@@ -83,26 +273,316 @@ int diskfile_write(char *buffer, int size, int cylinder, int sector)
 {
     RET_ERR_IF(cylinder >= n_cylinders || sector >= n_sectors || cylinder < 0 || sector < 0 || size < 0, , INVALID_ARG_ERROR);
 
-    RET_ERR_IF(diskfile == NULL, , DEFAULT_ERROR);
-
-    long filesize = n_cylinders * n_sectors * sector_size;
-    long start = (cylinder * n_sectors + sector) * sector_size;
+    long filesize = (long)n_cylinders * n_sectors * sector_size;
+    long start = ((long)cylinder * n_sectors + sector) * sector_size;
     long end = start + size;
     RET_ERR_IF(end > filesize, , INVALID_ARG_ERROR);
 
-    sem_wait(&diskfile_mutex);
-    arm_delay(disk_arm_loc, cylinder);
-    disk_arm_loc = cylinder;
-    printf("Write: cylinder = %d, sector = %d.\n", cylinder, sector);
-    memcpy(&diskfile[start], buffer, size);
-    sem_post(&diskfile_mutex);
+    int count = (size > sector_size) ? (size + sector_size - 1) / sector_size : 1;
+    LOG_DEBUG("Write: cylinder = %d, sector = %d.\n", cylinder, sector);
+    struct sched_req_t req = {SCHED_OP_WRITE, start / sector_size, count, -1};
+    disk_access_begin(&req);
+    int result = storage_write(buffer, start, size);
+    disk_access_end(&req);
+    RET_ERR_RESULT(result);
     return size;
 }
 
+// Reads count consecutive sectors starting at lba. The arm sweeps from the
+// first to the last cylinder of the range.
+int diskfile_read_sectors(char *buffer, int max_size, long lba, int count)
+{
+    RET_ERR_IF(!sectors_in_range(lba, count), , INVALID_ARG_ERROR);
+
+    RET_ERR_IF((long)count * sector_size > max_size, , BUFFER_OVERFLOW);
+
+    LOG_DEBUG("Read: lba = %ld, count = %d.\n", lba, count);
+    struct sched_req_t req = {SCHED_OP_READ, lba, count, -1};
+    disk_access_begin(&req);
+    int result = storage_read(buffer, lba * sector_size, count * sector_size);
+    disk_access_end(&req);
+    RET_ERR_RESULT(result);
+
+    return count * sector_size;
+}
+
+// Writes count consecutive sectors starting at lba.
+int diskfile_write_sectors(const char *buffer, long lba, int count)
+{
+    RET_ERR_IF(!sectors_in_range(lba, count), , INVALID_ARG_ERROR);
+
+    LOG_DEBUG("Write: lba = %ld, count = %d.\n", lba, count);
+    struct sched_req_t req = {SCHED_OP_WRITE, lba, count, -1};
+    disk_access_begin(&req);
+    int result = storage_write(buffer, lba * sector_size, count * sector_size);
+    disk_access_end(&req);
+    RET_ERR_RESULT(result);
+
+    return count * sector_size;
+}
+
+// Copies count sectors from src_lba to dst_lba without transferring them over
+// the network. The ranges may overlap.
+int diskfile_copy_sectors(long dst_lba, long src_lba, int count)
+{
+    RET_ERR_IF(!sectors_in_range(dst_lba, count) || !sectors_in_range(src_lba, count), , INVALID_ARG_ERROR);
+
+    LOG_DEBUG("Copy: lba = %ld, src = %ld, count = %d.\n", dst_lba, src_lba, count);
+    struct sched_req_t req = {SCHED_OP_OTHER, dst_lba, count, src_lba};
+    disk_access_begin(&req);
+    int result = storage_copy(dst_lba * sector_size, src_lba * sector_size, (long)count * sector_size);
+    disk_access_end(&req);
+    RET_ERR_RESULT(result);
+
+    return count * sector_size;
+}
+
+// Fills count sectors starting at lba with zeros.
+int diskfile_zero_sectors(long lba, int count)
+{
+    RET_ERR_IF(!sectors_in_range(lba, count), , INVALID_ARG_ERROR);
+
+    LOG_DEBUG("Zero: lba = %ld, count = %d.\n", lba, count);
+    struct sched_req_t req = {SCHED_OP_OTHER, lba, count, -1};
+    disk_access_begin(&req);
+    int result = storage_zero(lba * sector_size, (long)count * sector_size);
+    disk_access_end(&req);
+    RET_ERR_RESULT(result);
+
+    return count * sector_size;
+}
+
+// Returns once a sync that started after the call is over. Concurrent callers
+// share the same sync: the first one leads it, the others wait for it.
+int diskfile_group_sync()
+{
+    pthread_mutex_lock(&flush_mutex);
+    n_flushes++;
+    long target = n_syncs_started + 1;
+    while (n_syncs_done < target)
+    {
+        if (sync_leader)
+        {
+            pthread_cond_wait(&flush_cond, &flush_mutex);
+            continue;
+        }
+
+        // lead the next sync, after letting other flushes join it
+        sync_leader = true;
+        pthread_mutex_unlock(&flush_mutex);
+        usleep(flush_window_us);
+        pthread_mutex_lock(&flush_mutex);
+        long sync_id = ++n_syncs_started;
+        pthread_mutex_unlock(&flush_mutex);
+
+        int result = storage_sync();
+
+        pthread_mutex_lock(&flush_mutex);
+        sync_result = result;
+        n_syncs_done = sync_id;
+        sync_leader = false;
+        pthread_cond_broadcast(&flush_cond);
+    }
+    int result = sync_result;
+    pthread_mutex_unlock(&flush_mutex);
+    return result;
+}
+
+int diskfile_flush(bool barrier)
+{
+    LOG_DEBUG("Flush: barrier = %d.\n", barrier);
+    gate_enter(false);
+    if (barrier)
+    {
+        pthread_mutex_lock(&flush_mutex);
+        n_active_barriers++;
+        while (n_active_writes > 0)
+            pthread_cond_wait(&gate_cond, &flush_mutex);
+        pthread_mutex_unlock(&flush_mutex);
+    }
+
+    int result = diskfile_group_sync();
+
+    if (barrier)
+    {
+        pthread_mutex_lock(&flush_mutex);
+        n_active_barriers--;
+        if (n_active_barriers == 0)
+            pthread_cond_broadcast(&gate_cond);
+        pthread_mutex_unlock(&flush_mutex);
+    }
+    gate_leave(false);
+    return result;
+}
+
+// Discards count sectors starting at lba. They read as zeros afterwards.
+int diskfile_discard_sectors(long lba, int count)
+{
+    RET_ERR_IF(!sectors_in_range(lba, count), , INVALID_ARG_ERROR);
+
+    LOG_DEBUG("Discard: lba = %ld, count = %d.\n", lba, count);
+    struct sched_req_t req = {SCHED_OP_DISCARD, lba, count, -1};
+    disk_access_begin(&req);
+    int result = storage_discard(lba * sector_size, (long)count * sector_size);
+    disk_access_end(&req);
+    RET_ERR_RESULT(result);
+
+    return SUCCESS;
+}
+
+int vectored_read(const struct disk_msg_t *req, char *data, int *p_data_size, int max_data_size)
+{
+    RET_ERR_IF(req->count <= 0 || req->count > DISK_MAX_EXTENTS, , INVALID_ARG_ERROR);
+    RET_ERR_IF(req->payload_size != req->count * sizeof(struct disk_extent_t), , INVALID_ARG_ERROR);
+
+    struct disk_extent_t extents[DISK_MAX_EXTENTS];
+    disk_unpack_extents(req->payload, extents, req->count);
+
+    // an extent is bounded like a READ, so that its size cannot overflow
+    for (int i = 0; i < req->count; i++)
+        RET_ERR_IF(extents[i].count > DISK_MAX_SECTORS, , INVALID_ARG_ERROR);
+
+    int data_size = 0;
+    for (int i = 0; i < req->count; i++)
+    {
+        int result = diskfile_read_sectors(data + data_size, max_data_size - data_size, extents[i].lba, extents[i].count);
+        RET_ERR_RESULT(result);
+        data_size += result;
+    }
+    *p_data_size = data_size;
+    return data_size;
+}
+
+int vectored_write(const struct disk_msg_t *req)
+{
+    RET_ERR_IF(req->count <= 0 || req->count > DISK_MAX_EXTENTS, , INVALID_ARG_ERROR);
+    int extents_size = req->count * sizeof(struct disk_extent_t);
+    RET_ERR_IF(req->payload_size < extents_size, , INVALID_ARG_ERROR);
+
+    struct disk_extent_t extents[DISK_MAX_EXTENTS];
+    disk_unpack_extents(req->payload, extents, req->count);
+
+    // check the total size before writing anything
+    long data_size = 0;
+    for (int i = 0; i < req->count; i++)
+    {
+        RET_ERR_IF(extents[i].count > DISK_MAX_SECTORS, , INVALID_ARG_ERROR);
+        RET_ERR_IF(!sectors_in_range(extents[i].lba, extents[i].count), , INVALID_ARG_ERROR);
+        data_size += (long)extents[i].count * sector_size;
+    }
+    RET_ERR_IF(data_size != req->payload_size - extents_size, , INVALID_ARG_ERROR);
+
+    const char *data = req->payload + extents_size;
+    for (int i = 0; i < req->count; i++)
+    {
+        int result = diskfile_write_sectors(data, extents[i].lba, extents[i].count);
+        RET_ERR_RESULT(result);
+        data += result;
+    }
+    return data_size;
+}
+
+int vectored_discard(const struct disk_msg_t *req)
+{
+    RET_ERR_IF(req->count <= 0 || req->count > DISK_MAX_EXTENTS, , INVALID_ARG_ERROR);
+    RET_ERR_IF(req->payload_size != req->count * sizeof(struct disk_extent_t), , INVALID_ARG_ERROR);
+
+    struct disk_extent_t extents[DISK_MAX_EXTENTS];
+    disk_unpack_extents(req->payload, extents, req->count);
+
+    for (int i = 0; i < req->count; i++)
+    {
+        int result = diskfile_discard_sectors(extents[i].lba, extents[i].count);
+        RET_ERR_RESULT(result);
+    }
+    return SUCCESS;
+}
+
+int binary_response(const char *req_buffer, int req_size, char *res_buffer, int *p_res_size, int max_res_size)
+{
+    struct disk_msg_t req;
+    int result = disk_unpack_request(req_buffer, req_size, &req);
+    RET_ERR_RESULT(result);
+
+    // the data of the response is written in place, right after the header
+    struct disk_msg_t res = {req.opcode, 0, SUCCESS, 0, 0, 0, NULL, 0};
+    char *data = res_buffer + DISK_RES_HEADER_SIZE;
+    int max_data_size = max_res_size - DISK_RES_HEADER_SIZE;
+    RET_ERR_IF(max_data_size < 0, , BUFFER_OVERFLOW);
+
+    switch (req.opcode)
+    {
+    case DISK_OP_INFO:
+    {
+        u_int32_t geometry[2] = {htonl(n_cylinders), htonl(n_sectors)};
+        result = (max_data_size < sizeof(geometry)) ? BUFFER_OVERFLOW : SUCCESS;
+        if (!IS_ERROR(result))
+        {
+            memcpy(data, geometry, sizeof(geometry));
+            res.payload_size = sizeof(geometry);
+        }
+        break;
+    }
+    case DISK_OP_READ:
+        result = (req.count > DISK_MAX_SECTORS) ? INVALID_ARG_ERROR : diskfile_read_sectors(data, max_data_size, req.lba, req.count);
+        if (!IS_ERROR(result))
+            res.payload_size = result;
+        break;
+    case DISK_OP_WRITE:
+        result = (req.payload_size != (long)req.count * sector_size) ? INVALID_ARG_ERROR : diskfile_write_sectors(req.payload, req.lba, req.count);
+        break;
+    case DISK_OP_READV:
+        result = vectored_read(&req, data, &res.payload_size, max_data_size);
+        break;
+    case DISK_OP_WRITEV:
+        result = vectored_write(&req);
+        break;
+    case DISK_OP_COPY:
+        result = diskfile_copy_sectors(req.lba, req.arg, req.count);
+        break;
+    case DISK_OP_ZERO:
+        result = diskfile_zero_sectors(req.lba, req.count);
+        break;
+    case DISK_OP_DISCARD:
+        result = vectored_discard(&req);
+        break;
+    case DISK_OP_FLUSH:
+        result = diskfile_flush(req.flags & DISK_FLAG_BARRIER);
+        break;
+    default:
+        result = INVALID_ARG_ERROR;
+    }
+
+    if (IS_ERROR(result))
+    {
+        res.status = result;
+        res.payload_size = 0;
+    }
+    else
+    {
+        res.count = req.count;
+    }
+    return disk_pack_response(res_buffer, p_res_size, max_res_size, &res);
+}
+
 int response(int sockfd, const char *req_buffer, int req_size, char *res_buffer, int *p_res_size, int max_res_size)
 {
     int result;
-    if (starts_with(req_buffer, req_size, "I"))
+    stats_set_client(sockfd);
+    if (is_disk_message(req_buffer, req_size))
+    {
+        return binary_response(req_buffer, req_size, res_buffer, p_res_size, max_res_size);
+    }
+    else if (starts_with(req_buffer, req_size, "S"))
+    {
+        // stats -> res_buffer, formatted in place
+        result = stats_format(res_buffer, max_res_size);
+        RET_ERR_IF(IS_ERROR(result), , str_to_buffer("No", res_buffer, p_res_size, max_res_size));
+        *p_res_size = strlen(res_buffer);
+
+        return *p_res_size;
+    }
+    else if (starts_with(req_buffer, req_size, "I"))
     {
         // str
         char str[20];
@@ -117,31 +597,31 @@ int response(int sockfd, const char *req_buffer, int req_size, char *res_buffer,
     else if (starts_with(req_buffer, req_size, "R"))
     {
         // req_buffer -> req_str
-        char req_str[DEFAULT_BUFFER_CAPACITY];
-        result = buffer_to_str(req_buffer, req_size, req_str, DEFAULT_BUFFER_CAPACITY);
-        RET_ERR_RESULT(result); 
+        char *req_str = (char *)pool_alloc(req_size + 1);
+        RET_ERR_IF(req_str == NULL, , BAD_ALLOC_ERROR);
+        result = buffer_to_str(req_buffer, req_size, req_str, req_size + 1);
+        RET_ERR_IF(IS_ERROR(result), pool_free(req_str), result);
 
         // req_str -> cylinders, sector
         int cylinder, sector;
         result = sscanf(req_str, "R %d %d", &cylinder, &sector);
+        pool_free(req_str);
         RET_ERR_IF(result != 2, , str_to_buffer("No", res_buffer, p_res_size, max_res_size));
 
-        // cylinders, sector -> buffer
+        // cylinders, sector -> res_buffer, read in place after "Yes "
+        RET_ERR_IF(max_res_size < 4, , BUFFER_OVERFLOW);
         int size;
-        char buffer[DEFAULT_BUFFER_CAPACITY];
-        result = diskfile_read(buffer, &size, DEFAULT_BUFFER_CAPACITY, cylinder, sector);
+        result = diskfile_read(res_buffer + 4, &size, max_res_size - 4, cylinder, sector);
         RET_ERR_IF(IS_ERROR(result), , str_to_buffer("No", res_buffer, p_res_size, max_res_size));
-
-        // buffer -> res_buffer
-        result = concat_buffer(res_buffer, p_res_size, max_res_size, "Yes ", 4, buffer, size);
-        RET_ERR_RESULT(result); 
+        memcpy(res_buffer, "Yes ", 4);
+        *p_res_size = size + 4;
 
         return *p_res_size;
     }
     else if (starts_with(req_buffer, req_size, "W"))
     {
         // req_buffer -> req_str, data_buffer
-        char *req_str = (char *)malloc(req_size * sizeof(char));
+        char *req_str = (char *)pool_alloc(req_size);
         RET_ERR_IF(req_str == NULL, , BAD_ALLOC_ERROR);
         memcpy(req_str, req_buffer, req_size);
         
@@ -149,17 +629,17 @@ int response(int sockfd, const char *req_buffer, int req_size, char *res_buffer,
         int data_buffer_size;
         int req_str_size;
         int result = cut_at_n_space(req_str, req_size, 4, &data_buffer, &req_str_size, &data_buffer_size);
-        RET_ERR_IF(IS_ERROR(result), free(req_str), str_to_buffer("No", res_buffer, p_res_size, max_res_size));
+        RET_ERR_IF(IS_ERROR(result), pool_free(req_str), str_to_buffer("No", res_buffer, p_res_size, max_res_size));
 
         // req_str -> cylinder, sector, len
         int cylinder, sector, len;
         result = sscanf(req_str, "W %d %d %d", &cylinder, &sector, &len);
-        RET_ERR_IF(result != 3, free(req_str), str_to_buffer("No", res_buffer, p_res_size, max_res_size));
-        RET_ERR_IF(len != data_buffer_size, free(req_str), str_to_buffer("No", res_buffer, p_res_size, max_res_size));
+        RET_ERR_IF(result != 3, pool_free(req_str), str_to_buffer("No", res_buffer, p_res_size, max_res_size));
+        RET_ERR_IF(len != data_buffer_size, pool_free(req_str), str_to_buffer("No", res_buffer, p_res_size, max_res_size));
 
         // data_buffer, cylinder, sector -> diskfile_write()
         result = diskfile_write(data_buffer, data_buffer_size, cylinder, sector);
-        free(req_str);
+        pool_free(req_str);
         RET_ERR_IF(IS_ERROR(result), , str_to_buffer("No", res_buffer, p_res_size, max_res_size));
 
         return str_to_buffer("Yes", res_buffer, p_res_size, max_res_size);
@@ -170,22 +650,113 @@ int response(int sockfd, const char *req_buffer, int req_size, char *res_buffer,
     }
 }
 
+void print_stats()
+{
+    log_flush();
+    model_print_stats();
+    sched_print_stats();
+    pthread_mutex_lock(&flush_mutex);
+    if (n_flushes > 0)
+        printf("Stats: flushes = %ld, syncs = %ld.\n", n_flushes, n_syncs_done);
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+// SIGINT is blocked in every thread and taken here, so that the shutdown runs
+// outside a signal handler and waits for the locks held by other threads.
+void *sigint_waiter(void *arg)
+{
+    int sig;
+    sigwait((const sigset_t *)arg, &sig);
+    diskfile_drain();
+    print_stats();
+    sched_close();
+    diskfile_close();
+    exit(SUCCESS);
+}
+
 int main(int argc, char *argv[])
 {
-    EXIT_IF(argc != 6, , "Usage: %s <disk filename> <#cylinders> <#sector per cylinder> <track-to-track delay> <#port>\n", argv[0]);
+    const char *usage = "Usage: %s [-s none|fifo|sstf|scan|clook] [-w <max wait us>] [-c] [-r <rpm>] [-t <#track buffers>] [-g <group commit window us>] [-b mmap|direct|uring] [-v error|info|debug] [-o <stats file>] [-e <#workers>] [-l <unix socket path>] <disk filename> <#cylinders> <#sector per cylinder> <track-to-track delay> <#port>\n";
+    int max_wait_us = SCHED_DEFAULT_MAX_WAIT_US;
+    enum log_level_t level = LOG_LEVEL_INFO;
+    int n_workers = 0;
+    const char *shm_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:w:cr:t:g:b:v:o:e:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            EXIT_IF(IS_ERROR(parse_sched_policy(optarg, &sched_policy)), , "Error: Unknown scheduler '%s'.\n", optarg);
+            break;
+        case 'w':
+            max_wait_us = atoi(optarg);
+            break;
+        case 'c':
+            concurrent = true;
+            break;
+        case 'r':
+            rpm = atoi(optarg);
+            break;
+        case 't':
+            n_track_buffers = atoi(optarg);
+            break;
+        case 'g':
+            flush_window_us = atoi(optarg);
+            break;
+        case 'b':
+            EXIT_IF(IS_ERROR(parse_storage_backend(optarg, &backend)), , "Error: Unknown backend '%s'.\n", optarg);
+            break;
+        case 'v':
+            EXIT_IF(IS_ERROR(parse_log_level(optarg, &level)), , "Error: Unknown log level '%s'.\n", optarg);
+            break;
+        case 'o':
+            stats_filename = optarg;
+            break;
+        case 'e':
+            n_workers = atoi(optarg);
+            break;
+        case 'l':
+            shm_path = optarg;
+            break;
+        default:
+            EXIT_IF(true, , usage, argv[0]);
+        }
+    }
+    EXIT_IF(argc - optind != 5, , usage, argv[0]);
 
-    filename = argv[1];
-    n_cylinders = atoi(argv[2]);
-    n_sectors = atoi(argv[3]);
-    delay = atoi(argv[4]);
-    int port = atoi(argv[5]);
+    filename = argv[optind];
+    n_cylinders = atoi(argv[optind + 1]);
+    n_sectors = atoi(argv[optind + 2]);
+    delay = atoi(argv[optind + 3]);
+    int port = atoi(argv[optind + 4]);
 
     EXIT_IF(filename == NULL || filename[0] == '\0', , "Error: Invalid filename.\n");
-    EXIT_IF(n_cylinders <= 0 || n_sectors <= 0 || delay <= 0 || port <= 0, , "Error: Invalid arguments.\n");
+    EXIT_IF(n_cylinders <= 0 || n_sectors <= 0 || delay <= 0 || port <= 0 || max_wait_us <= 0 || rpm < 0 || n_track_buffers < 0 || flush_window_us < 0 || n_workers < 0, , "Error: Invalid arguments.\n");
+
+    // before any thread starts, so that all of them inherit the mask
+    static sigset_t sigint_set;
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint_set, NULL);
 
+    log_init(level);
     diskfile_init();
-    simple_server(port, response);
+    sched_init(sched_policy, n_sectors, max_wait_us, arm_serve, !concurrent);
+    pthread_t sigint_thread;
+    EXIT_IF(pthread_create(&sigint_thread, NULL, sigint_waiter, &sigint_set) != 0, , "Error: Could not start the signal thread.\n");
+    if (shm_path != NULL)
+        shm_server(shm_path, response);
+    // the FS pipelines small tagged requests, each response must go at once
+    server_set_nodelay(true);
+    if (n_workers > 0)
+        reactor_server(port, response, n_workers);
+    else
+        simple_server(port, response);
+    diskfile_drain();
+    print_stats();
+    sched_close();
     diskfile_close();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,148 @@
+#include "model.h"
+#include "common.h"
+#include "error_type.h"
+#include "stats.h"
+
+static int model_n_sectors = 1;
+static int seek_delay = 20;
+static long revolution_us = 0; // 0 if rotation is not modeled
+
+static int arm_cylinder = 0;
+
+// LRU track buffer, buffered_tracks[0] is the most recently used track
+static int *buffered_tracks = NULL;
+static int n_buffered_tracks = 0;
+static int max_buffered_tracks = 0;
+
+// statistics
+static long total_seek_distance = 0;
+static long n_seeks = 0;
+static long total_rotation_us = 0;
+static long n_buffer_hits = 0;
+static long n_accesses = 0;
+
+void model_init(int n_sectors, int delay, int rpm, int n_track_buffers)
+{
+    model_n_sectors = n_sectors;
+    seek_delay = delay;
+    revolution_us = (rpm > 0) ? 60000000L / rpm : 0;
+    arm_cylinder = 0;
+
+    max_buffered_tracks = n_track_buffers;
+    n_buffered_tracks = 0;
+    if (max_buffered_tracks > 0)
+    {
+        buffered_tracks = (int *)malloc(max_buffered_tracks * sizeof(int));
+        EXIT_IF(buffered_tracks == NULL, , "Error: Bad alloc.\n");
+    }
+    printf("Init: disk_arm_loc = cylinder 0.\n");
+    if (revolution_us > 0)
+        printf("Init: %d rpm, %ld us per revolution.\n", rpm, revolution_us);
+    if (max_buffered_tracks > 0)
+        printf("Init: track buffer of %d tracks.\n", max_buffered_tracks);
+}
+
+void model_close()
+{
+    if (buffered_tracks != NULL)
+        free(buffered_tracks);
+    buffered_tracks = NULL;
+}
+
+static bool track_buffered(int cylinder)
+{
+    for (int i = 0; i < n_buffered_tracks; i++)
+    {
+        if (buffered_tracks[i] == cylinder)
+            return true;
+    }
+    return false;
+}
+
+// Moves the track to the front of the buffer, evicting the least recently
+// used track if the buffer is full.
+static void track_buffer_touch(int cylinder)
+{
+    int i = 0;
+    while (i < n_buffered_tracks && buffered_tracks[i] != cylinder)
+        i++;
+    if (i == n_buffered_tracks)
+    {
+        if (n_buffered_tracks < max_buffered_tracks)
+            n_buffered_tracks++;
+        i = n_buffered_tracks - 1;
+    }
+    for (; i > 0; i--)
+        buffered_tracks[i] = buffered_tracks[i - 1];
+    buffered_tracks[0] = cylinder;
+}
+
+static long seek_to(int cylinder)
+{
+    int distance = abs(arm_cylinder - cylinder);
+    arm_cylinder = cylinder;
+    if (distance > 0)
+    {
+        total_seek_distance += distance;
+        n_seeks++;
+    }
+    return (long)seek_delay * distance;
+}
+
+// Returns the time needed, from time_us, until the sector passes under the
+// head.
+static long rotational_wait(int sector, long time_us)
+{
+    long offset = time_us % revolution_us;
+    long target = sector * revolution_us / model_n_sectors;
+    return (target - offset + revolution_us) % revolution_us;
+}
+
+// Accesses count sectors starting at lba, with the head available from
+// start_us. Moves the arm and returns the service time in microseconds.
+long model_access(bool read, long lba, int count, long start_us)
+{
+    int first_cylinder = lba / model_n_sectors;
+    int last_cylinder = (lba + count - 1) / model_n_sectors;
+    n_accesses++;
+
+    if (read && max_buffered_tracks > 0)
+    {
+        bool hit = true;
+        for (int cylinder = first_cylinder; cylinder <= last_cylinder && hit; cylinder++)
+            hit = track_buffered(cylinder);
+        if (hit)
+        {
+            for (int cylinder = first_cylinder; cylinder <= last_cylinder; cylinder++)
+                track_buffer_touch(cylinder);
+            n_buffer_hits++;
+            return 0;
+        }
+    }
+
+    stats_record_seek(abs(arm_cylinder - first_cylinder));
+    long service_us = seek_to(first_cylinder);
+    if (revolution_us > 0)
+    {
+        long wait_us = rotational_wait(lba % model_n_sectors, start_us + service_us);
+        total_rotation_us += wait_us;
+        service_us += wait_us + count * revolution_us / model_n_sectors;
+    }
+    service_us += seek_to(last_cylinder);
+
+    if (read)
+    {
+        for (int cylinder = first_cylinder; cylinder <= last_cylinder && max_buffered_tracks > 0; cylinder++)
+            track_buffer_touch(cylinder);
+    }
+    return service_us;
+}
+
+void model_print_stats()
+{
+    printf("Stats: total seek distance = %ld cylinders, seeks = %ld.\n", total_seek_distance, n_seeks);
+    if (revolution_us > 0)
+        printf("Stats: total rotational wait = %ld us.\n", total_rotation_us);
+    if (max_buffered_tracks > 0)
+        printf("Stats: track buffer hits = %ld of %ld accesses.\n", n_buffer_hits, n_accesses);
+}
@@ -0,0 +1,288 @@
+#include "scheduler.h"
+#include "common.h"
+#include "clock.h"
+#include "error_type.h"
+
+static enum sched_policy_t policy = SCHED_POLICY_NONE;
+static int n_sectors_per_cylinder = 1;
+static int max_wait = SCHED_DEFAULT_MAX_WAIT_US;
+static arm_serve_t serve = NULL;
+static bool exclusive = true;
+
+// pending requests in arrival order
+static struct sched_req_t *queue_head = NULL;
+static struct sched_req_t *queue_tail = NULL;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// the batch being served
+static int batch_remaining = 0;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t dispatcher_thread;
+static bool running = false;
+static int head = 0;      // cylinder of the arm, as seen by the scheduler
+static int direction = 1; // SCAN direction, 1 = towards higher cylinders
+
+// statistics
+static long n_requests = 0;
+static long n_batches = 0;
+static long n_merged = 0;
+static long n_promoted = 0;
+static long total_wait_us = 0;
+static long longest_wait_us = 0;
+
+static const char *policy_names[] = {"none", "fifo", "sstf", "scan", "clook"};
+
+int parse_sched_policy(const char *name, enum sched_policy_t *p_policy)
+{
+    for (int i = SCHED_POLICY_NONE; i <= SCHED_POLICY_CLOOK; i++)
+    {
+        if (strcmp(name, policy_names[i]) == 0)
+        {
+            *p_policy = i;
+            return SUCCESS;
+        }
+    }
+    return INVALID_ARG_ERROR;
+}
+
+const char *sched_policy_name(enum sched_policy_t policy)
+{
+    return policy_names[policy];
+}
+
+static int cylinder_of(const struct sched_req_t *req)
+{
+    // a copy starts by reading its source
+    long lba = (req->src_lba >= 0) ? req->src_lba : req->lba;
+    return lba / n_sectors_per_cylinder;
+}
+
+static void queue_remove(struct sched_req_t *req)
+{
+    if (req->prev != NULL)
+        req->prev->next = req->next;
+    else
+        queue_head = req->next;
+    if (req->next != NULL)
+        req->next->prev = req->prev;
+    else
+        queue_tail = req->prev;
+    req->prev = req->next = NULL;
+}
+
+// Picks the next request according to the policy. Must be called with
+// queue_mutex held and a non-empty queue.
+static struct sched_req_t *pick_next()
+{
+    // starvation bound: the oldest request is at the head of the queue
+    if (now_us() - queue_head->enqueue_us > max_wait)
+    {
+        n_promoted++;
+        return queue_head;
+    }
+
+    struct sched_req_t *best = NULL;
+    switch (policy)
+    {
+    case SCHED_POLICY_NONE:
+    case SCHED_POLICY_FIFO:
+        best = queue_head;
+        break;
+    case SCHED_POLICY_SSTF:
+        for (struct sched_req_t *req = queue_head; req != NULL; req = req->next)
+        {
+            if (best == NULL || abs(cylinder_of(req) - head) < abs(cylinder_of(best) - head))
+                best = req;
+        }
+        break;
+    case SCHED_POLICY_SCAN:
+        for (int turn = 0; turn < 2 && best == NULL; turn++)
+        {
+            for (struct sched_req_t *req = queue_head; req != NULL; req = req->next)
+            {
+                int distance = (cylinder_of(req) - head) * direction;
+                if (distance >= 0 && (best == NULL || distance < (cylinder_of(best) - head) * direction))
+                    best = req;
+            }
+            if (best == NULL)
+                direction = -direction;
+        }
+        break;
+    case SCHED_POLICY_CLOOK:
+    {
+        struct sched_req_t *lowest = NULL;
+        for (struct sched_req_t *req = queue_head; req != NULL; req = req->next)
+        {
+            int cylinder = cylinder_of(req);
+            if (cylinder >= head && (best == NULL || cylinder < cylinder_of(best)))
+                best = req;
+            if (lowest == NULL || cylinder < cylinder_of(lowest))
+                lowest = req;
+        }
+        if (best == NULL)
+            best = lowest;
+        break;
+    }
+    }
+    return best;
+}
+
+// Removes the first request and all queued requests adjacent to it from the
+// queue, and stores them in batch. Returns the size of the batch.
+static int collect_batch(struct sched_req_t *first, struct sched_req_t **batch, long *p_lo, long *p_hi)
+{
+    queue_remove(first);
+    batch[0] = first;
+    int n_batch = 1;
+    long lo = first->lba;
+    long hi = first->lba + first->count;
+
+    bool merged = first->op != SCHED_OP_OTHER && first->src_lba < 0;
+    while (merged && n_batch < SCHED_MAX_BATCH)
+    {
+        merged = false;
+        for (struct sched_req_t *req = queue_head; req != NULL; req = req->next)
+        {
+            if (req->op != first->op || req->src_lba >= 0)
+                continue;
+            if (req->lba + req->count == lo || req->lba == hi)
+            {
+                lo = (req->lba < lo) ? req->lba : lo;
+                hi = (req->lba + req->count > hi) ? req->lba + req->count : hi;
+                queue_remove(req);
+                batch[n_batch++] = req;
+                n_merged++;
+                merged = true;
+                break;
+            }
+        }
+    }
+    *p_lo = lo;
+    *p_hi = hi;
+    return n_batch;
+}
+
+static void *dispatcher(void *arg)
+{
+    struct sched_req_t *batch[SCHED_MAX_BATCH];
+    pthread_mutex_lock(&queue_mutex);
+    while (true)
+    {
+        while (running && queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        if (!running)
+            break;
+
+        struct sched_req_t *first = pick_next();
+        long lo, hi;
+        int n_batch = collect_batch(first, batch, &lo, &hi);
+
+        long now = now_us();
+        for (int i = 0; i < n_batch; i++)
+        {
+            batch[i]->start_us = now;
+            long wait = now - batch[i]->enqueue_us;
+            total_wait_us += wait;
+            longest_wait_us = (wait > longest_wait_us) ? wait : longest_wait_us;
+        }
+        n_batches++;
+        pthread_mutex_unlock(&queue_mutex);
+
+        // one sweep of the arm serves the whole batch
+        struct sched_req_t sweep = {first->op, lo, hi - lo, first->src_lba};
+        serve(&sweep);
+        if (first->op != SCHED_OP_DISCARD)
+            head = (hi - 1) / n_sectors_per_cylinder;
+
+        // grant the batch, and wait until all requests in it are completed,
+        // unless the transfers are protected by the callers themselves
+        pthread_mutex_lock(&queue_mutex);
+        batch_remaining = n_batch;
+        for (int i = 0; i < n_batch; i++)
+            sem_post(&batch[i]->granted);
+        while (exclusive && batch_remaining > 0)
+            pthread_cond_wait(&batch_cond, &queue_mutex);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return NULL;
+}
+
+void sched_init(enum sched_policy_t sched_policy, int n_sectors, int max_wait_us, arm_serve_t arm_serve, bool exclusive_batches)
+{
+    policy = sched_policy;
+    n_sectors_per_cylinder = n_sectors;
+    max_wait = max_wait_us;
+    serve = arm_serve;
+    exclusive = exclusive_batches;
+    head = 0;
+    direction = 1;
+    if (policy == SCHED_POLICY_NONE)
+        return;
+
+    running = true;
+    int result = pthread_create(&dispatcher_thread, NULL, dispatcher, NULL);
+    EXIT_IF(result != 0, , "Error: Could not create the dispatcher thread.\n");
+    printf("Init: scheduler = %s, max wait = %d us.\n", sched_policy_name(policy), max_wait);
+}
+
+void sched_close()
+{
+    if (policy == SCHED_POLICY_NONE || !running)
+        return;
+    pthread_mutex_lock(&queue_mutex);
+    running = false;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(dispatcher_thread, NULL);
+}
+
+// Queues the request and blocks until the arm has been moved over it. The
+// caller then owns its sectors until sched_complete().
+void sched_submit(struct sched_req_t *req)
+{
+    sem_init(&req->granted, 0, 0);
+    req->enqueue_us = now_us();
+    req->prev = req->next = NULL;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail == NULL)
+        queue_head = queue_tail = req;
+    else
+    {
+        req->prev = queue_tail;
+        queue_tail->next = req;
+        queue_tail = req;
+    }
+    n_requests++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+
+    sem_wait(&req->granted);
+}
+
+void sched_complete(struct sched_req_t *req)
+{
+    sem_destroy(&req->granted);
+    if (!exclusive)
+        return;
+    pthread_mutex_lock(&queue_mutex);
+    batch_remaining--;
+    if (batch_remaining == 0)
+        pthread_cond_signal(&batch_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+void sched_print_stats()
+{
+    if (policy == SCHED_POLICY_NONE)
+        return;
+    pthread_mutex_lock(&queue_mutex);
+    printf("Stats: scheduler = %s, requests = %ld, batches = %ld, merged = %ld, promoted = %ld.\n",
+           sched_policy_name(policy), n_requests, n_batches, n_merged, n_promoted);
+    long n_dispatched = n_batches + n_merged;
+    printf("Stats: average wait = %ld us, max wait = %ld us.\n",
+           (n_dispatched > 0) ? total_wait_us / n_dispatched : 0, longest_wait_us);
+    pthread_mutex_unlock(&queue_mutex);
+}
@@ -0,0 +1,338 @@
+#include "stats.h"
+#include "common.h"
+#include "clock.h"
+#include "error_type.h"
+#include "server.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+struct histogram_t
+{
+    atomic_long buckets[STATS_HISTOGRAM_BUCKETS];
+    atomic_long n_values;
+    atomic_long max_value;
+};
+
+struct client_stats_t
+{
+    char name[32]; // address:port of the client
+    atomic_long n_reads;
+    atomic_long n_read_sectors;
+    atomic_long n_writes;
+    atomic_long n_write_sectors;
+    atomic_long n_others;
+};
+
+static int stats_n_cylinders = 1;
+static int stats_n_sectors = 1;
+
+static struct histogram_t seek_histogram;
+static struct histogram_t wait_histogram;
+static struct histogram_t service_histogram;
+static atomic_long *cylinder_accesses = NULL;
+
+// clients[0] gathers the clients that do not fit in the table
+static struct client_stats_t clients[STATS_MAX_CLIENTS];
+static int n_clients = 1;
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct client_stats_t *thread_client = NULL;
+
+// client of the connection on every socket
+struct socket_client_t
+{
+    long connection_id;
+    struct client_stats_t *client;
+};
+static struct socket_client_t socket_clients[MAX_CLIENTS];
+
+static char *dump_file = NULL;
+static pthread_t dump_thread;
+static atomic_bool dumping = false;
+
+static void *dumper(void *arg);
+
+void stats_init(int n_cylinders, int n_sectors, const char *dump_filename)
+{
+    stats_n_cylinders = n_cylinders;
+    stats_n_sectors = n_sectors;
+    cylinder_accesses = (atomic_long *)calloc(n_cylinders, sizeof(atomic_long));
+    EXIT_IF(cylinder_accesses == NULL, , "Error: Bad alloc.\n");
+    strcpy(clients[0].name, "other");
+
+    if (dump_filename == NULL)
+        return;
+    dump_file = strdup(dump_filename);
+    EXIT_IF(dump_file == NULL, , "Error: Bad alloc.\n");
+    atomic_store(&dumping, true);
+    int result = pthread_create(&dump_thread, NULL, dumper, NULL);
+    EXIT_IF(result != 0, , "Error: Could not create the stats thread.\n");
+    printf("Init: stats are dumped to '%s'.\n", dump_file);
+}
+
+static int stats_dump();
+
+void stats_close()
+{
+    if (atomic_exchange(&dumping, false))
+    {
+        pthread_join(dump_thread, NULL);
+        stats_dump();
+    }
+    if (dump_file != NULL)
+        free(dump_file);
+    dump_file = NULL;
+    if (cylinder_accesses != NULL)
+        free(cylinder_accesses);
+    cylinder_accesses = NULL;
+}
+
+// Makes the peer of the socket the client of the requests of the calling
+// thread, until the next call. The reactor hands the requests of a connection
+// to several workers at once, so its entry is looked up and registered under
+// clients_mutex, and the connection is counted as one client.
+void stats_set_client(int sockfd)
+{
+    thread_client = NULL;
+    if (sockfd < 0 || sockfd >= MAX_CLIENTS)
+        return;
+    struct socket_client_t *socket_client = &socket_clients[sockfd];
+    long connection_id = server_connection_id(sockfd);
+    pthread_mutex_lock(&clients_mutex);
+    if (socket_client->connection_id == connection_id && socket_client->client != NULL)
+    {
+        thread_client = socket_client->client;
+        pthread_mutex_unlock(&clients_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    struct sockaddr_in addr;
+    socklen_t addr_size = sizeof(addr);
+    char name[32] = "unknown";
+    if (getpeername(sockfd, (struct sockaddr *)&addr, &addr_size) == 0)
+    {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+        snprintf(name, sizeof(name), "%s:%d", ip, ntohs(addr.sin_port));
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    // another worker may have registered the connection meanwhile
+    if (socket_client->connection_id != connection_id || socket_client->client == NULL)
+    {
+        struct client_stats_t *client = &clients[0];
+        if (n_clients < STATS_MAX_CLIENTS)
+        {
+            client = &clients[n_clients++];
+            strcpy(client->name, name);
+        }
+        socket_client->connection_id = connection_id;
+        socket_client->client = client;
+    }
+    thread_client = socket_client->client;
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+/*
+ * histograms
+ */
+
+static int bucket_of(long value)
+{
+    if (value < 8)
+        return (value < 0) ? 0 : value;
+    int exponent = 63 - __builtin_clzl(value);
+    int index = 8 + (exponent - 3) * 8 + ((value >> (exponent - 3)) & 7);
+    return (index < STATS_HISTOGRAM_BUCKETS) ? index : STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+// Returns the largest value of the bucket.
+static long bucket_top(int index)
+{
+    if (index < 8)
+        return index;
+    int exponent = (index - 8) / 8 + 3;
+    long step = 1L << (exponent - 3);
+    return (8 + (index - 8) % 8) * step + step - 1;
+}
+
+static void histogram_record(struct histogram_t *histogram, long value)
+{
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->n_values, 1, memory_order_relaxed);
+    long max_value = atomic_load_explicit(&histogram->max_value, memory_order_relaxed);
+    while (value > max_value && !atomic_compare_exchange_weak(&histogram->max_value, &max_value, value))
+        ;
+}
+
+// Returns the value below which a fraction per_mille / 1000 of the values
+// fall.
+static long histogram_percentile(struct histogram_t *histogram, long n_values, int per_mille)
+{
+    long rank = (n_values * per_mille + 999) / 1000;
+    long seen = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            long max_value = atomic_load(&histogram->max_value);
+            return (bucket_top(i) < max_value) ? bucket_top(i) : max_value;
+        }
+    }
+    return atomic_load(&histogram->max_value);
+}
+
+void stats_record_seek(int distance)
+{
+    histogram_record(&seek_histogram, distance);
+}
+
+void stats_record_request(const struct sched_req_t *req, long wait_us, long service_us)
+{
+    struct client_stats_t *client = (thread_client != NULL) ? thread_client : &clients[0];
+    switch (req->op)
+    {
+    case SCHED_OP_READ:
+        atomic_fetch_add_explicit(&client->n_reads, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&client->n_read_sectors, req->count, memory_order_relaxed);
+        break;
+    case SCHED_OP_WRITE:
+        atomic_fetch_add_explicit(&client->n_writes, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&client->n_write_sectors, req->count, memory_order_relaxed);
+        break;
+    default:
+        atomic_fetch_add_explicit(&client->n_others, 1, memory_order_relaxed);
+    }
+    histogram_record(&wait_histogram, wait_us);
+    histogram_record(&service_histogram, service_us);
+
+    // a discard does not move the arm
+    if (req->op == SCHED_OP_DISCARD)
+        return;
+    long lbas[2] = {req->lba, req->src_lba};
+    for (int i = 0; i < 2 && lbas[i] >= 0; i++)
+    {
+        int first_cylinder = lbas[i] / stats_n_sectors;
+        int last_cylinder = (lbas[i] + req->count - 1) / stats_n_sectors;
+        for (int cylinder = first_cylinder; cylinder <= last_cylinder && cylinder < stats_n_cylinders; cylinder++)
+            atomic_fetch_add_explicit(&cylinder_accesses[cylinder], 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * report
+ */
+
+static int append(char *buffer, int *p_size, int max_size, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int n_print = vsnprintf(buffer + *p_size, max_size - *p_size, format, args);
+    va_end(args);
+    RET_ERR_IF(n_print < 0 || n_print >= max_size - *p_size, , BUFFER_OVERFLOW);
+    *p_size += n_print;
+    return SUCCESS;
+}
+
+static int append_histogram(char *buffer, int *p_size, int max_size, const char *name, struct histogram_t *histogram)
+{
+    long n_values = atomic_load(&histogram->n_values);
+    if (n_values == 0)
+        return append(buffer, p_size, max_size, "%s: n = 0\n", name);
+    return append(buffer, p_size, max_size, "%s: n = %ld, p50 = %ld, p99 = %ld, p999 = %ld, max = %ld\n", name, n_values,
+                  histogram_percentile(histogram, n_values, 500), histogram_percentile(histogram, n_values, 990),
+                  histogram_percentile(histogram, n_values, 999), atomic_load(&histogram->max_value));
+}
+
+// Writes the statistics as text into buffer. Returns the length of the text.
+int stats_format(char *buffer, int max_size)
+{
+    RET_ERR_IF(max_size <= 0, , BUFFER_OVERFLOW);
+    int size = 0;
+    buffer[0] = '\0';
+
+    pthread_mutex_lock(&clients_mutex);
+    int n = n_clients;
+    pthread_mutex_unlock(&clients_mutex);
+    long totals[5] = {0};
+    for (int i = 0; i < n; i++)
+    {
+        totals[0] += atomic_load(&clients[i].n_reads);
+        totals[1] += atomic_load(&clients[i].n_read_sectors);
+        totals[2] += atomic_load(&clients[i].n_writes);
+        totals[3] += atomic_load(&clients[i].n_write_sectors);
+        totals[4] += atomic_load(&clients[i].n_others);
+    }
+    int result = append(buffer, &size, max_size, "requests: reads = %ld (%ld sectors), writes = %ld (%ld sectors), other = %ld\n",
+                        totals[0], totals[1], totals[2], totals[3], totals[4]);
+    RET_ERR_RESULT(result);
+    for (int i = 0; i < n; i++)
+    {
+        struct client_stats_t *client = &clients[i];
+        long n_others = atomic_load(&client->n_others);
+        long n_reads = atomic_load(&client->n_reads);
+        long n_writes = atomic_load(&client->n_writes);
+        if (n_reads + n_writes + n_others == 0)
+            continue;
+        result = append(buffer, &size, max_size, "client %s: reads = %ld (%ld sectors), writes = %ld (%ld sectors), other = %ld\n",
+                        client->name, n_reads, atomic_load(&client->n_read_sectors), n_writes, atomic_load(&client->n_write_sectors), n_others);
+        RET_ERR_RESULT(result);
+    }
+
+    result = append_histogram(buffer, &size, max_size, "seek distance (cylinders)", &seek_histogram);
+    RET_ERR_RESULT(result);
+    result = append_histogram(buffer, &size, max_size, "queue wait (us)", &wait_histogram);
+    RET_ERR_RESULT(result);
+    result = append_histogram(buffer, &size, max_size, "service time (us)", &service_histogram);
+    RET_ERR_RESULT(result);
+
+    int band_size = (stats_n_cylinders + STATS_HEATMAP_BANDS - 1) / STATS_HEATMAP_BANDS;
+    result = append(buffer, &size, max_size, "heatmap (%d cylinders per band):", band_size);
+    RET_ERR_RESULT(result);
+    for (int first = 0; first < stats_n_cylinders; first += band_size)
+    {
+        long n_accesses = 0;
+        for (int cylinder = first; cylinder < first + band_size && cylinder < stats_n_cylinders; cylinder++)
+            n_accesses += atomic_load_explicit(&cylinder_accesses[cylinder], memory_order_relaxed);
+        result = append(buffer, &size, max_size, " %ld", n_accesses);
+        RET_ERR_RESULT(result);
+    }
+    result = append(buffer, &size, max_size, "\n");
+    RET_ERR_RESULT(result);
+    return size;
+}
+
+// Replaces the dump file with the current statistics.
+static int stats_dump()
+{
+    char text[DEFAULT_BUFFER_CAPACITY];
+    int size = stats_format(text, sizeof(text));
+    RET_ERR_RESULT(size);
+
+    char tmp_file[PATH_MAX];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", dump_file);
+    FILE *file = fopen(tmp_file, "w");
+    RET_ERR_IF(file == NULL, , DEFAULT_ERROR);
+    size_t n_write = fwrite(text, 1, size, file);
+    fclose(file);
+    RET_ERR_IF(n_write != size, , WRITE_ERROR);
+    RET_ERR_IF(rename(tmp_file, dump_file) != 0, , WRITE_ERROR);
+    return SUCCESS;
+}
+
+static void *dumper(void *arg)
+{
+    // the signal handlers exit through stats_close(), which joins this thread
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (atomic_load(&dumping))
+    {
+        sleep_until_us(now_us() + STATS_DUMP_INTERVAL_US);
+        stats_dump();
+    }
+    return NULL;
+}
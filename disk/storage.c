@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+#include "storage.h"
+#include "common.h"
+#include "error_type.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+static enum storage_backend_t storage_backend = STORAGE_BACKEND_MMAP;
+static int storage_fd = -1;
+static long storage_size = 0;
+static char *storage_map = NULL;
+
+// aligned bounce buffers of the direct backends
+#define POOL_BUFFER_SIZE (STORAGE_CHUNK_SIZE + STORAGE_ALIGN)
+static char *pool_buffers[STORAGE_POOL_SIZE];
+static int pool_free[STORAGE_POOL_SIZE];
+static int n_pool_free = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+// serializes the read-modify-write of partially written blocks
+static pthread_mutex_t edge_locks[STORAGE_EDGE_LOCKS];
+
+static const char *backend_names[] = {"mmap", "direct", "uring"};
+
+int parse_storage_backend(const char *name, enum storage_backend_t *p_backend)
+{
+    for (int i = STORAGE_BACKEND_MMAP; i <= STORAGE_BACKEND_URING; i++)
+    {
+        if (strcmp(name, backend_names[i]) == 0)
+        {
+            *p_backend = i;
+            return SUCCESS;
+        }
+    }
+    return INVALID_ARG_ERROR;
+}
+
+const char *storage_backend_name(enum storage_backend_t backend)
+{
+    return backend_names[backend];
+}
+
+/*
+ *  io_uring, through the raw system calls. Each thread owns a ring, created on
+ *  its first transfer and destroyed when it exits, so no lock is needed around
+ *  the submission and completion queues.
+ */
+
+struct uring_t
+{
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    bool fixed_buffers;
+};
+
+static pthread_key_t uring_key;
+static __thread struct uring_t *thread_uring = NULL;
+
+static void uring_destroy(void *arg)
+{
+    struct uring_t *ring = (struct uring_t *)arg;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+static int uring_create(struct uring_t **p_ring)
+{
+    struct uring_t *ring = (struct uring_t *)calloc(1, sizeof(struct uring_t));
+    RET_ERR_IF(ring == NULL, , BAD_ALLOC_ERROR);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, STORAGE_URING_DEPTH, &params);
+    RET_ERR_IF(ring->fd < 0, free(ring), DEFAULT_ERROR);
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_size = ring->cq_size = (ring->sq_size > ring->cq_size) ? ring->sq_size : ring->cq_size;
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    RET_ERR_IF(ring->sq_ptr == MAP_FAILED, uring_destroy(ring), DEFAULT_ERROR);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        RET_ERR_IF(ring->cq_ptr == MAP_FAILED, uring_destroy(ring), DEFAULT_ERROR);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    RET_ERR_IF(ring->sqes == MAP_FAILED, uring_destroy(ring), DEFAULT_ERROR);
+
+    char *sq = (char *)ring->sq_ptr;
+    char *cq = (char *)ring->cq_ptr;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // the bounce buffers are registered, so that the kernel does not have to
+    // map them on every transfer
+    struct iovec iovecs[STORAGE_POOL_SIZE];
+    for (int i = 0; i < STORAGE_POOL_SIZE; i++)
+    {
+        iovecs[i].iov_base = pool_buffers[i];
+        iovecs[i].iov_len = POOL_BUFFER_SIZE;
+    }
+    int result = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, STORAGE_POOL_SIZE);
+    ring->fixed_buffers = result == 0;
+    *p_ring = ring;
+    return SUCCESS;
+}
+
+// Returns the ring of the calling thread, or NULL if io_uring is unavailable.
+static struct uring_t *uring_get()
+{
+    if (thread_uring == NULL && !IS_ERROR(uring_create(&thread_uring)))
+        pthread_setspecific(uring_key, thread_uring);
+    return thread_uring;
+}
+
+// Submits one transfer between the pool buffer buffer_index and the file, and
+// waits for its completion. Returns the number of bytes transferred, or
+// -errno.
+static int uring_transfer(struct uring_t *ring, bool write, int buffer_index, char *buffer, int size, long offset)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (ring->fixed_buffers)
+    {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buffer_index;
+    }
+    else
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = storage_fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int to_submit = 1;
+    while (true)
+    {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            int res = ring->cqes[head & *ring->cq_mask].res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return res;
+        }
+        int result = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result < 0 && errno != EINTR)
+            return -errno;
+        if (result > 0)
+            to_submit = 0;
+    }
+}
+
+/*
+ *  Direct backends
+ */
+
+static int pool_get()
+{
+    pthread_mutex_lock(&pool_mutex);
+    while (n_pool_free == 0)
+        pthread_cond_wait(&pool_cond, &pool_mutex);
+    int index = pool_free[--n_pool_free];
+    pthread_mutex_unlock(&pool_mutex);
+    return index;
+}
+
+static void pool_put(int index)
+{
+    pthread_mutex_lock(&pool_mutex);
+    pool_free[n_pool_free++] = index;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Transfers size aligned bytes between the pool buffer, from position, and
+// the file. Reads past the end of the file return zeros.
+static int direct_transfer(bool write, int buffer_index, int position, long offset, int size)
+{
+    char *buffer = pool_buffers[buffer_index] + position;
+    struct uring_t *ring = (storage_backend == STORAGE_BACKEND_URING) ? uring_get() : NULL;
+    int done = 0;
+    while (done < size)
+    {
+        int result;
+        if (ring != NULL)
+            result = uring_transfer(ring, write, buffer_index, buffer + done, size - done, offset + done);
+        else
+        {
+            result = write ? pwrite(storage_fd, buffer + done, size - done, offset + done)
+                           : pread(storage_fd, buffer + done, size - done, offset + done);
+            if (result < 0)
+                result = -errno;
+        }
+        if (result == -EINTR || result == -EAGAIN)
+            continue;
+        RET_ERR_IF(result < 0, , write ? WRITE_ERROR : READ_ERROR);
+        if (result == 0)
+        {
+            RET_ERR_IF(write, , WRITE_ERROR);
+            memset(buffer + done, 0, size - done);
+            break;
+        }
+        done += result;
+    }
+    return SUCCESS;
+}
+
+static long align_down(long offset)
+{
+    return offset / STORAGE_ALIGN * STORAGE_ALIGN;
+}
+
+static long align_up(long offset)
+{
+    return (offset + STORAGE_ALIGN - 1) / STORAGE_ALIGN * STORAGE_ALIGN;
+}
+
+static pthread_mutex_t *edge_lock(long aligned_offset)
+{
+    return &edge_locks[(aligned_offset / STORAGE_ALIGN) % STORAGE_EDGE_LOCKS];
+}
+
+// Reads at most STORAGE_CHUNK_SIZE bytes.
+static int direct_read_chunk(char *buffer, long offset, int size)
+{
+    long lo = align_down(offset);
+    long hi = align_up(offset + size);
+    int index = pool_get();
+    int result = direct_transfer(false, index, 0, lo, hi - lo);
+    if (!IS_ERROR(result))
+        memcpy(buffer, pool_buffers[index] + (offset - lo), size);
+    pool_put(index);
+    return result;
+}
+
+// Writes at most STORAGE_CHUNK_SIZE bytes. The partial blocks at the edges are
+// read first, under their edge locks.
+static int direct_write_chunk(const char *buffer, long offset, int size)
+{
+    long lo = align_down(offset);
+    long hi = align_up(offset + size);
+    bool partial_head = offset != lo;
+    bool partial_tail = offset + size != hi;
+    pthread_mutex_t *head_lock = partial_head ? edge_lock(lo) : NULL;
+    pthread_mutex_t *tail_lock = partial_tail ? edge_lock(hi - STORAGE_ALIGN) : NULL;
+    if (tail_lock == head_lock)
+        tail_lock = NULL;
+
+    // in ascending order of the stripes
+    if (head_lock != NULL && tail_lock != NULL && tail_lock < head_lock)
+    {
+        pthread_mutex_t *tmp = head_lock;
+        head_lock = tail_lock;
+        tail_lock = tmp;
+    }
+    if (head_lock != NULL)
+        pthread_mutex_lock(head_lock);
+    if (tail_lock != NULL)
+        pthread_mutex_lock(tail_lock);
+
+    int index = pool_get();
+    char *bounce = pool_buffers[index];
+    int result = SUCCESS;
+    if (partial_head)
+        result = direct_transfer(false, index, 0, lo, STORAGE_ALIGN);
+    if (!IS_ERROR(result) && partial_tail && (hi - STORAGE_ALIGN != lo || !partial_head))
+        result = direct_transfer(false, index, hi - STORAGE_ALIGN - lo, hi - STORAGE_ALIGN, STORAGE_ALIGN);
+    if (!IS_ERROR(result))
+    {
+        memcpy(bounce + (offset - lo), buffer, size);
+        result = direct_transfer(true, index, 0, lo, hi - lo);
+    }
+    pool_put(index);
+
+    if (tail_lock != NULL)
+        pthread_mutex_unlock(tail_lock);
+    if (head_lock != NULL)
+        pthread_mutex_unlock(head_lock);
+    return result;
+}
+
+/*
+ *  Interface
+ */
+
+void storage_init(const char *filename, long size, enum storage_backend_t backend)
+{
+    storage_backend = backend;
+    storage_size = size;
+
+    int flags = O_RDWR | O_CREAT;
+    if (backend != STORAGE_BACKEND_MMAP)
+    {
+        storage_fd = open(filename, flags | O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (storage_fd < 0 && errno == EINVAL)
+            printf("Init: O_DIRECT is not supported for '%s', using the page cache.\n", filename);
+    }
+    if (storage_fd < 0)
+        storage_fd = open(filename, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    EXIT_IF(storage_fd < 0, , "Error: Could not open file '%s'.\n", filename);
+
+    // stretch the file, to a whole number of aligned blocks for the direct
+    // backends, without touching existing data
+    long file_size = (backend == STORAGE_BACKEND_MMAP) ? size : align_up(size);
+    struct stat st;
+    int result = fstat(storage_fd, &st);
+    EXIT_IF(result < 0, close(storage_fd), "Error: Could not stat file '%s'.\n", filename);
+    if (st.st_size < file_size)
+    {
+        result = ftruncate(storage_fd, file_size);
+        EXIT_IF(result < 0, close(storage_fd), "Error: Could not stretch file '%s'.\n", filename);
+    }
+
+    if (backend == STORAGE_BACKEND_MMAP)
+    {
+        storage_map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, storage_fd, 0);
+        EXIT_IF(storage_map == MAP_FAILED, close(storage_fd), "Error: Could not map file '%s'.\n", filename);
+        printf("Init: backend = mmap.\n");
+        return;
+    }
+
+    for (int i = 0; i < STORAGE_POOL_SIZE; i++)
+    {
+        result = posix_memalign((void **)&pool_buffers[i], STORAGE_ALIGN, POOL_BUFFER_SIZE);
+        EXIT_IF(result != 0, close(storage_fd), "Error: Bad alloc.\n");
+        pool_free[i] = i;
+    }
+    n_pool_free = STORAGE_POOL_SIZE;
+    for (int i = 0; i < STORAGE_EDGE_LOCKS; i++)
+        pthread_mutex_init(&edge_locks[i], NULL);
+
+    if (backend == STORAGE_BACKEND_URING)
+    {
+        pthread_key_create(&uring_key, uring_destroy);
+        if (uring_get() == NULL)
+        {
+            printf("Init: io_uring is not available, using pread/pwrite.\n");
+            storage_backend = STORAGE_BACKEND_DIRECT;
+        }
+    }
+    printf("Init: backend = %s, %d bounce buffers of %d bytes.\n", storage_backend_name(storage_backend), STORAGE_POOL_SIZE, POOL_BUFFER_SIZE);
+}
+
+void storage_close()
+{
+    if (storage_map != NULL)
+    {
+        munmap(storage_map, storage_size);
+        storage_map = NULL;
+    }
+    if (storage_backend == STORAGE_BACKEND_URING && thread_uring != NULL)
+    {
+        pthread_setspecific(uring_key, NULL);
+        uring_destroy(thread_uring);
+        thread_uring = NULL;
+    }
+    if (storage_backend != STORAGE_BACKEND_MMAP)
+    {
+        for (int i = 0; i < STORAGE_POOL_SIZE; i++)
+            free(pool_buffers[i]);
+        n_pool_free = 0;
+    }
+    if (storage_fd >= 0)
+        close(storage_fd);
+    storage_fd = -1;
+}
+
+int storage_read(char *buffer, long offset, long size)
+{
+    RET_ERR_IF(storage_fd < 0, , DEFAULT_ERROR);
+    RET_ERR_IF(offset < 0 || size < 0 || offset + size > storage_size, , INVALID_ARG_ERROR);
+
+    if (storage_backend == STORAGE_BACKEND_MMAP)
+    {
+        memcpy(buffer, &storage_map[offset], size);
+        return SUCCESS;
+    }
+    for (long done = 0; done < size; done += STORAGE_CHUNK_SIZE)
+    {
+        int chunk = (size - done < STORAGE_CHUNK_SIZE) ? size - done : STORAGE_CHUNK_SIZE;
+        int result = direct_read_chunk(buffer + done, offset + done, chunk);
+        RET_ERR_RESULT(result);
+    }
+    return SUCCESS;
+}
+
+int storage_write(const char *buffer, long offset, long size)
+{
+    RET_ERR_IF(storage_fd < 0, , DEFAULT_ERROR);
+    RET_ERR_IF(offset < 0 || size < 0 || offset + size > storage_size, , INVALID_ARG_ERROR);
+
+    if (storage_backend == STORAGE_BACKEND_MMAP)
+    {
+        memcpy(&storage_map[offset], buffer, size);
+        return SUCCESS;
+    }
+    for (long done = 0; done < size; done += STORAGE_CHUNK_SIZE)
+    {
+        int chunk = (size - done < STORAGE_CHUNK_SIZE) ? size - done : STORAGE_CHUNK_SIZE;
+        int result = direct_write_chunk(buffer + done, offset + done, chunk);
+        RET_ERR_RESULT(result);
+    }
+    return SUCCESS;
+}
+
+// Copies size bytes from src_offset to dst_offset. The ranges may overlap.
+int storage_copy(long dst_offset, long src_offset, long size)
+{
+    RET_ERR_IF(storage_fd < 0, , DEFAULT_ERROR);
+    RET_ERR_IF(dst_offset < 0 || src_offset < 0 || size < 0, , INVALID_ARG_ERROR);
+    RET_ERR_IF(dst_offset + size > storage_size || src_offset + size > storage_size, , INVALID_ARG_ERROR);
+
+    if (storage_backend == STORAGE_BACKEND_MMAP)
+    {
+        memmove(&storage_map[dst_offset], &storage_map[src_offset], size);
+        return SUCCESS;
+    }
+
+    char *buffer = (char *)malloc(STORAGE_CHUNK_SIZE);
+    RET_ERR_IF(buffer == NULL, , BAD_ALLOC_ERROR);
+
+    // backwards if the destination overlaps the end of the source
+    bool backwards = dst_offset > src_offset && dst_offset < src_offset + size;
+    for (long done = 0; done < size; done += STORAGE_CHUNK_SIZE)
+    {
+        int chunk = (size - done < STORAGE_CHUNK_SIZE) ? size - done : STORAGE_CHUNK_SIZE;
+        long position = backwards ? size - done - chunk : done;
+        int result = direct_read_chunk(buffer, src_offset + position, chunk);
+        if (!IS_ERROR(result))
+            result = direct_write_chunk(buffer, dst_offset + position, chunk);
+        RET_ERR_IF(IS_ERROR(result), free(buffer), result);
+    }
+    free(buffer);
+    return SUCCESS;
+}
+
+int storage_zero(long offset, long size)
+{
+    RET_ERR_IF(storage_fd < 0, , DEFAULT_ERROR);
+    RET_ERR_IF(offset < 0 || size < 0 || offset + size > storage_size, , INVALID_ARG_ERROR);
+
+    if (storage_backend == STORAGE_BACKEND_MMAP)
+    {
+        memset(&storage_map[offset], 0, size);
+        return SUCCESS;
+    }
+
+    static const char zeros[STORAGE_CHUNK_SIZE];
+    for (long done = 0; done < size; done += STORAGE_CHUNK_SIZE)
+    {
+        int chunk = (size - done < STORAGE_CHUNK_SIZE) ? size - done : STORAGE_CHUNK_SIZE;
+        int result = direct_write_chunk(zeros, offset + done, chunk);
+        RET_ERR_RESULT(result);
+    }
+    return SUCCESS;
+}
+
+// Zeros size bytes from offset, and punches the aligned blocks they cover out
+// of the file. The partial blocks at the edges are zeroed like a write, so that
+// they do not race with the read-modify-write of neighbouring sectors.
+int storage_discard(long offset, long size)
+{
+    RET_ERR_IF(storage_fd < 0, , DEFAULT_ERROR);
+    RET_ERR_IF(offset < 0 || size < 0 || offset + size > storage_size, , INVALID_ARG_ERROR);
+
+    long lo = align_up(offset);
+    long hi = align_down(offset + size);
+    if (lo >= hi)
+        return storage_zero(offset, size);
+
+    int result = fallocate(storage_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, lo, hi - lo);
+    if (result < 0)
+        return storage_zero(offset, size);
+    result = storage_zero(offset, lo - offset);
+    RET_ERR_RESULT(result);
+    return storage_zero(hi, offset + size - hi);
+}
+
+// Makes all completed writes durable.
+int storage_sync()
+{
+    RET_ERR_IF(storage_fd < 0, , DEFAULT_ERROR);
+
+    int result;
+    if (storage_backend == STORAGE_BACKEND_MMAP)
+        result = msync(storage_map, storage_size, MS_SYNC);
+    else
+        result = fdatasync(storage_fd);
+    RET_ERR_IF(result < 0, , WRITE_ERROR);
+    return SUCCESS;
+}
@@ -17,23 +17,36 @@ int get_request(char *req_buffer, int *p_req_size, int max_req_size, int cycle)
     return *p_req_size;
 }
 
-int handle_response(const char *res_buffer, int res_size, int cycle)
+// Prints the response chunk by chunk as it comes, null bytes as spaces.
+int handle_response(const char *res_buffer, int res_size, int cycle, bool more)
 {
-    char res_str[DEFAULT_BUFFER_CAPACITY];
-    int result;
-    result = buffer_to_str(res_buffer, res_size, res_str, DEFAULT_BUFFER_CAPACITY);
-    RET_ERR_RESULT(result);
-    printf("%s\n", res_str);
+    for (int i = 0; i < res_size; i++)
+        putchar(res_buffer[i] != '\0' ? res_buffer[i] : ' ');
+    if (!more)
+        putchar('\n');
     return res_size;
 }
 
 int main(int argc, char *argv[])
 {
-
-    EXIT_IF(argc != 3, , "Usage: %s <server_ip> <port>\n", argv[0]);
-
-    const char *server_ip = argv[1];
-    int port = atoi(argv[2]);
+    const char *usage = "Usage: %s [-z] <server_ip> <port>\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "z")) != -1)
+    {
+        switch (opt)
+        {
+        case 'z':
+            // compress large requests and responses on the way
+            client_set_compression(true);
+            break;
+        default:
+            EXIT_IF(true, , usage, argv[0]);
+        }
+    }
+    EXIT_IF(argc - optind != 2, , usage, argv[0]);
+
+    const char *server_ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
 
     simple_client(server_ip, port, get_request, handle_response);
 
@@ -3,9 +3,9 @@
 #include "error_type.h"
 #include "server.h"
 #include "buffer.h"
+#include "log.h"
 
 struct context_t contexts[MAX_CLIENTS]; // contexts[0] used as internal context
-sem_t response_mutex;
 
 int response(int sockfd, const char *req_buffer, int req_size, char *res_buffer, int *p_res_size, int max_res_size)
 {
@@ -78,6 +78,11 @@ int response(int sockfd, const char *req_buffer, int req_size, char *res_buffer,
         struct response_arg_t arg = {&contexts[sockfd], res_buffer, p_res_size, max_res_size, req_buffer + 6, req_size - 6};
         return fs_operation_wrapper(chmod_file, arg, WRITE_AUTH);
     }
+    else if (starts_with(req_buffer, req_size, "sync"))
+    {
+        struct response_arg_t arg = {&contexts[sockfd], res_buffer, p_res_size, max_res_size, req_buffer + 4, req_size - 4};
+        return fs_sync(arg);
+    }
     else if (starts_with(req_buffer, req_size, "e"))
     {
         return DEFAULT_ERROR;
@@ -103,11 +108,95 @@ void handle_sigint(int sig)
     exit(SUCCESS);
 }
 
+// Parses "<address>:<port>" into a disk endpoint. The address is cut out of
+// str in place. A path to the Unix-domain socket of a disk server on the same
+// host needs no port.
+int parse_endpoint(char *str, struct disk_endpoint_t *endpoint)
+{
+    if (str[0] == '/')
+    {
+        endpoint->ip = str;
+        endpoint->port = 0;
+        return SUCCESS;
+    }
+    char *colon = strrchr(str, ':');
+    RET_ERR_IF(colon == NULL, , INVALID_ARG_ERROR);
+    *colon = '\0';
+    endpoint->ip = str;
+    endpoint->port = atoi(colon + 1);
+    RET_ERR_IF(endpoint->port <= 0, , INVALID_ARG_ERROR);
+    return SUCCESS;
+}
+
+// Parses a cache size, in blocks, or in bytes with a suffix K, M or G.
+int parse_cache_size(const char *str, int *p_blocks)
+{
+    char *end;
+    long long size = strtoll(str, &end, 10);
+    RET_ERR_IF(end == str || size <= 0 || size > DISK_MAX_CACHE_SIZE * (long long)BLOCK_SIZE, , INVALID_ARG_ERROR);
+    if (*end != '\0')
+    {
+        const char *suffixes = "KMG";
+        const char *suffix = strchr(suffixes, *end);
+        RET_ERR_IF(suffix == NULL || end[1] != '\0', , INVALID_ARG_ERROR);
+        size = (size << (10 * (suffix - suffixes + 1))) / BLOCK_SIZE;
+    }
+    RET_ERR_IF(size <= 0 || size > DISK_MAX_CACHE_SIZE, , INVALID_ARG_ERROR);
+    *p_blocks = (int)size;
+    return SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
-    EXIT_IF(argc != 4, , "Usage: %s <disk server address> <#disk port> <#fs port>\n", argv[0]);
+    const char *usage = "Usage: %s [-d <disk server address>:<#disk port>|<disk server socket path>]... [-u <stripe unit>] [-m nearest|load] [-c <cache size>[K|M|G]] [-v error|info|debug] [-e <#workers>] <disk server address> <#disk port> <#fs port>\n";
+    struct disk_config_t config;
+    config.n_servers = 1;
+    config.stripe_unit = DISK_DEFAULT_STRIPE_UNIT;
+    config.mirror = DISK_MIRROR_NONE;
+    config.cache_size = DISK_DEFAULT_CACHE_SIZE;
+    enum log_level_t level = LOG_LEVEL_INFO;
+    int n_workers = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:u:m:c:v:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            EXIT_IF(config.n_servers == DISK_MAX_SERVERS, , "Error: Too many disk servers.\n");
+            EXIT_IF(IS_ERROR(parse_endpoint(optarg, &config.servers[config.n_servers])), , "Error: Invalid disk server '%s'.\n", optarg);
+            config.n_servers++;
+            break;
+        case 'u':
+            config.stripe_unit = atoi(optarg);
+            break;
+        case 'm':
+            EXIT_IF(IS_ERROR(parse_disk_mirror(optarg, &config.mirror)) || config.mirror == DISK_MIRROR_NONE, ,
+                    "Error: Invalid read policy '%s'.\n", optarg);
+            break;
+        case 'c':
+            EXIT_IF(IS_ERROR(parse_cache_size(optarg, &config.cache_size)), , "Error: Invalid cache size '%s'.\n", optarg);
+            break;
+        case 'v':
+            EXIT_IF(IS_ERROR(parse_log_level(optarg, &level)), , "Error: Unknown log level '%s'.\n", optarg);
+            break;
+        case 'e':
+            n_workers = atoi(optarg);
+            EXIT_IF(n_workers <= 0, , "Error: Invalid number of workers.\n");
+            break;
+        default:
+            EXIT_IF(true, , usage, argv[0]);
+        }
+    }
+    EXIT_IF(argc - optind != 3, , usage, argv[0]);
+    EXIT_IF(config.stripe_unit <= 0, , "Error: Invalid stripe unit.\n");
 
-    fs_init(argv[1], atoi(argv[2]));
+    // the positional disk server comes first
+    config.servers[0].ip = argv[optind];
+    config.servers[0].port = atoi(argv[optind + 1]);
+    int port = atoi(argv[optind + 2]);
+
+    log_init(level);
+    fs_init(&config);
     sem_init(&response_mutex, 0, 1);
     // fs_format();
 
@@ -120,7 +209,10 @@ int main(int argc, char *argv[])
 
     signal(SIGINT, handle_sigint);
 
-    simple_server(atoi(argv[3]), response_with_mutex);
+    if (n_workers > 0)
+        reactor_server(port, response_with_mutex, n_workers);
+    else
+        simple_server(port, response_with_mutex);
 
     sem_destroy(&response_mutex);
     fs_close();
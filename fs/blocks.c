@@ -2,6 +2,7 @@
 #include "common.h"
 #include "disk.h"
 #include "error_type.h"
+#include "log.h"
 
 /*
  * buffer
@@ -17,17 +18,124 @@ static struct superblock_t superblock;
 int least_block_bitmap_block = BLOCK_BITMAP_PTR;
 int least_inode_bitmap_block = INODE_BITMAP_PTR;
 
+/*
+ * discard
+ */
+
+// freed data blocks not yet discarded on the disk server, as extents of disk
+// blocks, sent in one request once the batch is full
+static struct disk_extent_t pending_discards[DISK_MAX_EXTENTS];
+static int n_pending_discards = 0;
+
+int discard_flush()
+{
+    if (n_pending_discards == 0)
+        return SUCCESS;
+    int result = disk_discard(pending_discards, n_pending_discards);
+    n_pending_discards = 0;
+    return result;
+}
+
+// Queues the block for discarding. Its cached copy is dropped right away.
+int discard_queue(int block)
+{
+    disk_invalidate(block, 1);
+
+    if (n_pending_discards > 0)
+    {
+        struct disk_extent_t *last = &pending_discards[n_pending_discards - 1];
+        if (last->lba + last->count == block)
+        {
+            last->count++;
+            return SUCCESS;
+        }
+    }
+    if (n_pending_discards == DISK_MAX_EXTENTS)
+    {
+        int result = discard_flush();
+        RET_ERR_RESULT(result);
+    }
+    pending_discards[n_pending_discards].lba = block;
+    pending_discards[n_pending_discards].count = 1;
+    n_pending_discards++;
+    return SUCCESS;
+}
+
+// Removes a reallocated block from the pending discards, so that its new
+// content is not discarded.
+int discard_cancel(int block)
+{
+    for (int i = 0; i < n_pending_discards; i++)
+    {
+        struct disk_extent_t *extent = &pending_discards[i];
+        if (block < extent->lba || block >= extent->lba + extent->count)
+            continue;
+
+        if (extent->count == 1)
+            *extent = pending_discards[--n_pending_discards];
+        else if (block == extent->lba)
+        {
+            extent->lba++;
+            extent->count--;
+        }
+        else if (block == extent->lba + extent->count - 1)
+            extent->count--;
+        else if (n_pending_discards < DISK_MAX_EXTENTS)
+        {
+            // split the extent around the block
+            pending_discards[n_pending_discards].lba = block + 1;
+            pending_discards[n_pending_discards].count = extent->lba + extent->count - block - 1;
+            n_pending_discards++;
+            extent->count = block - extent->lba;
+        }
+        else
+        {
+            // no room to split, discard the part before the block now
+            struct disk_extent_t head = {extent->lba, block - extent->lba};
+            extent->count -= block + 1 - extent->lba;
+            extent->lba = block + 1;
+            return disk_discard(&head, 1);
+        }
+        return SUCCESS;
+    }
+    return SUCCESS;
+}
+
+/*
+ * superblock
+ */
+
+// Writes the superblock through the cache whenever its counts change, so that
+// the flusher of the disk persists it along with the bitmaps.
+int superblock_write()
+{
+    return disk_write((char *)&superblock, SUPERBLOCK_PTR);
+}
+
 /*
  * init & close
  */
 
 void blocks_close()
 {
-    int result = disk_write((char *)&superblock, SUPERBLOCK_PTR);
+    int result = discard_flush();
+    EXIT_IF(IS_ERROR(result), disk_close(), "FATAL: could not discard freed blocks.\n");
+    result = superblock_write();
     EXIT_IF(IS_ERROR(result), disk_close(), "FATAL: could not write superblock.\n");
     disk_close();
 }
 
+// Makes everything written so far durable: the pending discards, the
+// superblock and the dirty cached blocks.
+int blocks_sync()
+{
+    int result = discard_flush();
+    RET_ERR_RESULT(result);
+    result = superblock_write();
+    RET_ERR_RESULT(result);
+    return disk_flush();
+}
+
 int blocks_format()
 {
     superblock.block_size = BLOCK_SIZE;
@@ -38,21 +146,18 @@ int blocks_format()
     superblock.inode_table_ptr = INODE_TABLE_PTR;
     superblock.data_blocks_ptr = DATA_BLOCKS_PTR;
 
-    int result;
-    char zeros[256];
-    for (int i = 0; i < 256; i++)
-    {
-        zeros[i] = 0;
-    }
+    // clear both bitmaps with a single server-side zero-fill
+    int result = disk_zero(BLOCK_BITMAP_PTR, INODE_BITMAP_END - BLOCK_BITMAP_PTR);
+    RET_ERR_RESULT(result);
 
-    for (int i = BLOCK_BITMAP_PTR; i < INODE_BITMAP_END; i++)
-    {
-        result = disk_write(zeros, i);
-        RET_ERR_RESULT(result); 
-    }
+    // all data blocks are free
+    n_pending_discards = 0;
+    struct disk_extent_t data_blocks = {DATA_BLOCKS_PTR, n_blocks - DATA_BLOCKS_PTR};
+    result = disk_discard(&data_blocks, 1);
+    RET_ERR_RESULT(result);
 
     superblock.formatted = true;
-    result = disk_write((char *)&superblock, SUPERBLOCK_PTR);
+    result = superblock_write();
     RET_ERR_RESULT(result); 
 
     least_block_bitmap_block = BLOCK_BITMAP_PTR;
@@ -61,9 +166,9 @@ int blocks_format()
     return SUCCESS;
 }
 
-void blocks_init(const char *server_ip, int port)
+void blocks_init(const struct disk_config_t *config)
 {
-    disk_init(server_ip, port);
+    disk_init(config);
 
     get_n_blocks(&n_blocks);
     EXIT_IF(n_blocks > MAX_N_BLOCKS || n_blocks < MIN_N_BLOCKS, blocks_close(), "Error: Invalid disk size.\n");
@@ -154,7 +259,7 @@ int find_first_zero_bit(int start_block, int *p_offset, int search_start_block,
 
 int deallocate_inode(int inode_id)
 {
-    printf("blocks: deallocate inode block %i\n", inode_id);
+    LOG_DEBUG("blocks: deallocate inode block %i\n", inode_id);
     RET_ERR_IF(inode_id < 0, , INVALID_ARG_ERROR);
     RET_ERR_IF(inode_id >= INODE_TABLE_END - INODE_TABLE_PTR, , INVALID_ARG_ERROR);
 
@@ -162,7 +267,7 @@ int deallocate_inode(int inode_id)
     RET_ERR_RESULT(result); 
     superblock.n_free_inodes++;
     least_inode_bitmap_block = INODE_BITMAP_PTR + inode_id / (BLOCK_SIZE * 8);
-    return SUCCESS;
+    return superblock_write();
 }
 
 int allocate_inode(int *inode_id)
@@ -178,8 +283,8 @@ int allocate_inode(int *inode_id)
     RET_ERR_RESULT(result); 
     *inode_id = inode_bitmap_offset;
     superblock.n_free_inodes--;
-    printf("blocks: allocate inode block %i\n", *inode_id);
-    return SUCCESS;
+    LOG_DEBUG("blocks: allocate inode block %i\n", *inode_id);
+    return superblock_write();
 }
 
 int read_inode(int inode_id, struct inode_t *p_inode)
@@ -204,15 +309,17 @@ int write_inode(int inode_id, const struct inode_t* p_inode)
 
 int deallocate_block(int block_id)
 {
-    printf("blocks: deallocate data block %i\n", block_id);
+    LOG_DEBUG("blocks: deallocate data block %i\n", block_id);
     RET_ERR_IF(block_id < 0, , INVALID_ARG_ERROR);
     RET_ERR_IF(block_id >= n_blocks - DATA_BLOCKS_PTR, , INVALID_ARG_ERROR);
 
     int result = bit_clear(BLOCK_BITMAP_PTR, block_id);
     RET_ERR_RESULT(result); 
+    result = discard_queue(DATA_BLOCKS_PTR + block_id);
+    RET_ERR_RESULT(result);
     superblock.n_free_blocks++;
     least_block_bitmap_block = BLOCK_BITMAP_PTR + block_id / (BLOCK_SIZE * 8);
-    return SUCCESS;
+    return superblock_write();
 }
 
 int allocate_block(int *block_id)
@@ -226,10 +333,12 @@ int allocate_block(int *block_id)
 
     result = bit_set(BLOCK_BITMAP_PTR, block_bitmap_offset);
     RET_ERR_RESULT(result); 
+    result = discard_cancel(DATA_BLOCKS_PTR + block_bitmap_offset);
+    RET_ERR_RESULT(result);
     *block_id = block_bitmap_offset;
     superblock.n_free_blocks--;
-    printf("blocks: allocate data block %i\n", *block_id);
-    return SUCCESS;
+    LOG_DEBUG("blocks: allocate data block %i\n", *block_id);
+    return superblock_write();
 }
 
 int read_block(int block_id, char block[BLOCK_SIZE])
@@ -240,6 +349,21 @@ int read_block(int block_id, char block[BLOCK_SIZE])
     return disk_read(block, DATA_BLOCKS_PTR + block_id);
 }
 
+// Has data blocks loaded into the cache in the background, ahead of their
+// use. Returns the number of blocks queued, the first ones, up to
+// DISK_MAX_ASYNC at once.
+int readahead_blocks(const int *block_ids, int count)
+{
+    int blocks[DISK_MAX_ASYNC];
+    count = (count < DISK_MAX_ASYNC) ? count : DISK_MAX_ASYNC;
+    for (int i = 0; i < count; i++)
+    {
+        bool valid = block_ids[i] >= 0 && block_ids[i] < n_blocks - DATA_BLOCKS_PTR;
+        blocks[i] = valid ? DATA_BLOCKS_PTR + block_ids[i] : -1;
+    }
+    return disk_readahead(blocks, count);
+}
+
 int write_block(int block_id, const char block[BLOCK_SIZE])
 {
     RET_ERR_IF(block_id < 0, , INVALID_ARG_ERROR);
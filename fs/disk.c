@@ -1,198 +1,2257 @@
 #include "disk.h"
 #include "common.h"
 #include "error_type.h"
-#include "client.h"
+#include "socket.h"
 #include "buffer.h"
 #include "fsconfig.h"
+#include "protocol.h"
+#include "clock.h"
+#include "log.h"
+#include "shm.h"
+#include "pool.h"
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
 
-response_t disk_server_response;
-int n_cylinder;
-int n_sectors;
+// disk servers, the logical blocks are striped across them in units of
+// stripe_unit blocks, or every one of them holds a full copy of the disk
+struct disk_server_t
+{
+    const char *ip;
+    int port;
+    int sockfd;
+    int n_blocks;
+    int n_sectors; // sectors per cylinder
+
+    // mirroring
+    bool online;
+    int arm_cylinder;     // last known position of the arm
+    long n_read_blocks;   // blocks read from the replica
+    unsigned char *dirty; // regions written while the replica was offline
+    long last_attempt_us; // last time the replica was connected to
+
+    struct shm_channel_t *shm; // shared-memory channel, NULL over TCP
+    bool corked;
+};
+
+struct disk_server_t servers[DISK_MAX_SERVERS];
+int n_servers = 0;
+int n_columns = 0; // servers the blocks are striped across, 1 if mirrored
+int stripe_unit = DISK_DEFAULT_STRIPE_UNIT;
+enum disk_mirror_t mirror = DISK_MIRROR_NONE;
+int n_regions = 0; // regions of DISK_MIRROR_REGION_SIZE blocks
+int n_disk_blocks = 0;
+
+// The last block of every replica holds its label, with the generation of the
+// mirror it was last in sync with. The generation goes up whenever a replica
+// goes offline, so a replica that missed writes is still found behind after
+// the file system restarts and its dirty regions are lost.
+#define MIRROR_LABEL_MAGIC 0x4D4C4231 // "MLB1"
+struct mirror_label_t
+{
+    u_int32_t magic;
+    u_int32_t generation;
+};
+u_int32_t mirror_generation = 0;
+bool generation_pending = false; // a replica failed since the generation was recorded
+
+// Block cache with the ARC replacement policy. A resident block is on T1 if
+// it was used once since it was loaded and on T2 if more often, and B1 and B2
+// remember the blocks last evicted from T1 and T2, without their data. A miss
+// on such a ghost tells which of T1 and T2 was too small, and moves the target
+// size of T1 toward it. A scan of blocks used once only cycles through T1, so
+// it does not push the blocks used again out of T2.
+//
+// The cache is split into shards by runs of DISK_CACHE_SHARD_RUN blocks, each
+// with its own lock and its own lists, so that threads working on different
+// shards do not contend. A run stays in one shard, so that the dirty blocks
+// written back from a shard can be merged into multi-block extents. A block
+// that missed is read without the lock of its shard, on the LOADING list, and
+// the other threads that want it wait until it is loaded.
+enum cache_list_t
+{
+    CACHE_T1,
+    CACHE_T2,
+    CACHE_B1,
+    CACHE_B2,
+    CACHE_LOADING,
+    CACHE_N_LISTS,
+};
 
-typedef struct
+struct cache_entry_t
 {
-    char data[BLOCK_SIZE];
-} cache_entry_t;
+    int block;
+    int slot;       // block of data, -1 for a ghost
+    int list;       // enum cache_list_t, -1 if free
+    int prev, next; // in the list, next is also the next free entry
+    bool dirty;      // written since it was loaded or written back
+    long dirty_us;   // when it became dirty
+    bool read_ahead; // loaded ahead of use and not used yet
+};
+
+struct cache_shard_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t loaded; // a block has been loaded or given up
+    int size;              // blocks
+    int target_t1;
+
+    // entries of resident and ghost blocks, at most twice the cache, followed
+    // by the heads of the circular lists
+    struct cache_entry_t *entries;
+    int list_sizes[CACHE_N_LISTS];
+    int free_entry;
+
+    char *data;
+    int *free_slots;
+    int n_free_slots;
+
+    // index from block to entry, open addressing with linear probing, at
+    // most half full so that probe sequences stay short
+    int *index; // -1 if empty
+    int index_bits;
+};
+
+#define LIST_HEAD(shard, list) (2 * (shard)->size + (list))
+#define CACHE_DATA(shard, e) ((shard)->data + (size_t)(shard)->entries[(e)].slot * BLOCK_SIZE)
+static struct cache_shard_t shards[DISK_CACHE_SHARDS];
+static int n_shards = 0; // a power of two
+static int cache_size = 0;
+static atomic_int n_dirty = 0; // dirty resident blocks of all shards
+
+// The flusher writes the dirty blocks back in the background, those dirty for
+// longer than DISK_DIRTY_EXPIRE_US, and more while the dirty blocks exceed
+// dirty_background. A writer that takes them over dirty_limit waits for it.
+static pthread_t flusher_thread;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_wake; // both on the monotonic clock
+static pthread_cond_t flush_done; // a pass is over
+static bool flusher_running = false;
+static bool flush_requested = false;
+static int dirty_background = 0; // blocks
+static int dirty_limit = 0;
+
+static void *flusher(void *arg);
 
-cache_entry_t *cache;
-int ref[CACHE_SIZE];
-int blocks[CACHE_SIZE];
-int victim;
+// Blocks to read ahead of use, queued by disk_readahead() and loaded into the
+// cache by a thread of their own, so that the caller does not wait for them.
+static pthread_t readahead_thread;
+static pthread_mutex_t readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_wake;
+static bool readahead_running = false;
+static int readahead_queue[DISK_READAHEAD_QUEUE]; // circular
+static int readahead_head = 0;
+static int n_readahead = 0;
 
-int disk_read_direct(char buffer[BLOCK_SIZE], int block);
+static void *readahead_loader(void *arg);
 
-int disk_write_direct(const char buffer[BLOCK_SIZE], int block);
+// the requests to the servers are not thread-safe, one thread sends them at a
+// time. A thread may take it while it holds the lock of a shard, not the
+// other way around.
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void disk_init(const char *server_ip, int port)
+// per-server staging of the data of striped transfers
+static char staging[DISK_MAX_SERVERS][DISK_MAX_SECTORS * BLOCK_SIZE];
+
+static_assert(BLOCK_SIZE == DISK_SECTOR_SIZE);
+
+int disk_read_direct(char *buffer, int block, int count);
+
+int disk_write_direct(const char *buffer, int block, int count);
+
+int disk_writev_direct(const struct disk_extent_t *extents, int n_extents, const char *buffer);
+
+int disk_flush_servers(int flags);
+
+int disk_request(int server, const struct disk_msg_t *req, char *data, int *p_data_size, int max_data_size);
+
+int disk_receive_response(int server, u_int32_t tag, const char *res_buffer, int res_size);
+
+void disk_disconnect(int server);
+
+void mirror_fail(int server);
+
+void mirror_mark_dirty(int block, int count);
+
+void mirror_revive();
+
+int mirror_read_generation(int server, u_int32_t *p_generation);
+
+void mirror_commit_generation();
+
+// requests sent to the servers and not collected yet, a server may answer
+// them in any order
+struct disk_inflight_t
 {
-    printf("disk: initializing\n");
-    custom_client_init(server_ip, port, &disk_server_response);
+    u_int32_t tag; // 0 if the entry is free
+    int server;
+    int opcode;
+    char *data; // where the payload of the response is copied
+    int max_data_size;
+    bool done;
+    int result; // size of the payload, or an error
+    int async;  // asynchronous request the request is part of, or -1
+    int lba;
+    int count;
+};
 
-    // "I" -> res_buffer
-    char res_buffer[DEFAULT_BUFFER_CAPACITY];
-    int res_size;
-    int result = disk_server_response(0, "I", 1, res_buffer, &res_size, DEFAULT_BUFFER_CAPACITY);
-    EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Could not get disk info.\n");
+// an asynchronous request, made of one request to every server involved
+struct disk_async_t
+{
+    bool used;
+    bool write;
+    char *buffer;
+    int block;
+    int count;
+    int n_pending; // requests still in flight
+    int n_done;    // requests served
+    int error;
+};
 
-    // res_buffer -> res_str
-    char res_str[DEFAULT_BUFFER_CAPACITY];
-    result = buffer_to_str(res_buffer, res_size, res_str, DEFAULT_BUFFER_CAPACITY);
-    EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Could not get disk info.\n");
+static struct disk_inflight_t inflight[DISK_MAX_INFLIGHT];
+static int n_server_inflight[DISK_MAX_SERVERS];
+static u_int32_t next_tag = 1;
+static struct disk_async_t asyncs[DISK_MAX_ASYNC];
 
-    // res_str -> n_cylinders, n_sectors
-    result = sscanf(res_str, "%d %d", &n_cylinder, &n_sectors);
-    EXIT_IF(result != 2, custom_client_close(), "Error: Could not get disk info.\n");
+static const char *mirror_names[] = {"none", "nearest", "load"};
 
-    // cache init
-    cache = (cache_entry_t *)malloc(CACHE_SIZE * sizeof(cache_entry_t));
-    EXIT_IF(cache == NULL, custom_client_close(), "Error: Bad alloc.\n");
+int parse_disk_mirror(const char *name, enum disk_mirror_t *p_mirror)
+{
+    for (int i = DISK_MIRROR_NONE; i <= DISK_MIRROR_LOAD; i++)
+    {
+        if (strcmp(name, mirror_names[i]) == 0)
+        {
+            *p_mirror = i;
+            return SUCCESS;
+        }
+    }
+    return INVALID_ARG_ERROR;
+}
 
-    for (int i = 0; i < CACHE_SIZE; i++)
+void disk_close_servers()
+{
+    for (int i = 0; i < n_servers; i++)
     {
-        ref[i] = -1;
-        blocks[i] = -1;
-        victim = 0;
+        if (servers[i].online)
+            disk_disconnect(i);
+        servers[i].online = false;
+        if (servers[i].dirty != NULL)
+            free(servers[i].dirty);
+        servers[i].dirty = NULL;
     }
+    n_servers = 0;
 }
 
-void disk_close()
+// Closes the connection to a disk server.
+void disk_disconnect(int server)
+{
+    if (servers[server].shm != NULL)
+        shm_close(servers[server].shm);
+    else
+        close(servers[server].sockfd);
+    servers[server].shm = NULL;
+    servers[server].corked = false;
+}
+
+// Connects to a disk server and gets its geometry. A server whose address is
+// a path is reached through shared memory, over the Unix-domain socket at
+// that path. The server is not marked online.
+int disk_connect(int server)
+{
+    struct disk_server_t *s = &servers[server];
+    s->last_attempt_us = now_us();
+    if (s->ip[0] == '/')
+    {
+        int result = shm_connect(s->ip, &s->shm);
+        RET_ERR_RESULT(result);
+        s->sockfd = -1;
+    }
+    else
+    {
+        int sockfd = try_connect_to_server(s->ip, s->port);
+        RET_ERR_RESULT(sockfd);
+        socket_set_nodelay(sockfd, true);
+        s->sockfd = sockfd;
+    }
+
+    // INFO -> geometry
+    struct disk_msg_t req = {DISK_OP_INFO, 0, SUCCESS, 0, 0, 0, NULL, 0};
+    u_int32_t geometry[2];
+    int geometry_size;
+    int result = disk_request(server, &req, (char *)geometry, &geometry_size, sizeof(geometry));
+    RET_ERR_IF(IS_ERROR(result) || geometry_size != sizeof(geometry), disk_disconnect(server), READ_ERROR);
+
+    // geometry -> n_blocks
+    long n_blocks = (long)ntohl(geometry[0]) * ntohl(geometry[1]);
+    RET_ERR_IF(n_blocks <= 0 || n_blocks > INT_MAX, disk_disconnect(server), READ_ERROR);
+    s->n_blocks = n_blocks;
+    s->n_sectors = ntohl(geometry[1]);
+    s->arm_cylinder = 0;
+    return SUCCESS;
+}
+
+void disk_init(const struct disk_config_t *config)
 {
-    printf("disk: closing\n");
+    LOG_INFO("disk: initializing\n");
+    EXIT_IF(config->n_servers <= 0 || config->n_servers > DISK_MAX_SERVERS, , "Error: Invalid number of disk servers.\n");
+    EXIT_IF(config->stripe_unit <= 0, , "Error: Invalid stripe unit.\n");
+    stripe_unit = config->stripe_unit;
+    mirror = config->mirror;
+    n_columns = (mirror == DISK_MIRROR_NONE) ? config->n_servers : 1;
+
+    // a replica that cannot be reached is brought back later, but a stripe
+    // column cannot be missing
+    int min_n_blocks = 0;
+    int n_online = 0;
+    for (int i = 0; i < config->n_servers; i++)
+    {
+        struct disk_server_t server = {config->servers[i].ip, config->servers[i].port, -1, 0, 1, false, 0, 0, NULL, 0, NULL, false};
+        servers[i] = server;
+        n_servers++;
+
+        int result = disk_connect(i);
+        EXIT_IF(IS_ERROR(result) && mirror == DISK_MIRROR_NONE, disk_close_servers(),
+                "Error: Could not connect to disk server %s:%d.\n", servers[i].ip, servers[i].port);
+        if (IS_ERROR(result))
+        {
+            LOG_INFO("disk: replica %s:%d is offline\n", servers[i].ip, servers[i].port);
+            continue;
+        }
+        servers[i].online = true;
+        min_n_blocks = (n_online == 0 || servers[i].n_blocks < min_n_blocks) ? servers[i].n_blocks : min_n_blocks;
+        n_online++;
+    }
+    EXIT_IF(n_online == 0, disk_close_servers(), "Error: No disk server is online.\n");
+
+    // every server contributes the same whole number of stripe units
+    if (n_columns == 1)
+        n_disk_blocks = (mirror != DISK_MIRROR_NONE) ? min_n_blocks - 1 : min_n_blocks; // the label of a replica
+    else
+    {
+        long n_blocks = (long)(min_n_blocks / stripe_unit) * stripe_unit * n_servers;
+        n_disk_blocks = (n_blocks > INT_MAX) ? INT_MAX / (stripe_unit * n_servers) * (stripe_unit * n_servers) : n_blocks;
+        LOG_INFO("disk: %d servers, stripe unit = %d blocks\n", n_servers, stripe_unit);
+    }
+
+    // the replicas that are offline from the start, or behind the others, may
+    // hold anything, and the others record a new generation without them
+    if (mirror != DISK_MIRROR_NONE)
+    {
+        u_int32_t generations[DISK_MAX_SERVERS] = {0};
+        for (int i = 0; i < n_servers; i++)
+        {
+            if (servers[i].online && IS_ERROR(mirror_read_generation(i, &generations[i])))
+            {
+                disk_disconnect(i);
+                servers[i].online = false;
+                n_online--;
+            }
+            if (servers[i].online && generations[i] > mirror_generation)
+                mirror_generation = generations[i];
+        }
+        for (int i = 0; i < n_servers; i++)
+        {
+            if (!servers[i].online || generations[i] == mirror_generation)
+                continue;
+            LOG_INFO("disk: replica %s:%d is behind, it will be resynced in full\n", servers[i].ip, servers[i].port);
+            disk_disconnect(i);
+            servers[i].online = false;
+            servers[i].last_attempt_us = 0;
+            n_online--;
+        }
+        EXIT_IF(n_online == 0, disk_close_servers(), "Error: No disk server is online.\n");
+
+        n_regions = (n_disk_blocks + DISK_MIRROR_REGION_SIZE - 1) / DISK_MIRROR_REGION_SIZE;
+        for (int i = 0; i < n_servers; i++)
+        {
+            servers[i].dirty = (unsigned char *)malloc(n_regions);
+            EXIT_IF(servers[i].dirty == NULL, disk_close_servers(), "Error: Bad alloc.\n");
+            memset(servers[i].dirty, !servers[i].online, n_regions);
+        }
+        generation_pending = n_online < n_servers;
+        mirror_commit_generation();
+        LOG_INFO("disk: %d replicas, %d online, reads = %s\n", n_servers, n_online, mirror_names[mirror]);
+    }
 
-    // cache cleanup
-    for (int i = 0; i < CACHE_SIZE; i++)
+    // cache init
+    cache_size = (config->cache_size > 0) ? config->cache_size : DISK_DEFAULT_CACHE_SIZE;
+    EXIT_IF(cache_size > DISK_MAX_CACHE_SIZE, disk_close_servers(), "Error: Cache too large.\n");
+    n_shards = 1;
+    while (n_shards * 2 <= DISK_CACHE_SHARDS && n_shards * 2 <= cache_size)
+        n_shards *= 2;
+    for (int i = 0; i < n_shards; i++)
     {
-        if (ref[i] != -1)
+        struct cache_shard_t *shard = &shards[i];
+        shard->size = cache_size / n_shards + (i < cache_size % n_shards);
+        shard->index_bits = 2;
+        while ((1 << shard->index_bits) < 4 * shard->size)
+            shard->index_bits++;
+        shard->data = (char *)malloc((size_t)shard->size * BLOCK_SIZE);
+        shard->entries = (struct cache_entry_t *)malloc((2 * shard->size + CACHE_N_LISTS) * sizeof(struct cache_entry_t));
+        shard->free_slots = (int *)malloc(shard->size * sizeof(int));
+        shard->index = (int *)malloc((1 << shard->index_bits) * sizeof(int));
+        EXIT_IF(shard->data == NULL || shard->entries == NULL || shard->free_slots == NULL || shard->index == NULL,
+                disk_close_servers(), "Error: Bad alloc.\n");
+
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->loaded, NULL);
+        shard->free_entry = -1;
+        for (int e = 2 * shard->size - 1; e >= 0; e--)
+        {
+            shard->entries[e].list = -1;
+            shard->entries[e].slot = -1;
+            shard->entries[e].dirty = false;
+            shard->entries[e].dirty_us = 0;
+            shard->entries[e].read_ahead = false;
+            shard->entries[e].next = shard->free_entry;
+            shard->free_entry = e;
+        }
+        for (int list = 0; list < CACHE_N_LISTS; list++)
         {
-            disk_write_direct(cache[i].data, blocks[i]);
+            int head = LIST_HEAD(shard, list);
+            shard->entries[head].prev = shard->entries[head].next = head;
+            shard->list_sizes[list] = 0;
         }
+        for (int j = 0; j < shard->size; j++)
+            shard->free_slots[j] = shard->size - 1 - j;
+        shard->n_free_slots = shard->size;
+        shard->target_t1 = 0;
+        memset(shard->index, -1, (1 << shard->index_bits) * sizeof(int));
     }
-    if (cache != NULL)
-        free(cache);
-    custom_client_close();
+    LOG_INFO("disk: cache of %d blocks in %d shards\n", cache_size, n_shards);
+
+    // flusher init
+    atomic_store(&n_dirty, 0);
+    dirty_background = cache_size * DISK_DIRTY_BACKGROUND_RATIO / 100;
+    dirty_limit = cache_size * DISK_DIRTY_RATIO / 100;
+    dirty_limit = (dirty_limit > 0) ? dirty_limit : 1;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flush_wake, &attr);
+    pthread_cond_init(&flush_done, &attr);
+    pthread_condattr_destroy(&attr);
+    flusher_running = true;
+    flush_requested = false;
+    int result = pthread_create(&flusher_thread, NULL, flusher, NULL);
+    EXIT_IF(result != 0, disk_close_servers(), "Error: Could not create the flusher thread.\n");
+    LOG_INFO("disk: dirty blocks written back over %d, writers wait over %d\n", dirty_background, dirty_limit);
+
+    // read-ahead init
+    pthread_cond_init(&readahead_wake, NULL);
+    readahead_running = true;
+    readahead_head = 0;
+    n_readahead = 0;
+    result = pthread_create(&readahead_thread, NULL, readahead_loader, NULL);
+    EXIT_IF(result != 0, disk_close_servers(), "Error: Could not create the read-ahead thread.\n");
 }
 
-void get_n_blocks(int *p_n_blocks)
+void disk_close()
 {
-    *p_n_blocks = n_cylinder * n_sectors;
+    LOG_INFO("disk: closing\n");
+
+    pthread_mutex_lock(&readahead_mutex);
+    bool loading = readahead_running;
+    readahead_running = false;
+    pthread_cond_signal(&readahead_wake);
+    pthread_mutex_unlock(&readahead_mutex);
+    if (loading)
+    {
+        pthread_join(readahead_thread, NULL);
+        pthread_cond_destroy(&readahead_wake);
+    }
+
+    pthread_mutex_lock(&flush_mutex);
+    bool running = flusher_running;
+    flusher_running = false;
+    pthread_cond_signal(&flush_wake);
+    pthread_cond_broadcast(&flush_done);
+    pthread_mutex_unlock(&flush_mutex);
+    if (running)
+    {
+        pthread_join(flusher_thread, NULL);
+        pthread_cond_destroy(&flush_wake);
+        pthread_cond_destroy(&flush_done);
+    }
+
+    disk_flush();
+    // the dirty regions of the offline replicas are forgotten once the file
+    // system closes, so a replica that failed late is resynced now if it can
+    // be, and otherwise in full at the next start, as its generation is behind
+    for (int i = 0; i < n_servers && mirror != DISK_MIRROR_NONE; i++)
+        servers[i].last_attempt_us = 0;
+    pthread_mutex_lock(&io_mutex);
+    if (mirror != DISK_MIRROR_NONE)
+        mirror_revive();
+    pthread_mutex_unlock(&io_mutex);
+    for (int i = 0; i < n_shards; i++)
+    {
+        free(shards[i].data);
+        free(shards[i].entries);
+        free(shards[i].free_slots);
+        free(shards[i].index);
+        pthread_mutex_destroy(&shards[i].mutex);
+        pthread_cond_destroy(&shards[i].loaded);
+    }
+    n_shards = 0;
+    for (int i = 0; i < n_servers && mirror != DISK_MIRROR_NONE; i++)
+        LOG_INFO("disk: replica %s:%d served %ld blocks\n", servers[i].ip, servers[i].port, servers[i].n_read_blocks);
+    disk_close_servers();
 }
 
-int disk_read_direct(char buffer[BLOCK_SIZE], int block)
+void get_n_blocks(int *p_n_blocks)
 {
-    printf("disk: direct reading %i\n", block);
+    *p_n_blocks = n_disk_blocks;
+}
 
-    // block -> cylinder, sector
-    int cylinder = block / n_sectors;
-    int sector = block % n_sectors;
+/*
+ * striping
+ */
 
-    // cylinder, sector -> req_str
-    char req_str[20];
-    snprintf(req_str, 20, "R %d %d", cylinder, sector);
+// Maps a logical block to a server and a block on that server.
+void stripe_map(int block, int *p_server, int *p_server_block)
+{
+    int stripe = block / stripe_unit;
+    *p_server = stripe % n_columns;
+    *p_server_block = (stripe / n_columns) * stripe_unit + block % stripe_unit;
+}
 
-    // req_str -> res_buffer
-    char res_buffer[DEFAULT_BUFFER_CAPACITY];
-    int res_size;
-    int result = disk_server_response(0, req_str, strlen(req_str), res_buffer, &res_size, DEFAULT_BUFFER_CAPACITY);
-    RET_ERR_RESULT(result);
-    RET_ERR_IF(res_size != 4 + BLOCK_SIZE, , READ_ERROR);
-    RET_ERR_IF(!starts_with(res_buffer, res_size, "Yes"), , READ_ERROR);
+// Returns the length of the piece of [block, block + count) that starts at
+// block and stays on one server.
+int stripe_piece(int block, int count)
+{
+    int piece = stripe_unit - block % stripe_unit;
+    return (piece < count) ? piece : count;
+}
 
-    // res_buffer -> buffer
-    memcpy(buffer, res_buffer + 4, BLOCK_SIZE);
-    return BLOCK_SIZE;
+// Splits [block, block + count) into the range of blocks it covers on every
+// server. The part of a contiguous logical range on one server is contiguous.
+void stripe_split(int block, int count, int starts[DISK_MAX_SERVERS], int counts[DISK_MAX_SERVERS])
+{
+    int first_stripe = block / stripe_unit;
+    int last_stripe = (block + count - 1) / stripe_unit;
+    for (int i = 0; i < n_columns; i++)
+    {
+        // first and last logical blocks of the range on server i
+        int first_block = block;
+        if (first_stripe % n_columns != i)
+            first_block = (first_stripe + (i - first_stripe % n_columns + n_columns) % n_columns) * stripe_unit;
+        int last_block = block + count - 1;
+        if (last_stripe % n_columns != i)
+            last_block = (last_stripe - (last_stripe % n_columns - i + n_columns) % n_columns) * stripe_unit + stripe_unit - 1;
+
+        counts[i] = 0;
+        if (first_block > last_block)
+            continue;
+        int server, last_server_block;
+        stripe_map(first_block, &server, &starts[i]);
+        stripe_map(last_block, &server, &last_server_block);
+        counts[i] = last_server_block - starts[i] + 1;
+    }
 }
 
-int disk_write_direct(const char buffer[BLOCK_SIZE], int block)
+/*
+ * requests
+ */
+
+// Frees an entry of the in-flight table.
+static void inflight_free(int slot)
 {
-    printf("disk: direct writing %i\n", block);
+    inflight[slot].tag = 0;
+}
 
-    // block -> cylinder, sector
-    int cylinder = block / n_sectors;
-    int sector = block % n_sectors;
+// Records the result of a request in flight. The entries of asynchronous
+// requests are freed at once, the others when the caller collects them.
+static void inflight_finish(int slot, int result)
+{
+    struct disk_inflight_t *entry = &inflight[slot];
+    entry->done = true;
+    entry->result = result;
+    n_server_inflight[entry->server]--;
+    if (entry->async < 0)
+        return;
 
-    // cylinder, sector -> req_head_str
-    char req_head_str[30];
-    snprintf(req_head_str, 30, "W %d %d %d ", cylinder, sector, BLOCK_SIZE);
+    int server = entry->server;
+    struct disk_async_t *async = &asyncs[entry->async];
+    async->n_pending--;
+    inflight_free(slot);
+    if (IS_ERROR(result))
+    {
+        async->error = IS_ERROR(async->error) ? async->error : result;
+        if (mirror != DISK_MIRROR_NONE && servers[server].online)
+            mirror_fail(server);
+        if (mirror != DISK_MIRROR_NONE && async->write)
+            mirror_mark_dirty(entry->lba, entry->count);
+        return;
+    }
+    async->n_done++;
+    if (mirror != DISK_MIRROR_NONE)
+    {
+        servers[server].arm_cylinder = (entry->lba + entry->count - 1) / servers[server].n_sectors;
+        if (!async->write)
+            servers[server].n_read_blocks += entry->count;
+    }
+}
 
-    // req_head_str, buffer -> req_buffer
-    char req_buffer[DEFAULT_BUFFER_CAPACITY];
-    int req_size;
-    int result = concat_buffer(req_buffer, &req_size, DEFAULT_BUFFER_CAPACITY, req_head_str, strlen(req_head_str), buffer, BLOCK_SIZE);
-    RET_ERR_RESULT(result);
+// Fails all requests in flight on a server, whose connection is broken.
+static void disk_fail_server(int server, int error)
+{
+    for (int i = 0; i < DISK_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].tag != 0 && !inflight[i].done && inflight[i].server == server)
+            inflight_finish(i, error);
+    }
+}
 
-    // req_buffer -> res_buffer
-    char res_buffer[DEFAULT_BUFFER_CAPACITY];
+// Receives one response from a server, in whatever order the server completes
+// the requests, and copies its payload to where its request wants it.
+int disk_receive(int server)
+{
+    // over shared memory, the response is read in place and its slot is
+    // released once the payload is copied, over TCP it is received into a
+    // pooled buffer that grows to the largest response
+    static struct pool_buffer_t res_buffer = {NULL, 0};
+    const char *res_data;
     int res_size;
-    result = disk_server_response(0, req_buffer, req_size, res_buffer, &res_size, DEFAULT_BUFFER_CAPACITY);
-    RET_ERR_RESULT(result);
-    RET_ERR_IF(!starts_with(res_buffer, res_size, "Yes"), , READ_ERROR);
-    return res_size;
+    int shm_slot = -1;
+    u_int32_t tag;
+    int result;
+    if (servers[server].shm != NULL)
+        result = shm_receive(servers[server].shm, &tag, &shm_slot, &res_data, &res_size);
+    else
+    {
+        result = recv_pooled_message(servers[server].sockfd, &tag, &res_buffer, &res_size, DEFAULT_BUFFER_CAPACITY);
+        res_data = res_buffer.data;
+    }
+    RET_ERR_IF(IS_ERROR(result), disk_fail_server(server, result), result);
+    result = disk_receive_response(server, tag, res_data, res_size);
+    if (shm_slot >= 0)
+        shm_release(servers[server].shm, shm_slot);
+    return result;
 }
 
-int disk_read(char buffer[BLOCK_SIZE], int block)
+// Copies the payload of a response to where its request wants it.
+int disk_receive_response(int server, u_int32_t tag, const char *res_buffer, int res_size)
+{
+    // res_buffer -> res
+    struct disk_msg_t res;
+    int result = disk_unpack_response(res_buffer, res_size, &res);
+    RET_ERR_IF(IS_ERROR(result), disk_fail_server(server, result), result);
+    int slot = -1;
+    for (int i = 0; i < DISK_MAX_INFLIGHT && slot < 0; i++)
+    {
+        if (inflight[i].tag == tag && !inflight[i].done && inflight[i].server == server)
+            slot = i;
+    }
+    RET_ERR_IF(slot < 0 || res.opcode != inflight[slot].opcode, disk_fail_server(server, READ_ERROR), READ_ERROR);
+
+    // res -> data
+    struct disk_inflight_t *entry = &inflight[slot];
+    result = res.status;
+    if (!IS_ERROR(result) && entry->data != NULL)
+    {
+        if (res.payload_size > entry->max_data_size)
+            result = BUFFER_OVERFLOW;
+        else
+            memcpy(entry->data, res.payload, res.payload_size);
+    }
+    inflight_finish(slot, IS_ERROR(result) ? result : res.payload_size);
+    return SUCCESS;
+}
+
+// Corks or uncorks the connection to a TCP disk server.
+static void disk_cork(int server, bool on)
+{
+    if (servers[server].shm != NULL || servers[server].corked == on)
+        return;
+    socket_set_cork(servers[server].sockfd, on);
+    servers[server].corked = on;
+}
+
+// Sends a binary request to a disk server with a new tag, without waiting for
+// the response, whose payload is copied into data when it arrives. Returns the
+// entry of the request in the in-flight table.
+int disk_send(int server, const struct disk_msg_t *req, char *data, int max_data_size)
 {
-    printf("disk: reading %i\n", block);
-    for (int i = 0; i < CACHE_SIZE; i++)
+    // a server gets at most DISK_MAX_SERVER_INFLIGHT requests ahead, so that
+    // neither side blocks on a full socket while the other one does
+    while (n_server_inflight[server] >= DISK_MAX_SERVER_INFLIGHT)
     {
-        if (blocks[i] == block)
+        // the requests held back by the cork must go out to be answered
+        if (servers[server].corked)
         {
-            // cache hit
-            memcpy(buffer, cache[i].data, BLOCK_SIZE);
-            ref[i] = 1;
-            return BLOCK_SIZE;
+            disk_cork(server, false);
+            disk_cork(server, true);
         }
+        int result = disk_receive(server);
+        RET_ERR_RESULT(result);
+    }
+    int slot = -1;
+    for (int i = 0; i < DISK_MAX_INFLIGHT && slot < 0; i++)
+    {
+        if (inflight[i].tag == 0)
+            slot = i;
     }
-    // cache miss
+    RET_ERR_IF(slot < 0, , BUFFER_OVERFLOW);
+
+    u_int32_t tag = next_tag++;
+    if (next_tag == 0)
+        next_tag = 1;
     int result;
-    while (ref[victim] == 1)
+    if (servers[server].shm != NULL)
     {
-        ref[victim] = 0;
-        victim = (victim + 1) % CACHE_SIZE;
+        // the request is packed in place into a shared slot
+        char *req_buffer;
+        int shm_slot = shm_reserve(servers[server].shm, &req_buffer);
+        RET_ERR_RESULT(shm_slot);
+        int req_size;
+        result = disk_pack_request(req_buffer, &req_size, SHM_SLOT_SIZE, req);
+        RET_ERR_IF(IS_ERROR(result), shm_release(servers[server].shm, shm_slot), result);
+        result = shm_submit(servers[server].shm, shm_slot, tag, req_size);
+        RET_ERR_IF(IS_ERROR(result), shm_release(servers[server].shm, shm_slot), result);
     }
-    if (ref[victim] == 0)
+    else
     {
-        result = disk_write_direct(cache[victim].data, blocks[victim]);
+        // the header and the payload are gathered by the socket
+        RET_ERR_IF(req->payload_size < 0 || DISK_REQ_HEADER_SIZE + req->payload_size > DEFAULT_BUFFER_CAPACITY, , BUFFER_OVERFLOW);
+        char header[DISK_REQ_HEADER_SIZE];
+        disk_pack_request_header(header, req);
+        struct iovec iov[2] = {{header, DISK_REQ_HEADER_SIZE}, {(void *)req->payload, req->payload_size}};
+        result = send_tagged_messagev(servers[server].sockfd, tag, iov, (req->payload != NULL) ? 2 : 1);
         RET_ERR_RESULT(result);
     }
-    result = disk_read_direct(cache[victim].data, block);
+
+    struct disk_inflight_t entry = {tag, server, req->opcode, data, max_data_size, false, SUCCESS, -1, req->lba, req->count};
+    inflight[slot] = entry;
+    n_server_inflight[server]++;
+    return slot;
+}
+
+// Waits for the response to a request sent by disk_send(), receiving the
+// responses to other requests of its server in the meantime. Returns the size
+// of the payload on success.
+int disk_complete(int slot, int *p_data_size)
+{
+    while (!inflight[slot].done)
+        disk_receive(inflight[slot].server);
+    int result = inflight[slot].result;
+    inflight_free(slot);
     RET_ERR_RESULT(result);
-    blocks[victim] = block;
-    ref[victim] = 1;
-    memcpy(buffer, cache[victim].data, BLOCK_SIZE);
-    victim = (victim + 1) % CACHE_SIZE;
-    return BLOCK_SIZE;
+    if (p_data_size != NULL)
+        *p_data_size = result;
+    return result;
 }
 
-int disk_write(const char buffer[BLOCK_SIZE], int block)
+// Sends a binary request to a disk server and copies the payload of the
+// response into data. Returns the size of the payload on success.
+int disk_request(int server, const struct disk_msg_t *req, char *data, int *p_data_size, int max_data_size)
+{
+    int slot = disk_send(server, req, data, max_data_size);
+    RET_ERR_RESULT(slot);
+    return disk_complete(slot, p_data_size);
+}
+
+/*
+ * mirroring
+ */
+
+// Marks the regions of [block, block + count) dirty on every offline replica.
+void mirror_mark_dirty(int block, int count)
+{
+    for (int i = 0; i < n_servers; i++)
+    {
+        if (servers[i].online)
+            continue;
+        for (int r = block / DISK_MIRROR_REGION_SIZE; r <= (block + count - 1) / DISK_MIRROR_REGION_SIZE; r++)
+            servers[i].dirty[r] = 1;
+    }
+}
+
+// Marks the blocks changed by a request dirty on every offline replica.
+void mirror_mark_request_dirty(const struct disk_msg_t *req)
+{
+    struct disk_extent_t extents[DISK_MAX_EXTENTS];
+    switch (req->opcode)
+    {
+    case DISK_OP_WRITE:
+    case DISK_OP_COPY:
+    case DISK_OP_ZERO:
+        mirror_mark_dirty(req->lba, req->count);
+        break;
+    case DISK_OP_WRITEV:
+    case DISK_OP_DISCARD:
+        disk_unpack_extents(req->payload, extents, req->count);
+        for (int i = 0; i < req->count; i++)
+            mirror_mark_dirty(extents[i].lba, extents[i].count);
+        break;
+    }
+}
+
+// Reads the generation in the label of a replica, 0 if it has none.
+int mirror_read_generation(int server, u_int32_t *p_generation)
+{
+    char block[BLOCK_SIZE];
+    int block_size;
+    struct disk_msg_t req = {DISK_OP_READ, 0, SUCCESS, servers[server].n_blocks - 1, 1, 0, NULL, 0};
+    int result = disk_request(server, &req, block, &block_size, BLOCK_SIZE);
+    RET_ERR_IF(IS_ERROR(result) || block_size != BLOCK_SIZE, , READ_ERROR);
+    struct mirror_label_t label;
+    memcpy(&label, block, sizeof(label));
+    *p_generation = (ntohl(label.magic) == MIRROR_LABEL_MAGIC) ? ntohl(label.generation) : 0;
+    return SUCCESS;
+}
+
+// Writes the label of a replica with the given generation.
+int mirror_write_generation(int server, u_int32_t generation)
 {
-    printf("disk: writing %i\n", block);
-    for (int i = 0; i < CACHE_SIZE; i++)
+    char block[BLOCK_SIZE] = {0};
+    struct mirror_label_t label = {htonl(MIRROR_LABEL_MAGIC), htonl(generation)};
+    memcpy(block, &label, sizeof(label));
+    struct disk_msg_t req = {DISK_OP_WRITE, 0, SUCCESS, servers[server].n_blocks - 1, 1, 0, block, BLOCK_SIZE};
+    return disk_request(server, &req, NULL, NULL, 0);
+}
+
+// Records a new generation on the online replicas once a replica has failed,
+// so that it is behind them from then on. A replica that fails to record it
+// fails in turn.
+void mirror_commit_generation()
+{
+    while (generation_pending)
     {
-        if (blocks[i] == block)
+        generation_pending = false;
+        mirror_generation++;
+        for (int i = 0; i < n_servers; i++)
         {
-            // cache hit
-            memcpy(cache[i].data, buffer, BLOCK_SIZE);
-            ref[i] = 1;
-            return BLOCK_SIZE;
+            if (servers[i].online && IS_ERROR(mirror_write_generation(i, mirror_generation)))
+                mirror_fail(i);
         }
     }
-    // cache miss
-    int result;
-    while (ref[victim] == 1)
+}
+
+// Moves the last known arm of a replica to where the request left it.
+void mirror_track_arm(int server, const struct disk_msg_t *req)
+{
+    struct disk_extent_t extents[DISK_MAX_EXTENTS];
+    long last_lba;
+    switch (req->opcode)
     {
-        ref[victim] = 0;
-        victim = (victim + 1) % CACHE_SIZE;
+    case DISK_OP_READ:
+    case DISK_OP_WRITE:
+    case DISK_OP_COPY:
+    case DISK_OP_ZERO:
+        last_lba = req->lba + req->count - 1;
+        break;
+    case DISK_OP_WRITEV:
+        disk_unpack_extents(req->payload, extents, req->count);
+        last_lba = extents[req->count - 1].lba + extents[req->count - 1].count - 1;
+        break;
+    default:
+        return;
     }
-    if (ref[victim] == 0)
+    servers[server].arm_cylinder = last_lba / servers[server].n_sectors;
+}
+
+// Takes a replica offline. It misses all writes from now on.
+void mirror_fail(int server)
+{
+    LOG_INFO("disk: replica %s:%d failed\n", servers[server].ip, servers[server].port);
+    disk_disconnect(server);
+    servers[server].online = false;
+    servers[server].last_attempt_us = now_us();
+    generation_pending = true;
+    disk_fail_server(server, READ_ERROR);
+}
+
+// Stores the online replicas in order, the best one to read block from first,
+// and returns their number.
+int mirror_order(int block, int order[DISK_MAX_SERVERS])
+{
+    int n_online = 0;
+    for (int i = 0; i < n_servers; i++)
     {
-        result = disk_write_direct(cache[victim].data, blocks[victim]);
-        RET_ERR_RESULT(result);
+        if (!servers[i].online)
+            continue;
+
+        // insertion by distance of the arm for nearest, by blocks served for
+        // load, ties broken by blocks served
+        int cylinder = block / servers[i].n_sectors;
+        int j = n_online++;
+        for (; j > 0; j--)
+        {
+            struct disk_server_t *other = &servers[order[j - 1]];
+            int distance = abs(servers[i].arm_cylinder - cylinder);
+            int other_distance = abs(other->arm_cylinder - block / other->n_sectors);
+            if (mirror == DISK_MIRROR_NEAREST && distance != other_distance)
+            {
+                if (distance > other_distance)
+                    break;
+            }
+            else if (servers[i].n_read_blocks >= other->n_read_blocks)
+                break;
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    return n_online;
+}
+
+// Reads count blocks starting at lba from the replicas. A read of at least
+// DISK_MIRROR_MIN_SPLIT blocks is split into one contiguous part per online
+// replica, and the parts are read in parallel, the lowest one from the
+// replica whose arm is closest to it. A failed replica is taken offline and
+// the read is retried on the others.
+int mirror_read(int lba, int count, char *data, int max_data_size)
+{
+    RET_ERR_IF(count * BLOCK_SIZE > max_data_size, , BUFFER_OVERFLOW);
+    while (true)
+    {
+        int order[DISK_MAX_SERVERS];
+        int n_parts = mirror_order(lba, order);
+        RET_ERR_IF(n_parts == 0, , DEFAULT_ERROR);
+        if (count < DISK_MIRROR_MIN_SPLIT)
+            n_parts = 1;
+        n_parts = (n_parts < count) ? n_parts : count;
+
+        struct disk_msg_t parts[DISK_MAX_SERVERS];
+        int slots[DISK_MAX_SERVERS];
+        bool failed = false;
+        for (int i = 0, start = 0; i < n_parts; i++)
+        {
+            int part_count = count / n_parts + (i < count % n_parts);
+            struct disk_msg_t part = {DISK_OP_READ, 0, SUCCESS, lba + start, part_count, 0, NULL, 0};
+            parts[i] = part;
+            start += part_count;
+
+            char *part_data = data + (parts[i].lba - lba) * BLOCK_SIZE;
+            slots[i] = disk_send(order[i], &parts[i], part_data, parts[i].count * BLOCK_SIZE);
+            if (IS_ERROR(slots[i]))
+            {
+                mirror_fail(order[i]);
+                failed = true;
+            }
+        }
+        for (int i = 0; i < n_parts; i++)
+        {
+            if (IS_ERROR(slots[i]))
+                continue;
+            int result = disk_complete(slots[i], NULL);
+            if (IS_ERROR(result))
+            {
+                if (servers[order[i]].online)
+                    mirror_fail(order[i]);
+                failed = true;
+                continue;
+            }
+            servers[order[i]].n_read_blocks += parts[i].count;
+            mirror_track_arm(order[i], &parts[i]);
+        }
+        if (!failed)
+            return count * BLOCK_SIZE;
+    }
+}
+
+// Sends a request that changes the disk to all online replicas in parallel.
+// Succeeds if at least one replica has served it, the blocks are marked dirty
+// on the others.
+int mirror_write(const struct disk_msg_t *req)
+{
+    int slots[DISK_MAX_SERVERS];
+    for (int i = 0; i < n_servers; i++)
+    {
+        slots[i] = DEFAULT_ERROR;
+        if (!servers[i].online)
+            continue;
+        slots[i] = disk_send(i, req, NULL, 0);
+        if (IS_ERROR(slots[i]))
+            mirror_fail(i);
+    }
+    int n_done = 0;
+    for (int i = 0; i < n_servers; i++)
+    {
+        if (IS_ERROR(slots[i]))
+            continue;
+        int result = disk_complete(slots[i], NULL);
+        if (IS_ERROR(result))
+        {
+            if (servers[i].online)
+                mirror_fail(i);
+            continue;
+        }
+        mirror_track_arm(i, req);
+        n_done++;
+    }
+    mirror_mark_request_dirty(req);
+    mirror_commit_generation();
+    RET_ERR_IF(n_done == 0, , DEFAULT_ERROR);
+    return SUCCESS;
+}
+
+// Copies the dirty regions of a replica from the online ones.
+int mirror_resync(int server)
+{
+    char *buffer = (char *)pool_alloc(DISK_MAX_SECTORS * BLOCK_SIZE);
+    RET_ERR_IF(buffer == NULL, , BAD_ALLOC_ERROR);
+    int n_resynced = 0;
+    for (int r = 0; r < n_regions; r++)
+    {
+        if (!servers[server].dirty[r])
+            continue;
+        int end = (r + 1) * DISK_MIRROR_REGION_SIZE;
+        end = (end < n_disk_blocks) ? end : n_disk_blocks;
+        for (int block = r * DISK_MIRROR_REGION_SIZE; block < end; block += DISK_MAX_SECTORS)
+        {
+            int count = (end - block < DISK_MAX_SECTORS) ? end - block : DISK_MAX_SECTORS;
+            int result = mirror_read(block, count, buffer, DISK_MAX_SECTORS * BLOCK_SIZE);
+            RET_ERR_IF(IS_ERROR(result), pool_free(buffer), result);
+            struct disk_msg_t req = {DISK_OP_WRITE, 0, SUCCESS, block, count, 0, buffer, count * BLOCK_SIZE};
+            result = disk_request(server, &req, NULL, NULL, 0);
+            RET_ERR_IF(IS_ERROR(result), pool_free(buffer), result);
+        }
+        servers[server].dirty[r] = 0;
+        n_resynced++;
+    }
+    pool_free(buffer);
+    LOG_INFO("disk: resynced %d regions of replica %s:%d\n", n_resynced, servers[server].ip, servers[server].port);
+    return SUCCESS;
+}
+
+// Tries to bring the offline replicas back, at most once every
+// DISK_MIRROR_RETRY_US each. A replica serves requests again once its dirty
+// regions are resynced.
+void mirror_revive()
+{
+    mirror_commit_generation();
+    long now = now_us();
+    for (int i = 0; i < n_servers; i++)
+    {
+        if (servers[i].online || now - servers[i].last_attempt_us < DISK_MIRROR_RETRY_US)
+            continue;
+        int result = disk_connect(i);
+        if (IS_ERROR(result))
+            continue;
+        if (servers[i].n_blocks <= n_disk_blocks || IS_ERROR(mirror_resync(i)) || IS_ERROR(mirror_write_generation(i, mirror_generation)))
+        {
+            disk_disconnect(i);
+            continue;
+        }
+        servers[i].online = true;
+        LOG_INFO("disk: replica %s:%d is back online\n", servers[i].ip, servers[i].port);
+    }
+}
+
+// Sends reqs[i] to every server i whose request has a non-zero opcode, then
+// collects all the responses, so that the servers work in parallel. The
+// payload of the response of server i is copied into data[i] if it is not
+// NULL. Returns the first error. If the servers are mirrored, reqs[0] is
+// served by the replicas.
+int disk_request_all(const struct disk_msg_t reqs[DISK_MAX_SERVERS], char *data[DISK_MAX_SERVERS], int max_data_size)
+{
+    if (mirror != DISK_MIRROR_NONE)
+    {
+        if (reqs[0].opcode == 0)
+            return SUCCESS;
+        mirror_revive();
+        if (reqs[0].opcode == DISK_OP_READ)
+            return mirror_read(reqs[0].lba, reqs[0].count, data[0], max_data_size);
+        return mirror_write(&reqs[0]);
+    }
+
+    int slots[DISK_MAX_SERVERS];
+    int error = SUCCESS;
+    for (int i = 0; i < n_columns; i++)
+    {
+        slots[i] = DEFAULT_ERROR;
+        if (reqs[i].opcode == 0)
+            continue;
+        char *server_data = (data != NULL) ? data[i] : NULL;
+        slots[i] = disk_send(i, &reqs[i], server_data, max_data_size);
+        error = (IS_ERROR(slots[i]) && !IS_ERROR(error)) ? slots[i] : error;
+    }
+    for (int i = 0; i < n_columns; i++)
+    {
+        if (IS_ERROR(slots[i]))
+            continue;
+        int result = disk_complete(slots[i], NULL);
+        error = (IS_ERROR(result) && !IS_ERROR(error)) ? result : error;
+    }
+    return error;
+}
+
+// Reads or writes count consecutive logical blocks starting at block, with
+// one request to every server involved.
+int disk_transfer(bool write, char *buffer, int block, int count)
+{
+    RET_ERR_IF(count <= 0 || count > DISK_MAX_SECTORS, , INVALID_ARG_ERROR);
+    RET_ERR_IF(block < 0 || block + count > n_disk_blocks, , INVALID_ARG_ERROR);
+
+    int starts[DISK_MAX_SERVERS], counts[DISK_MAX_SERVERS];
+    stripe_split(block, count, starts, counts);
+
+    // buffer <-> staging, in the order of the pieces on every server
+    int offsets[DISK_MAX_SERVERS] = {0};
+    for (int b = block, done = 0; done < count;)
+    {
+        int server, server_block;
+        stripe_map(b, &server, &server_block);
+        int piece = stripe_piece(b, count - done);
+        if (write)
+            memcpy(staging[server] + offsets[server], buffer + done * BLOCK_SIZE, piece * BLOCK_SIZE);
+        offsets[server] += piece * BLOCK_SIZE;
+        b += piece;
+        done += piece;
+    }
+
+    struct disk_msg_t reqs[DISK_MAX_SERVERS];
+    char *data[DISK_MAX_SERVERS];
+    for (int i = 0; i < n_columns; i++)
+    {
+        struct disk_msg_t req = {0, 0, SUCCESS, starts[i], counts[i], 0, NULL, 0};
+        if (counts[i] > 0)
+        {
+            req.opcode = write ? DISK_OP_WRITE : DISK_OP_READ;
+            req.payload = write ? staging[i] : NULL;
+            req.payload_size = write ? counts[i] * BLOCK_SIZE : 0;
+        }
+        reqs[i] = req;
+        data[i] = write ? NULL : staging[i];
     }
-    result = disk_read_direct(cache[victim].data, block);
+    int result = disk_request_all(reqs, data, DISK_MAX_SECTORS * BLOCK_SIZE);
     RET_ERR_RESULT(result);
-    blocks[victim] = block;
-    ref[victim] = 1;
-    memcpy(cache[victim].data, buffer, BLOCK_SIZE);
-    victim = (victim + 1) % CACHE_SIZE;
+
+    if (!write)
+    {
+        for (int i = 0; i < n_columns; i++)
+            offsets[i] = 0;
+        for (int b = block, done = 0; done < count;)
+        {
+            int server, server_block;
+            stripe_map(b, &server, &server_block);
+            int piece = stripe_piece(b, count - done);
+            memcpy(buffer + done * BLOCK_SIZE, staging[server] + offsets[server], piece * BLOCK_SIZE);
+            offsets[server] += piece * BLOCK_SIZE;
+            b += piece;
+            done += piece;
+        }
+    }
+    return count * BLOCK_SIZE;
+}
+
+// Sends a request of the given opcode for the range of every server covered
+// by [block, block + count), to all servers in parallel.
+int disk_range_request(int opcode, int block, int count)
+{
+    int starts[DISK_MAX_SERVERS], counts[DISK_MAX_SERVERS];
+    stripe_split(block, count, starts, counts);
+
+    struct disk_msg_t reqs[DISK_MAX_SERVERS];
+    for (int i = 0; i < n_columns; i++)
+    {
+        struct disk_msg_t req = {(counts[i] > 0) ? opcode : 0, 0, SUCCESS, starts[i], counts[i], 0, NULL, 0};
+        reqs[i] = req;
+    }
+    return disk_request_all(reqs, NULL, 0);
+}
+
+/*
+ * asynchronous requests
+ */
+
+// Sends a request as part of an asynchronous request.
+static void disk_async_send(int handle, int server, const struct disk_msg_t *req, char *data, int max_data_size)
+{
+    struct disk_async_t *async = &asyncs[handle];
+    int slot = disk_send(server, req, data, max_data_size);
+    if (IS_ERROR(slot))
+    {
+        async->error = IS_ERROR(async->error) ? async->error : slot;
+        if (mirror != DISK_MIRROR_NONE && servers[server].online)
+            mirror_fail(server);
+        return;
+    }
+    inflight[slot].async = handle;
+    async->n_pending++;
+}
+
+// Starts reading or writing count consecutive blocks starting at block, with
+// one request for every piece of a stripe unit, or for every replica written.
+// Returns the handle to wait for.
+static int disk_async_start(bool write, char *buffer, int block, int count)
+{
+    RET_ERR_IF(count <= 0 || count > DISK_MAX_SECTORS, , INVALID_ARG_ERROR);
+    RET_ERR_IF(block < 0 || block + count > n_disk_blocks, , INVALID_ARG_ERROR);
+    int handle = -1;
+    for (int i = 0; i < DISK_MAX_ASYNC && handle < 0; i++)
+    {
+        if (!asyncs[i].used)
+            handle = i;
+    }
+    RET_ERR_IF(handle < 0, , BUFFER_OVERFLOW);
+    struct disk_async_t async = {true, write, buffer, block, count, 0, 0, SUCCESS};
+    asyncs[handle] = async;
+
+    if (mirror != DISK_MIRROR_NONE)
+    {
+        // reads from the best replica, writes to all of them
+        mirror_revive();
+        int order[DISK_MAX_SERVERS];
+        int n_online = mirror_order(block, order);
+        if (n_online == 0)
+            asyncs[handle].error = DEFAULT_ERROR;
+        n_online = (!write && n_online > 1) ? 1 : n_online;
+        struct disk_msg_t req = {write ? DISK_OP_WRITE : DISK_OP_READ, 0, SUCCESS, block, count, 0, write ? buffer : NULL, write ? count * BLOCK_SIZE : 0};
+        for (int i = 0; i < n_online; i++)
+            disk_async_send(handle, order[i], &req, write ? NULL : buffer, count * BLOCK_SIZE);
+        if (write)
+            mirror_mark_dirty(block, count);
+        return handle;
+    }
+
+    // the pieces go to and come from the buffer directly, and the requests to
+    // a server are corked into as few packets as possible
+    for (int i = 0; i < n_columns; i++)
+        disk_cork(i, true);
+    for (int b = block, done = 0; done < count;)
+    {
+        int server, server_block;
+        stripe_map(b, &server, &server_block);
+        int piece = stripe_piece(b, count - done);
+        char *data = buffer + done * BLOCK_SIZE;
+        struct disk_msg_t req = {write ? DISK_OP_WRITE : DISK_OP_READ, 0, SUCCESS, server_block, piece, 0, write ? data : NULL, write ? piece * BLOCK_SIZE : 0};
+        disk_async_send(handle, server, &req, write ? NULL : data, piece * BLOCK_SIZE);
+        b += piece;
+        done += piece;
+    }
+    for (int i = 0; i < n_columns; i++)
+        disk_cork(i, false);
+    return handle;
+}
+
+// Starts reading count consecutive blocks starting at block into buffer,
+// which must stay valid until disk_wait() returns. Bypasses the cache.
+int disk_read_async(char *buffer, int block, int count)
+{
+    LOG_DEBUG("disk: async reading %i (%i)\n", block, count);
+    pthread_mutex_lock(&io_mutex);
+    int handle = disk_async_start(false, buffer, block, count);
+    pthread_mutex_unlock(&io_mutex);
+    return handle;
+}
+
+// Starts writing count consecutive blocks starting at block. The data is sent
+// by the time it returns, so buffer can be reused. Bypasses the cache.
+int disk_write_async(const char *buffer, int block, int count)
+{
+    LOG_DEBUG("disk: async writing %i (%i)\n", block, count);
+    pthread_mutex_lock(&io_mutex);
+    int handle = disk_async_start(true, (char *)buffer, block, count);
+    pthread_mutex_unlock(&io_mutex);
+    return handle;
+}
+
+// Receives the responses that have arrived, without blocking. Returns true
+// once the asynchronous request is complete.
+bool disk_poll(int handle)
+{
+    pthread_mutex_lock(&io_mutex);
+    while (asyncs[handle].n_pending > 0)
+    {
+        struct pollfd fds[DISK_MAX_SERVERS];
+        int fd_servers[DISK_MAX_SERVERS];
+        int n_fds = 0;
+        bool received = false;
+        for (int i = 0; i < n_servers; i++)
+        {
+            if (n_server_inflight[i] == 0)
+                continue;
+            if (servers[i].shm != NULL)
+            {
+                if (shm_ready(servers[i].shm))
+                {
+                    disk_receive(i);
+                    received = true;
+                }
+                continue;
+            }
+            fds[n_fds].fd = servers[i].sockfd;
+            fds[n_fds].events = POLLIN;
+            fd_servers[n_fds++] = i;
+        }
+        if (n_fds == 0 || poll(fds, n_fds, 0) <= 0)
+        {
+            if (!received)
+                break;
+            continue;
+        }
+        for (int i = 0; i < n_fds; i++)
+        {
+            if (fds[i].revents != 0)
+                disk_receive(fd_servers[i]);
+        }
+    }
+    bool done = asyncs[handle].n_pending == 0;
+    pthread_mutex_unlock(&io_mutex);
+    return done;
+}
+
+// Waits for an asynchronous request and releases its handle. Returns the
+// number of bytes transferred. A mirrored write succeeds if one replica has
+// served it, and a mirrored read that failed is retried on the others.
+static int disk_wait_locked(int handle)
+{
+    RET_ERR_IF(handle < 0 || handle >= DISK_MAX_ASYNC || !asyncs[handle].used, , INVALID_ARG_ERROR);
+    struct disk_async_t *async = &asyncs[handle];
+    while (async->n_pending > 0)
+    {
+        int server = -1;
+        for (int i = 0; i < DISK_MAX_INFLIGHT && server < 0; i++)
+        {
+            if (inflight[i].tag != 0 && inflight[i].async == handle)
+                server = inflight[i].server;
+        }
+        disk_receive(server);
+    }
+    async->used = false;
+    if (mirror != DISK_MIRROR_NONE && async->write)
+        mirror_commit_generation();
+
+    int result = async->error;
+    if (mirror != DISK_MIRROR_NONE && async->write && async->n_done > 0)
+        result = SUCCESS;
+    if (mirror != DISK_MIRROR_NONE && !async->write && IS_ERROR(result))
+        result = mirror_read(async->block, async->count, async->buffer, async->count * BLOCK_SIZE);
+    RET_ERR_RESULT(result);
+    return async->count * BLOCK_SIZE;
+}
+
+int disk_wait(int handle)
+{
+    pthread_mutex_lock(&io_mutex);
+    int result = disk_wait_locked(handle);
+    pthread_mutex_unlock(&io_mutex);
+    return result;
+}
+
+// Reads count consecutive blocks starting at block.
+int disk_read_direct(char *buffer, int block, int count)
+{
+    LOG_DEBUG("disk: direct reading %i (%i)\n", block, count);
+    pthread_mutex_lock(&io_mutex);
+    int result = disk_transfer(false, buffer, block, count);
+    pthread_mutex_unlock(&io_mutex);
+    return result;
+}
+
+// Writes count consecutive blocks starting at block.
+int disk_write_direct(const char *buffer, int block, int count)
+{
+    LOG_DEBUG("disk: direct writing %i (%i)\n", block, count);
+    pthread_mutex_lock(&io_mutex);
+    int result = disk_transfer(true, (char *)buffer, block, count);
+    pthread_mutex_unlock(&io_mutex);
+    return result;
+}
+
+// Writes n_extents extents, with one request to every server involved. The
+// data of all extents is stored back to back in buffer.
+static int disk_writev_locked(const struct disk_extent_t *extents, int n_extents, const char *buffer)
+{
+    RET_ERR_IF(n_extents <= 0 || n_extents > DISK_MAX_EXTENTS, , INVALID_ARG_ERROR);
+
+    int n_blocks = 0;
+    for (int i = 0; i < n_extents; i++)
+    {
+        RET_ERR_IF(extents[i].lba + extents[i].count > n_disk_blocks, , INVALID_ARG_ERROR);
+        n_blocks += extents[i].count;
+    }
+    RET_ERR_IF(n_blocks > DISK_MAX_SECTORS, , INVALID_ARG_ERROR);
+
+    // logical extents -> extents and data of every server
+    struct disk_extent_t server_extents[DISK_MAX_SERVERS][DISK_MAX_EXTENTS];
+    int n_server_extents[DISK_MAX_SERVERS] = {0};
+    int data_sizes[DISK_MAX_SERVERS] = {0};
+    const char *data = buffer;
+    for (int i = 0; i < n_extents; i++)
+    {
+        for (int b = extents[i].lba, done = 0; done < extents[i].count;)
+        {
+            int server, server_block;
+            stripe_map(b, &server, &server_block);
+            int piece = stripe_piece(b, extents[i].count - done);
+
+            int n = n_server_extents[server];
+            if (n > 0 && server_extents[server][n - 1].lba + server_extents[server][n - 1].count == server_block)
+                server_extents[server][n - 1].count += piece;
+            else
+            {
+                RET_ERR_IF(n_server_extents[server] == DISK_MAX_EXTENTS, , INVALID_ARG_ERROR);
+                server_extents[server][n_server_extents[server]].lba = server_block;
+                server_extents[server][n_server_extents[server]].count = piece;
+                n_server_extents[server]++;
+            }
+            memcpy(staging[server] + data_sizes[server], data, piece * BLOCK_SIZE);
+            data_sizes[server] += piece * BLOCK_SIZE;
+            data += piece * BLOCK_SIZE;
+            b += piece;
+            done += piece;
+        }
+    }
+
+    // extents, data -> payload of every server
+    char *payloads = (char *)pool_alloc(n_columns * (DISK_MAX_EXTENTS * sizeof(struct disk_extent_t) + DISK_MAX_SECTORS * BLOCK_SIZE));
+    RET_ERR_IF(payloads == NULL, , BAD_ALLOC_ERROR);
+    struct disk_msg_t reqs[DISK_MAX_SERVERS];
+    char *payload = payloads;
+    for (int i = 0; i < n_columns; i++)
+    {
+        int extents_size = n_server_extents[i] * sizeof(struct disk_extent_t);
+        disk_pack_extents(payload, server_extents[i], n_server_extents[i]);
+        memcpy(payload + extents_size, staging[i], data_sizes[i]);
+        struct disk_msg_t req = {(n_server_extents[i] > 0) ? DISK_OP_WRITEV : 0, 0, SUCCESS, 0, n_server_extents[i], 0, payload, extents_size + data_sizes[i]};
+        reqs[i] = req;
+        payload += extents_size + data_sizes[i];
+    }
+    int result = disk_request_all(reqs, NULL, 0);
+    pool_free(payloads);
+    RET_ERR_RESULT(result);
+    return n_blocks * BLOCK_SIZE;
+}
+
+int disk_writev_direct(const struct disk_extent_t *extents, int n_extents, const char *buffer)
+{
+    LOG_DEBUG("disk: direct writing %i extents\n", n_extents);
+    pthread_mutex_lock(&io_mutex);
+    int result = disk_writev_locked(extents, n_extents, buffer);
+    pthread_mutex_unlock(&io_mutex);
+    return result;
+}
+
+static struct cache_shard_t *cache_shard(int block)
+{
+    return &shards[(block / DISK_CACHE_SHARD_RUN) & (n_shards - 1)];
+}
+
+static int cache_hash(struct cache_shard_t *shard, int block)
+{
+    return (int)(((uint32_t)block * 2654435761u) >> (32 - shard->index_bits));
+}
+
+// Returns the position of block in the index, or of the empty entry where it
+// would go.
+static int cache_index_position(struct cache_shard_t *shard, int block)
+{
+    int mask = (1 << shard->index_bits) - 1;
+    int i = cache_hash(shard, block);
+    while (shard->index[i] != -1 && shard->entries[shard->index[i]].block != block)
+        i = (i + 1) & mask;
+    return i;
+}
+
+// Returns the entry of block, resident, loading or ghost, or -1.
+static int cache_lookup(struct cache_shard_t *shard, int block)
+{
+    return shard->index[cache_index_position(shard, block)];
+}
+
+// Removes the entry at position i from the index. The entries after it in the
+// same run are shifted back, so that no lookup stops early at the hole.
+static void cache_index_remove(struct cache_shard_t *shard, int i)
+{
+    int mask = (1 << shard->index_bits) - 1;
+    int j = i;
+    while (true)
+    {
+        j = (j + 1) & mask;
+        if (shard->index[j] == -1)
+            break;
+        // the entry at j may fill the hole unless its home lies in (i, j]
+        int home = cache_hash(shard, shard->entries[shard->index[j]].block);
+        bool stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (stays)
+            continue;
+        shard->index[i] = shard->index[j];
+        i = j;
+    }
+    shard->index[i] = -1;
+}
+
+static void list_unlink(struct cache_shard_t *shard, int e)
+{
+    struct cache_entry_t *entries = shard->entries;
+    entries[entries[e].prev].next = entries[e].next;
+    entries[entries[e].next].prev = entries[e].prev;
+    shard->list_sizes[entries[e].list]--;
+}
+
+// Puts entry e at the most recently used end of a list.
+static void list_push(struct cache_shard_t *shard, int e, int list)
+{
+    struct cache_entry_t *entries = shard->entries;
+    int head = LIST_HEAD(shard, list);
+    entries[e].list = list;
+    entries[e].prev = head;
+    entries[e].next = entries[head].next;
+    entries[entries[head].next].prev = e;
+    entries[head].next = e;
+    shard->list_sizes[list]++;
+}
+
+static void list_move(struct cache_shard_t *shard, int e, int list)
+{
+    list_unlink(shard, e);
+    list_push(shard, e, list);
+}
+
+// Returns the least recently used entry of a list, which must not be empty.
+static int list_lru(struct cache_shard_t *shard, int list)
+{
+    return shard->entries[LIST_HEAD(shard, list)].prev;
+}
+
+// Marks a resident entry dirty or clean, and keeps n_dirty up to date.
+static void cache_set_dirty(struct cache_entry_t *entry, bool dirty)
+{
+    if (dirty == entry->dirty)
+        return;
+    if (dirty)
+        entry->dirty_us = now_us();
+    atomic_fetch_add(&n_dirty, dirty ? 1 : -1);
+    entry->dirty = dirty;
+}
+
+// Forgets entry e, resident or ghost, without writing it back.
+static void cache_remove(struct cache_shard_t *shard, int e)
+{
+    struct cache_entry_t *entry = &shard->entries[e];
+    cache_index_remove(shard, cache_index_position(shard, entry->block));
+    list_unlink(shard, e);
+    if (entry->slot != -1)
+        shard->free_slots[shard->n_free_slots++] = entry->slot;
+    cache_set_dirty(entry, false);
+    entry->read_ahead = false;
+    entry->list = -1;
+    entry->slot = -1;
+    entry->next = shard->free_entry;
+    shard->free_entry = e;
+}
+
+// Writes a dirty resident entry back to the disk.
+static int cache_clean(struct cache_shard_t *shard, int e)
+{
+    int result = disk_write_direct(CACHE_DATA(shard, e), shard->entries[e].block, 1);
+    RET_ERR_RESULT(result);
+    cache_set_dirty(&shard->entries[e], false);
+    return SUCCESS;
+}
+
+// A dirty resident entry gathered for write-back.
+struct write_item_t
+{
+    int block;
+    int shard;
+    int entry;
+};
+
+static int write_item_compare(const void *a, const void *b)
+{
+    return ((const struct write_item_t *)a)->block - ((const struct write_item_t *)b)->block;
+}
+
+// Writes a batch of dirty entries back to the disk and marks them clean. The
+// batch is sorted by block, which on every server is the order of cylinders
+// (block / n_sectors), and consecutive blocks are merged into one extent, so
+// the arm sweeps once across the batch and a run of blocks is one transfer.
+// The shards of the entries must be locked.
+static int cache_clean_batch(struct write_item_t *items, int n_items, char *buffer)
+{
+    qsort(items, n_items, sizeof(struct write_item_t), write_item_compare);
+    struct disk_extent_t extents[DISK_MAX_EXTENTS];
+    int n_extents = 0;
+    int first = 0; // first item of the extents
+    for (int i = 0; i <= n_items; i++)
+    {
+        bool merge = i < n_items && n_extents > 0 && items[i].block == extents[n_extents - 1].lba + extents[n_extents - 1].count;
+        if (i == n_items || (!merge && n_extents == DISK_MAX_EXTENTS))
+        {
+            int result = disk_writev_direct(extents, n_extents, buffer);
+            RET_ERR_RESULT(result);
+            for (int j = first; j < i; j++)
+                cache_set_dirty(&shards[items[j].shard].entries[items[j].entry], false);
+            first = i;
+            n_extents = 0;
+            if (i == n_items)
+                break;
+        }
+        if (merge)
+            extents[n_extents - 1].count++;
+        else
+        {
+            extents[n_extents].lba = items[i].block;
+            extents[n_extents].count = 1;
+            n_extents++;
+        }
+        memcpy(buffer + (i - first) * BLOCK_SIZE, CACHE_DATA(&shards[items[i].shard], items[i].entry), BLOCK_SIZE);
+    }
+    return SUCCESS;
+}
+
+// Writes the dirty victim e back together with the dirty entries next to it
+// at the least recently used end of its list, which are the next victims, in
+// one batch instead of one request per eviction.
+static int cache_clean_victims(struct cache_shard_t *shard, int e)
+{
+    char *buffer = (char *)pool_alloc(DISK_EVICT_BATCH * BLOCK_SIZE);
+    RET_ERR_IF(buffer == NULL, , BAD_ALLOC_ERROR);
+    struct write_item_t items[DISK_EVICT_BATCH];
+    int n_items = 0;
+    int head = LIST_HEAD(shard, shard->entries[e].list);
+    for (int i = e, n_scanned = 0; i != head && n_scanned < DISK_EVICT_BATCH; i = shard->entries[i].prev, n_scanned++)
+    {
+        if (!shard->entries[i].dirty)
+            continue;
+        struct write_item_t item = {shard->entries[i].block, shard - shards, i};
+        items[n_items++] = item;
+    }
+    int result = cache_clean_batch(items, n_items, buffer);
+    pool_free(buffer);
+    return result;
+}
+
+// Evicts the least recently used block of T1 or T2 into its ghost list. T1
+// gives up its block if it is larger than its target size, or as large and
+// the miss was on a ghost of T2.
+static int cache_replace(struct cache_shard_t *shard, bool in_b2)
+{
+    int t1 = shard->list_sizes[CACHE_T1];
+    bool from_t1 = t1 > 0 && (t1 > shard->target_t1 || (in_b2 && t1 == shard->target_t1));
+    if (shard->list_sizes[CACHE_T2] == 0)
+        from_t1 = true;
+    int e = list_lru(shard, from_t1 ? CACHE_T1 : CACHE_T2);
+    if (shard->entries[e].dirty)
+    {
+        int result = cache_clean_victims(shard, e);
+        RET_ERR_RESULT(result);
+    }
+    shard->free_slots[shard->n_free_slots++] = shard->entries[e].slot;
+    shard->entries[e].slot = -1;
+    list_move(shard, e, from_t1 ? CACHE_B1 : CACHE_B2);
+    return SUCCESS;
+}
+
+// Makes room for block, which is not resident, and returns its entry with a
+// slot whose data is not loaded yet. e is the ghost of block, or -1. A slot
+// must be free, or T1 and T2 must not be empty.
+static int cache_admit(struct cache_shard_t *shard, int block, int e)
+{
+    int *sizes = shard->list_sizes;
+    if (e >= 0)
+    {
+        // a ghost hit, the list it was evicted from should have been larger
+        bool in_b2 = shard->entries[e].list == CACHE_B2;
+        if (in_b2)
+        {
+            shard->target_t1 -= (sizes[CACHE_B1] > sizes[CACHE_B2]) ? sizes[CACHE_B1] / sizes[CACHE_B2] : 1;
+            shard->target_t1 = (shard->target_t1 > 0) ? shard->target_t1 : 0;
+        }
+        else
+        {
+            shard->target_t1 += (sizes[CACHE_B2] > sizes[CACHE_B1]) ? sizes[CACHE_B2] / sizes[CACHE_B1] : 1;
+            shard->target_t1 = (shard->target_t1 < shard->size) ? shard->target_t1 : shard->size;
+        }
+        if (shard->n_free_slots == 0)
+        {
+            int result = cache_replace(shard, in_b2);
+            RET_ERR_RESULT(result);
+        }
+        shard->entries[e].slot = shard->free_slots[--shard->n_free_slots];
+        shard->entries[e].read_ahead = false;
+        list_move(shard, e, CACHE_T2);
+        return e;
+    }
+
+    // a new block, the blocks used once and their ghosts fill at most the
+    // cache, and all blocks twice the cache. The blocks being loaded are
+    // counted on neither side, so the bounds may be overshot.
+    int l1 = sizes[CACHE_T1] + sizes[CACHE_B1];
+    int total = l1 + sizes[CACHE_T2] + sizes[CACHE_B2] + sizes[CACHE_LOADING];
+    if (l1 >= shard->size && sizes[CACHE_T1] > 0 && (sizes[CACHE_B1] == 0 || sizes[CACHE_T1] >= shard->size))
+    {
+        int lru = list_lru(shard, CACHE_T1);
+        if (shard->entries[lru].dirty)
+        {
+            int result = cache_clean(shard, lru);
+            RET_ERR_RESULT(result);
+        }
+        cache_remove(shard, lru);
+    }
+    else if (l1 >= shard->size)
+        cache_remove(shard, list_lru(shard, CACHE_B1));
+    else if (total >= 2 * shard->size)
+        cache_remove(shard, list_lru(shard, (sizes[CACHE_B2] > 0) ? CACHE_B2 : CACHE_B1));
+    if (shard->n_free_slots == 0)
+    {
+        int result = cache_replace(shard, false);
+        RET_ERR_RESULT(result);
+    }
+    e = shard->free_entry;
+    struct cache_entry_t *entry = &shard->entries[e];
+    shard->free_entry = entry->next;
+    entry->block = block;
+    entry->slot = shard->free_slots[--shard->n_free_slots];
+    entry->dirty = false;
+    entry->read_ahead = false;
+    shard->index[cache_index_position(shard, block)] = e;
+    list_push(shard, e, CACHE_T1);
+    return e;
+}
+
+// Returns the resident entry of block, with the lock of its shard held. On a
+// miss, a slot is made for the block, and its data is read from the disk if
+// fetch is set, with the lock released in the meantime. A block that another
+// thread is reading is waited for rather than read twice.
+static int cache_acquire(struct cache_shard_t *shard, int block, bool fetch)
+{
+    while (true)
+    {
+        int e = cache_lookup(shard, block);
+        bool loading = e >= 0 && shard->entries[e].list == CACHE_LOADING;
+        bool busy = shard->n_free_slots == 0 && shard->list_sizes[CACHE_T1] + shard->list_sizes[CACHE_T2] == 0;
+        if (loading || (busy && (e < 0 || shard->entries[e].slot == -1)))
+        {
+            pthread_cond_wait(&shard->loaded, &shard->mutex);
+            continue;
+        }
+        if (e >= 0 && shard->entries[e].slot != -1)
+        {
+            // cache hit, the first use of a block read ahead counts as the
+            // miss it saved, so that a scan read ahead stays on T1
+            list_move(shard, e, shard->entries[e].read_ahead ? CACHE_T1 : CACHE_T2);
+            shard->entries[e].read_ahead = false;
+            return e;
+        }
+
+        // cache miss
+        e = cache_admit(shard, block, e);
+        if (IS_ERROR(e) || !fetch)
+            return e;
+        int list = shard->entries[e].list;
+        list_move(shard, e, CACHE_LOADING);
+        pthread_mutex_unlock(&shard->mutex);
+        int result = disk_read_direct(CACHE_DATA(shard, e), block, 1);
+        pthread_mutex_lock(&shard->mutex);
+        pthread_cond_broadcast(&shard->loaded);
+        RET_ERR_IF(IS_ERROR(result), cache_remove(shard, e), result);
+        list_move(shard, e, list);
+        return e;
+    }
+}
+
+// Drops the cached copies of blocks in [block, block + count) without writing
+// them back, along with their ghosts. A range larger than the cache is
+// matched against every entry instead of being looked up block by block.
+void cache_invalidate(int block, int count)
+{
+    if (count <= cache_size)
+    {
+        for (int b = block; b < block + count; b++)
+        {
+            struct cache_shard_t *shard = cache_shard(b);
+            pthread_mutex_lock(&shard->mutex);
+            int e;
+            while ((e = cache_lookup(shard, b)) >= 0 && shard->entries[e].list == CACHE_LOADING)
+                pthread_cond_wait(&shard->loaded, &shard->mutex);
+            if (e >= 0)
+                cache_remove(shard, e);
+            pthread_mutex_unlock(&shard->mutex);
+        }
+        return;
+    }
+    for (int i = 0; i < n_shards; i++)
+    {
+        struct cache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (int e = 0; e < 2 * shard->size; e++)
+        {
+            struct cache_entry_t *entry = &shard->entries[e];
+            if (entry->list == -1 || entry->block < block || entry->block >= block + count)
+                continue;
+            if (entry->list == CACHE_LOADING)
+            {
+                pthread_cond_wait(&shard->loaded, &shard->mutex);
+                e = -1; // the entries may have changed meanwhile
+                continue;
+            }
+            cache_remove(shard, e);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+// Writes the dirty cached copies of blocks in [block, block + count) back to
+// the disk, so that the server sees the latest data.
+int cache_write_back(int block, int count)
+{
+    if (count <= cache_size)
+    {
+        for (int b = block; b < block + count; b++)
+        {
+            struct cache_shard_t *shard = cache_shard(b);
+            pthread_mutex_lock(&shard->mutex);
+            int e = cache_lookup(shard, b);
+            int result = (e >= 0 && shard->entries[e].dirty) ? cache_clean(shard, e) : SUCCESS;
+            pthread_mutex_unlock(&shard->mutex);
+            RET_ERR_RESULT(result);
+        }
+        return SUCCESS;
+    }
+    for (int i = 0; i < n_shards; i++)
+    {
+        struct cache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        int result = SUCCESS;
+        for (int e = 0; e < 2 * shard->size && !IS_ERROR(result); e++)
+        {
+            struct cache_entry_t *entry = &shard->entries[e];
+            if (entry->dirty && entry->block >= block && entry->block < block + count)
+                result = cache_clean(shard, e);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        RET_ERR_RESULT(result);
+    }
+    return SUCCESS;
+}
+
+// Drops the cached copies of blocks whose content is no longer needed, so that
+// they are never written back.
+void disk_invalidate(int block, int count)
+{
+    cache_invalidate(block, count);
+}
+
+// Discards n_extents extents, with one request to every server involved. The
+// blocks read as zeros afterwards.
+int disk_discard(const struct disk_extent_t *extents, int n_extents)
+{
+    LOG_DEBUG("disk: discarding %i extents\n", n_extents);
+    RET_ERR_IF(n_extents <= 0 || n_extents > DISK_MAX_EXTENTS, , INVALID_ARG_ERROR);
+
+    // logical extents -> extents of every server, a logical extent covers one
+    // range on every server
+    struct disk_extent_t server_extents[DISK_MAX_SERVERS][DISK_MAX_EXTENTS];
+    int n_server_extents[DISK_MAX_SERVERS] = {0};
+    for (int i = 0; i < n_extents; i++)
+    {
+        RET_ERR_IF(extents[i].lba + extents[i].count > n_disk_blocks, , INVALID_ARG_ERROR);
+        cache_invalidate(extents[i].lba, extents[i].count);
+
+        int starts[DISK_MAX_SERVERS], counts[DISK_MAX_SERVERS];
+        stripe_split(extents[i].lba, extents[i].count, starts, counts);
+        for (int j = 0; j < n_columns; j++)
+        {
+            if (counts[j] == 0)
+                continue;
+            server_extents[j][n_server_extents[j]].lba = starts[j];
+            server_extents[j][n_server_extents[j]].count = counts[j];
+            n_server_extents[j]++;
+        }
+    }
+
+    char payloads[DISK_MAX_SERVERS][DISK_MAX_EXTENTS * sizeof(struct disk_extent_t)];
+    struct disk_msg_t reqs[DISK_MAX_SERVERS];
+    for (int i = 0; i < n_columns; i++)
+    {
+        disk_pack_extents(payloads[i], server_extents[i], n_server_extents[i]);
+        struct disk_msg_t req = {(n_server_extents[i] > 0) ? DISK_OP_DISCARD : 0, 0, SUCCESS, 0, n_server_extents[i], 0, payloads[i], n_server_extents[i] * sizeof(struct disk_extent_t)};
+        reqs[i] = req;
+    }
+    pthread_mutex_lock(&io_mutex);
+    int result = disk_request_all(reqs, NULL, 0);
+    pthread_mutex_unlock(&io_mutex);
+    return result;
+}
+
+// Writes the cached blocks dirty since dirtied_before or earlier back to the
+// disk, at most max_blocks of them, in batches of DISK_MAX_SECTORS blocks. The
+// shards of the blocks in a batch stay locked until it is written, in order,
+// so that none of the blocks changes before it is marked clean. Returns the
+// number of blocks written.
+int cache_write_back_all(long dirtied_before, int max_blocks)
+{
+    struct write_item_t items[DISK_MAX_SECTORS];
+    char *buffer = (char *)pool_alloc(DISK_MAX_SECTORS * BLOCK_SIZE);
+    RET_ERR_IF(buffer == NULL, , BAD_ALLOC_ERROR);
+
+    int n_written = 0;
+    int n_items = 0;
+    int first_locked = 0, last_locked = -1; // shards of the batch
+    int result = SUCCESS;
+    for (int i = 0; i < n_shards && n_written + n_items < max_blocks && !IS_ERROR(result); i++)
+    {
+        struct cache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        last_locked = i;
+        if (n_items == 0)
+            first_locked = i;
+        for (int e = 0; e < 2 * shard->size && n_written + n_items < max_blocks && !IS_ERROR(result); e++)
+        {
+            struct cache_entry_t *entry = &shard->entries[e];
+            if (!entry->dirty || entry->dirty_us > dirtied_before)
+                continue;
+            struct write_item_t item = {entry->block, i, e};
+            items[n_items++] = item;
+            if (n_items == DISK_MAX_SECTORS)
+            {
+                result = cache_clean_batch(items, n_items, buffer);
+                for (int j = first_locked; j < i; j++)
+                    pthread_mutex_unlock(&shards[j].mutex);
+                first_locked = i;
+                n_written += n_items;
+                n_items = 0;
+            }
+        }
+        if (n_items == 0 || IS_ERROR(result))
+            pthread_mutex_unlock(&shard->mutex);
+    }
+    if (n_items > 0 && !IS_ERROR(result))
+    {
+        result = cache_clean_batch(items, n_items, buffer);
+        for (int j = first_locked; j <= last_locked; j++)
+            pthread_mutex_unlock(&shards[j].mutex);
+        n_written += n_items;
+    }
+    pool_free(buffer);
+    RET_ERR_RESULT(result);
+    return n_written;
+}
+
+// One pass of the flusher: the expired dirty blocks are written back, then
+// more until the dirty blocks are down to dirty_background, and the servers
+// make them durable, so that a crash loses at most the last few seconds. Past
+// dirty_background at least DISK_WRITEBACK_BATCH blocks go, so that a writer
+// just over it does not wake the flusher for a block or two at a time, which
+// would leave no runs to merge.
+static int cache_flush_background()
+{
+    int result = cache_write_back_all(now_us() - DISK_DIRTY_EXPIRE_US, INT_MAX);
+    RET_ERR_RESULT(result);
+    int n_written = result;
+    int excess = atomic_load(&n_dirty) - dirty_background;
+    if (excess > 0)
+    {
+        result = cache_write_back_all(LONG_MAX, (excess < DISK_WRITEBACK_BATCH) ? DISK_WRITEBACK_BATCH : excess);
+        RET_ERR_RESULT(result);
+        n_written += result;
+    }
+    return (n_written > 0) ? disk_flush_servers(0) : SUCCESS;
+}
+
+static struct timespec us_to_timespec(long us)
+{
+    struct timespec ts = {us / 1000000L, (us % 1000000L) * 1000};
+    return ts;
+}
+
+// Makes a pass every DISK_FLUSH_INTERVAL_US, or as soon as a writer asks.
+static void *flusher(void *arg)
+{
+    pthread_mutex_lock(&flush_mutex);
+    while (flusher_running)
+    {
+        struct timespec deadline = us_to_timespec(now_us() + DISK_FLUSH_INTERVAL_US);
+        while (flusher_running && !flush_requested)
+        {
+            if (pthread_cond_timedwait(&flush_wake, &flush_mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+        if (!flusher_running)
+            break;
+        flush_requested = false;
+        pthread_mutex_unlock(&flush_mutex);
+        int result = cache_flush_background();
+        if (IS_ERROR(result))
+            LOG_INFO("disk: background write-back failed\n");
+        pthread_mutex_lock(&flush_mutex);
+        pthread_cond_broadcast(&flush_done);
+    }
+    pthread_mutex_unlock(&flush_mutex);
+    return NULL;
+}
+
+// Called by a writer after it dirtied a block. Past dirty_background the
+// flusher is woken, and past dirty_limit the writer also waits for its pass,
+// at most DISK_FLUSH_INTERVAL_US in case the pass fails.
+static void cache_throttle()
+{
+    int dirty = atomic_load(&n_dirty);
+    if (dirty <= dirty_background)
+        return;
+    pthread_mutex_lock(&flush_mutex);
+    if (flusher_running && !flush_requested)
+    {
+        flush_requested = true;
+        pthread_cond_signal(&flush_wake);
+    }
+    if (flusher_running && dirty > dirty_limit)
+    {
+        struct timespec deadline = us_to_timespec(now_us() + DISK_FLUSH_INTERVAL_US);
+        pthread_cond_timedwait(&flush_done, &flush_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+// Sends a FLUSH with the given flags to all servers in parallel.
+int disk_flush_servers(int flags)
+{
+    struct disk_msg_t reqs[DISK_MAX_SERVERS];
+    for (int i = 0; i < n_columns; i++)
+    {
+        struct disk_msg_t req = {DISK_OP_FLUSH, flags, SUCCESS, 0, 0, 0, NULL, 0};
+        reqs[i] = req;
+    }
+    pthread_mutex_lock(&io_mutex);
+    int result = disk_request_all(reqs, NULL, 0);
+    pthread_mutex_unlock(&io_mutex);
+    return result;
+}
+
+// Writes the cache back and asks the servers to make the disk durable. Every
+// server groups the syncs of concurrent flushes.
+int disk_flush()
+{
+    LOG_DEBUG("disk: flushing\n");
+    RET_ERR_IF(n_shards == 0, , DEFAULT_ERROR);
+
+    int result = cache_write_back_all(LONG_MAX, INT_MAX);
+    RET_ERR_RESULT(result);
+    return disk_flush_servers(0);
+}
+
+// Like disk_flush(), but the writes of other clients in progress are drained
+// first, and their later writes are ordered after the flush.
+int disk_barrier()
+{
+    LOG_DEBUG("disk: barrier\n");
+    RET_ERR_IF(n_shards == 0, , DEFAULT_ERROR);
+
+    int result = cache_write_back_all(LONG_MAX, INT_MAX);
+    RET_ERR_RESULT(result);
+    return disk_flush_servers(DISK_FLAG_BARRIER);
+}
+
+int disk_zero(int block, int count)
+{
+    LOG_DEBUG("disk: zeroing %i (%i)\n", block, count);
+    RET_ERR_IF(block < 0 || count <= 0 || block + count > n_disk_blocks, , INVALID_ARG_ERROR);
+
+    cache_invalidate(block, count);
+    pthread_mutex_lock(&io_mutex);
+    int result = disk_range_request(DISK_OP_ZERO, block, count);
+    pthread_mutex_unlock(&io_mutex);
+    return result;
+}
+
+// Returns the size of chunk k of a copy of count blocks through the client,
+// and stores its position in the range.
+static int copy_chunk(int k, int count, bool backwards, int *p_position)
+{
+    int done = k * DISK_MAX_SECTORS;
+    int chunk = (count - done < DISK_MAX_SECTORS) ? count - done : DISK_MAX_SECTORS;
+    *p_position = backwards ? count - done - chunk : done;
+    return chunk;
+}
+
+int disk_copy(int dst_block, int src_block, int count)
+{
+    LOG_DEBUG("disk: copying %i -> %i (%i)\n", src_block, dst_block, count);
+    RET_ERR_IF(dst_block < 0 || src_block < 0 || count <= 0, , INVALID_ARG_ERROR);
+    RET_ERR_IF(dst_block + count > n_disk_blocks || src_block + count > n_disk_blocks, , INVALID_ARG_ERROR);
+
+    int result = cache_write_back(src_block, count);
+    RET_ERR_RESULT(result);
+    cache_invalidate(dst_block, count);
+    if (n_columns == 1)
+    {
+        struct disk_msg_t reqs[DISK_MAX_SERVERS] = {{DISK_OP_COPY, 0, SUCCESS, dst_block, count, src_block, NULL, 0}};
+        pthread_mutex_lock(&io_mutex);
+        result = disk_request_all(reqs, NULL, 0);
+        pthread_mutex_unlock(&io_mutex);
+        return result;
+    }
+
+    // the source and the destination may be on different servers, so the
+    // blocks go through the client, backwards if the ranges overlap that way.
+    // The next chunk is read while the current one is written, the two never
+    // overlap since the chunks move away from the destination.
+    char *buffers[2] = {pool_alloc(DISK_MAX_SECTORS * BLOCK_SIZE), pool_alloc(DISK_MAX_SECTORS * BLOCK_SIZE)};
+    RET_ERR_IF(buffers[0] == NULL || buffers[1] == NULL, pool_free(buffers[0]); pool_free(buffers[1]), BAD_ALLOC_ERROR);
+    bool backwards = dst_block > src_block && dst_block < src_block + count;
+    int n_chunks = (count + DISK_MAX_SECTORS - 1) / DISK_MAX_SECTORS;
+    int handle = SUCCESS;
+    for (int k = 0; k <= n_chunks; k++)
+    {
+        int position;
+        int next_handle = SUCCESS;
+        if (k < n_chunks)
+        {
+            int chunk = copy_chunk(k, count, backwards, &position);
+            next_handle = disk_read_async(buffers[k % 2], src_block + position, chunk);
+            RET_ERR_IF(IS_ERROR(next_handle), (k > 0) ? disk_wait(handle) : 0; pool_free(buffers[0]); pool_free(buffers[1]), next_handle);
+        }
+        if (k > 0)
+        {
+            int chunk = copy_chunk(k - 1, count, backwards, &position);
+            result = disk_wait(handle);
+            if (!IS_ERROR(result))
+                result = disk_write_direct(buffers[(k - 1) % 2], dst_block + position, chunk);
+            RET_ERR_IF(IS_ERROR(result), (k < n_chunks) ? disk_wait(next_handle) : 0; pool_free(buffers[0]); pool_free(buffers[1]), result);
+        }
+        handle = next_handle;
+    }
+    pool_free(buffers[0]);
+    pool_free(buffers[1]);
+    return SUCCESS;
+}
+
+// Loads the blocks that are neither cached nor being loaded, with one request
+// per run of consecutive blocks, all in flight at once. They are on the
+// LOADING list meanwhile, so that a thread that wants one waits for it rather
+// than reading it again.
+static void readahead_load(const int *blocks, int n_blocks)
+{
+    char *buffer = (char *)pool_alloc(n_blocks * BLOCK_SIZE);
+    if (buffer == NULL)
+        return;
+    int loads[DISK_MAX_ASYNC], load_entries[DISK_MAX_ASYNC], load_lists[DISK_MAX_ASYNC];
+    int n_loads = 0;
+    for (int i = 0; i < n_blocks; i++)
+    {
+        struct cache_shard_t *shard = cache_shard(blocks[i]);
+        pthread_mutex_lock(&shard->mutex);
+        int e = cache_lookup(shard, blocks[i]);
+        bool present = e >= 0 && (shard->entries[e].slot != -1 || shard->entries[e].list == CACHE_LOADING);
+        bool busy = shard->n_free_slots == 0 && shard->list_sizes[CACHE_T1] + shard->list_sizes[CACHE_T2] == 0;
+        if (!present && !busy)
+            e = cache_admit(shard, blocks[i], e);
+        if (!present && !busy && !IS_ERROR(e))
+        {
+            loads[n_loads] = blocks[i];
+            load_entries[n_loads] = e;
+            load_lists[n_loads] = shard->entries[e].list;
+            shard->entries[e].read_ahead = true;
+            list_move(shard, e, CACHE_LOADING);
+            n_loads++;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    int handles[DISK_MAX_ASYNC], run_starts[DISK_MAX_ASYNC + 1];
+    int n_runs = 0;
+    for (int i = 0; i < n_loads; n_runs++)
+    {
+        int count = 1;
+        while (i + count < n_loads && loads[i + count] == loads[i] + count)
+            count++;
+        run_starts[n_runs] = i;
+        handles[n_runs] = disk_read_async(buffer + i * BLOCK_SIZE, loads[i], count);
+        i += count;
+    }
+    run_starts[n_runs] = n_loads;
+
+    // a run that failed is left to be read on demand
+    for (int r = 0; r < n_runs; r++)
+    {
+        int result = IS_ERROR(handles[r]) ? handles[r] : disk_wait(handles[r]);
+        for (int i = run_starts[r]; i < run_starts[r + 1]; i++)
+        {
+            struct cache_shard_t *shard = cache_shard(loads[i]);
+            int e = load_entries[i];
+            pthread_mutex_lock(&shard->mutex);
+            if (IS_ERROR(result))
+                cache_remove(shard, e);
+            else
+            {
+                memcpy(CACHE_DATA(shard, e), buffer + i * BLOCK_SIZE, BLOCK_SIZE);
+                list_move(shard, e, load_lists[i]);
+            }
+            pthread_cond_broadcast(&shard->loaded);
+            pthread_mutex_unlock(&shard->mutex);
+        }
+    }
+    pool_free(buffer);
+}
+
+// Loads the queued blocks in batches of at most DISK_MAX_ASYNC.
+static void *readahead_loader(void *arg)
+{
+    int blocks[DISK_MAX_ASYNC];
+    pthread_mutex_lock(&readahead_mutex);
+    while (true)
+    {
+        while (readahead_running && n_readahead == 0)
+            pthread_cond_wait(&readahead_wake, &readahead_mutex);
+        if (!readahead_running)
+            break;
+        int n_blocks = (n_readahead < DISK_MAX_ASYNC) ? n_readahead : DISK_MAX_ASYNC;
+        for (int i = 0; i < n_blocks; i++)
+            blocks[i] = readahead_queue[(readahead_head + i) % DISK_READAHEAD_QUEUE];
+        readahead_head = (readahead_head + n_blocks) % DISK_READAHEAD_QUEUE;
+        n_readahead -= n_blocks;
+        pthread_mutex_unlock(&readahead_mutex);
+        readahead_load(blocks, n_blocks);
+        pthread_mutex_lock(&readahead_mutex);
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+    return NULL;
+}
+
+// Queues blocks to be loaded into the cache in the background, ahead of
+// their use. The queue holds at most a quarter of the cache, so that blocks
+// read ahead are not evicted before they are used. Returns the number of
+// blocks queued, the first ones, invalid blocks counting as queued.
+int disk_readahead(const int *blocks, int n_blocks)
+{
+    int max_queued = (cache_size / 4 < DISK_READAHEAD_QUEUE) ? cache_size / 4 : DISK_READAHEAD_QUEUE;
+    pthread_mutex_lock(&readahead_mutex);
+    int i = 0;
+    for (; i < n_blocks && n_readahead < max_queued && readahead_running; i++)
+    {
+        if (blocks[i] < 0 || blocks[i] >= n_disk_blocks)
+            continue;
+        readahead_queue[(readahead_head + n_readahead) % DISK_READAHEAD_QUEUE] = blocks[i];
+        n_readahead++;
+    }
+    if (n_readahead > 0)
+        pthread_cond_signal(&readahead_wake);
+    pthread_mutex_unlock(&readahead_mutex);
+    return i;
+}
+
+int disk_read(char buffer[BLOCK_SIZE], int block)
+{
+    LOG_DEBUG("disk: reading %i\n", block);
+    struct cache_shard_t *shard = cache_shard(block);
+    pthread_mutex_lock(&shard->mutex);
+    int e = cache_acquire(shard, block, true);
+    if (!IS_ERROR(e))
+        memcpy(buffer, CACHE_DATA(shard, e), BLOCK_SIZE);
+    pthread_mutex_unlock(&shard->mutex);
+    RET_ERR_RESULT(e);
+    return BLOCK_SIZE;
+}
+
+// A miss does not read the block, as it is overwritten whole.
+int disk_write(const char buffer[BLOCK_SIZE], int block)
+{
+    LOG_DEBUG("disk: writing %i\n", block);
+    struct cache_shard_t *shard = cache_shard(block);
+    pthread_mutex_lock(&shard->mutex);
+    int e = cache_acquire(shard, block, false);
+    if (!IS_ERROR(e))
+    {
+        memcpy(CACHE_DATA(shard, e), buffer, BLOCK_SIZE);
+        cache_set_dirty(&shard->entries[e], true);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    RET_ERR_RESULT(e);
+    cache_throttle();
     return BLOCK_SIZE;
 }
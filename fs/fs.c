@@ -4,17 +4,19 @@
 #include "inodes.h"
 #include "buffer.h"
 #include "blocks.h"
+#include "server.h"
 
 int cur_inode_id;
+sem_t response_mutex;
 
 void fs_close()
 {
     inodes_close();
 }
 
-void fs_init(const char *server_ip, int port)
+void fs_init(const struct disk_config_t *config)
 {
-    inodes_init(server_ip, port);
+    inodes_init(config);
     cur_inode_id = ROOT_INODE_ID;
 }
 
@@ -71,6 +73,14 @@ int error_response(int result, struct response_arg_t arg)
         return str_to_buffer("Error.", arg.res_buffer, arg.p_res_size, arg.max_size);
 }
 
+// Writes back everything cached and makes it durable on the disk servers.
+int fs_sync(struct response_arg_t arg)
+{
+    int result = inodes_sync();
+    RET_ERR_IF(IS_ERROR(result), , error_response(result, arg));
+    return str_to_buffer("Success.", arg.res_buffer, arg.p_res_size, arg.max_size);
+}
+
 int authorize(const struct context_t *p_context, struct inode_t *p_inode, enum auth_t auth)
 {
     if (p_context == NULL || p_inode == NULL)
@@ -111,6 +121,17 @@ int authorize(const struct context_t *p_context, struct inode_t *p_inode, enum a
     return PERMISSION_DENIED;
 }
 
+// Sends a chunk of a streamed response with response_mutex released, so that
+// a client slow to take it does not stall the others. Whatever was read under
+// the lock must be checked again afterwards.
+static int fs_send_chunk(const char *buffer, int size)
+{
+    sem_post(&response_mutex);
+    int result = server_send_chunk(buffer, size);
+    sem_wait(&response_mutex);
+    return (result == INVALID_ARG_ERROR) ? BUFFER_OVERFLOW : result;
+}
+
 int fs_operation_wrapper(fs_op_t fs_op, struct response_arg_t arg, enum auth_t auth)
 {
     int result;
@@ -133,10 +154,24 @@ int fs_operation_wrapper(fs_op_t fs_op, struct response_arg_t arg, enum auth_t a
     result = authorize(arg.p_context, &inode, auth);
     RET_ERR_IF(IS_ERROR(result), free(entries), error_response(result, arg));
 
+    // a streaming operation lets other requests change the directory, so
+    // its entries are saved only if the operation changed them
+    int saved_n_entries = n_entries;
+    struct dir_entry_t *saved_entries = (struct dir_entry_t *)malloc(inode.size);
+    RET_ERR_IF(saved_entries == NULL, free(entries), BAD_ALLOC_ERROR);
+    memcpy(saved_entries, entries, inode.size);
+
     // do some operations
     *arg.p_res_size = 0;
     result = fs_op(arg, &n_entries, &entries);
-    RET_ERR_IF(IS_ERROR(result), free(entries), error_response(result, arg));
+    RET_ERR_IF(IS_ERROR(result), free(entries); free(saved_entries), error_response(result, arg));
+    bool changed = n_entries != saved_n_entries || memcmp(entries, saved_entries, n_entries * DIR_ENTRY_SIZE) != 0;
+    free(saved_entries);
+    if (!changed)
+    {
+        free(entries);
+        return SUCCESS;
+    }
 
     // n_entries, entries may has been changed
     // save the changes !!!
@@ -150,10 +185,16 @@ int fs_operation_wrapper(fs_op_t fs_op, struct response_arg_t arg, enum auth_t a
     return SUCCESS;
 }
 
+// A listing larger than the response buffer is sent in chunks of whole lines.
+// It fails if the directory changes while a chunk is sent.
 int list(struct response_arg_t arg, int *p_n_entries, struct dir_entry_t **p_entries)
 {
     int total_size = 0;
     int result;
+    arg.res_buffer[0] = '\0';
+    struct inode_t dir_inode;
+    result = get_inode(arg.p_context->cur_inode_id, &dir_inode);
+    RET_ERR_RESULT(result);
     for (int i = 0; i < *p_n_entries; i++)
     {
         struct inode_t inode;
@@ -178,19 +219,25 @@ int list(struct response_arg_t arg, int *p_n_entries, struct dir_entry_t **p_ent
         struct tm *timeinfo = localtime(&timestamp);
         strftime(time_str, 30, "%b %d %H:%M", timeinfo);
 
-        int n_print = snprintf(arg.res_buffer + total_size, arg.max_size - total_size,
-                               "%s %5hu %5hu %10u %s %s\n",
+        char line[MAX_NAME_LEN + 64];
+        int n_print = snprintf(line, sizeof(line), "%s %5hu %5hu %10u %s %s\n",
                                mode_str, inode.gid, inode.uid, inode.size, time_str, (*p_entries)[i].name);
+        RET_ERR_IF(n_print >= (int)sizeof(line) || n_print >= arg.max_size, , BUFFER_OVERFLOW);
 
         if (n_print >= arg.max_size - total_size)
         {
-            *arg.p_res_size = strlen(arg.res_buffer);
-            return BUFFER_OVERFLOW;
+            result = fs_send_chunk(arg.res_buffer, total_size);
+            RET_ERR_IF(IS_ERROR(result), *arg.p_res_size = total_size, result);
+            total_size = 0;
+            struct inode_t cur_dir_inode;
+            result = get_inode(arg.p_context->cur_inode_id, &cur_dir_inode);
+            RET_ERR_RESULT(result);
+            RET_ERR_IF(cur_dir_inode.size != dir_inode.size || cur_dir_inode.mtime != dir_inode.mtime, , READ_ERROR);
         }
-
+        memcpy(arg.res_buffer + total_size, line, n_print + 1);
         total_size += n_print;
     }
-    *arg.p_res_size = strlen(arg.res_buffer);
+    *arg.p_res_size = total_size;
     return SUCCESS;
 }
 
@@ -405,12 +452,31 @@ int change_dir(struct response_arg_t arg, int *p_n_entries, struct dir_entry_t *
     return SUCCESS;
 }
 
+// Reads the file into data_buffer. A file larger than the buffer is sent in
+// chunks as it is read, and only its tail is left in the buffer. It fails if
+// the file changes while a chunk is sent.
 int catch_file_kernel(int inode_id, int size, char *data_buffer, int *data_size, int max_data_size)
 {
-    RET_ERR_IF(size > max_data_size, , BUFFER_OVERFLOW);
-    int result = inode_file_read(inode_id, data_buffer, 0, size);
+    int result;
+    int start = 0;
+    struct inode_t inode;
+    result = get_inode(inode_id, &inode);
+    RET_ERR_RESULT(result);
+    while (size - start > max_data_size)
+    {
+        result = inode_file_read(inode_id, data_buffer, start, max_data_size);
+        RET_ERR_RESULT(result);
+        result = fs_send_chunk(data_buffer, max_data_size);
+        RET_ERR_RESULT(result);
+        start += max_data_size;
+        struct inode_t cur_inode;
+        result = get_inode(inode_id, &cur_inode);
+        RET_ERR_RESULT(result);
+        RET_ERR_IF(cur_inode.size != inode.size || cur_inode.mtime != inode.mtime, , READ_ERROR);
+    }
+    result = inode_file_read(inode_id, data_buffer, start, size - start);
     RET_ERR_RESULT(result);
-    *data_size = size;
+    *data_size = size - start;
     return SUCCESS;
 }
 
@@ -5,14 +5,32 @@
 #include "error_type.h"
 #include <time.h>
 
+// A file read sequentially has its next blocks read ahead into the cache. The
+// window starts at INODE_READAHEAD_MIN blocks and doubles with every read that
+// goes on where the previous one ended, up to INODE_READAHEAD_MAX. Any other
+// read closes it, except one from the start of the file, which opens it anew.
+// The streams of the files read last are remembered.
+struct readahead_t
+{
+    int inode_id;   // -1 if unused
+    int next_block; // where a sequential read goes on
+    int window;     // blocks, 0 if closed
+    int end_block;  // the blocks before it are read or read ahead
+};
+
+static struct readahead_t streams[INODE_READAHEAD_STREAMS];
+static int next_stream = 0; // replaced next
+
 void inodes_close()
 {
     blocks_close();
 }
 
-void inodes_init(const char *server_ip, int port)
+void inodes_init(const struct disk_config_t *config)
 {
-    blocks_init(server_ip, port);
+    blocks_init(config);
+    for (int i = 0; i < INODE_READAHEAD_STREAMS; i++)
+        streams[i].inode_id = -1;
 }
 
 int inodes_format()
@@ -20,6 +38,11 @@ int inodes_format()
     return blocks_format();
 }
 
+int inodes_sync()
+{
+    return blocks_sync();
+}
+
 void nth_block_to_visit_path(int block, struct visit_path_t *p_visit_path)
 {
     if (block < BLOCK_END)
@@ -109,6 +132,8 @@ int manipulate_entry_1_block_id(struct inode_t *p_inode, int *p_block_id, struct
         *p_block_id = ib.block_ptr[visit_path.entry_1];
         break;
     }
+    if (op == GET_BLOCK_ID)
+        return SUCCESS;
 
     // save entries
     switch (visit_path.visit_type)
@@ -160,6 +185,8 @@ int manipulate_entry_2_block_id(struct inode_t *p_inode, int *p_block_id, struct
         *p_block_id = ib.block_ptr[visit_path.entry_2];
         break;
     }
+    if (op == GET_BLOCK_ID)
+        return SUCCESS;
 
     // save entries
     result = write_block(ib_id, (char *)&ib);
@@ -198,6 +225,8 @@ int manipulate_entry_3_block_id(struct inode_t *p_inode, int *p_block_id, struct
         *p_block_id = ib.block_ptr[visit_path.entry_3];
         break;
     }
+    if (op == GET_BLOCK_ID)
+        return SUCCESS;
 
     // save entries
     result = write_block(ib_id, (char *)&ib);
@@ -228,6 +257,114 @@ int visit_path_to_block_id(struct inode_t *p_inode, int *p_block_id, struct visi
     return SUCCESS;
 }
 
+// Returns in p_ib_id the indirect block that holds the pointer to the nth
+// block of the file, or -1 if the inode holds it.
+int nth_block_to_ib_id(struct inode_t *p_inode, int nth_block, int *p_ib_id)
+{
+    struct visit_path_t visit_path;
+    nth_block_to_visit_path(nth_block, &visit_path);
+    switch (visit_path.visit_type)
+    {
+    case DIRECT_PATH:
+        *p_ib_id = -1;
+        return SUCCESS;
+    case SINGLE_PATH:
+        *p_ib_id = p_inode->sblock_ptr;
+        return SUCCESS;
+    case DOUBLE_PATH:
+        return manipulate_entry_1_block_id(p_inode, p_ib_id, visit_path, GET_BLOCK_ID);
+    case TRIPLE_PATH:
+        return manipulate_entry_2_block_id(p_inode, p_ib_id, visit_path, GET_BLOCK_ID);
+    }
+    return INVALID_ARG_ERROR;
+}
+
+static void readahead_forget(int inode_id)
+{
+    for (int i = 0; i < INODE_READAHEAD_STREAMS; i++)
+    {
+        if (streams[i].inode_id == inode_id)
+            streams[i].inode_id = -1;
+    }
+}
+
+static struct readahead_t *readahead_stream(int inode_id)
+{
+    for (int i = 0; i < INODE_READAHEAD_STREAMS; i++)
+    {
+        if (streams[i].inode_id == inode_id)
+            return &streams[i];
+    }
+    struct readahead_t *stream = &streams[next_stream];
+    next_stream = (next_stream + 1) % INODE_READAHEAD_STREAMS;
+    struct readahead_t new_stream = {inode_id, 0, 0, 0};
+    *stream = new_stream;
+    return stream;
+}
+
+// Returns the stream of a read of size bytes at start if it goes on where the
+// previous read of the file ended, or NULL.
+static struct readahead_t *readahead_start(int inode_id, int start, int size)
+{
+    struct readahead_t *stream = readahead_stream(inode_id);
+    if (start == 0)
+    {
+        // a new pass over the file
+        stream->next_block = 0;
+        stream->window = 0;
+        stream->end_block = 0;
+    }
+    bool sequential = start / BLOCK_SIZE == stream->next_block;
+    stream->next_block = (start + size) / BLOCK_SIZE;
+    if (!sequential)
+    {
+        stream->window = 0;
+        stream->end_block = (start + size - 1) / BLOCK_SIZE + 1;
+        return NULL;
+    }
+    stream->window = (stream->window > 0) ? stream->window : INODE_READAHEAD_MIN;
+    return stream;
+}
+
+// Reads a window of blocks ahead of the nth block of the file once the read
+// gets within half a window of the blocks read ahead so far, and then doubles
+// the window. The indirect block one window further is read ahead too, so that
+// its pointers are cached when the window gets there. Errors are ignored.
+static void inode_readahead(struct readahead_t *stream, struct inode_t *p_inode, int nth_block)
+{
+    if (nth_block + stream->window / 2 < stream->end_block)
+        return;
+    int n_file_blocks = (p_inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int from = (nth_block + 1 > stream->end_block) ? nth_block + 1 : stream->end_block;
+    int to = (nth_block + 1 + stream->window < n_file_blocks) ? nth_block + 1 + stream->window : n_file_blocks;
+
+    // the blocks that were not queued are tried again at the next block
+    int block_ids[INODE_READAHEAD_BATCH];
+    while (from < to)
+    {
+        int n_block_ids = 0;
+        while (from + n_block_ids < to && n_block_ids < INODE_READAHEAD_BATCH)
+        {
+            struct visit_path_t visit_path;
+            nth_block_to_visit_path(from + n_block_ids, &visit_path);
+            if (IS_ERROR(visit_path_to_block_id(p_inode, &block_ids[n_block_ids], visit_path)))
+                return;
+            n_block_ids++;
+        }
+        int n_queued = readahead_blocks(block_ids, n_block_ids);
+        from += n_queued;
+        stream->end_block = from;
+        if (n_queued < n_block_ids)
+            return;
+    }
+
+    stream->window = (2 * stream->window < INODE_READAHEAD_MAX) ? 2 * stream->window : INODE_READAHEAD_MAX;
+    int ib_id;
+    int ib_block = to + stream->window;
+    if (ib_block < n_file_blocks && !IS_ERROR(nth_block_to_ib_id(p_inode, ib_block, &ib_id)) && ib_id != -1)
+        readahead_blocks(&ib_id, 1);
+}
+
 int create_inode(int *inode_id, u_int16_t mode, u_int16_t uid, u_int16_t gid)
 {
     int result = allocate_inode(inode_id);
@@ -253,6 +390,7 @@ int inode_file_resize(int inode_id, int size)
     int result = read_inode(inode_id, &inode);
     RET_ERR_RESULT(result);
 
+    readahead_forget(inode_id);
     int n_blocks = (size != 0) ? (size / BLOCK_SIZE + 1) : 0;
     int cur_n_blocks = (inode.size != 0) ? (inode.size / BLOCK_SIZE + 1) : 0;
     RET_ERR_IF(n_blocks >= MAX_SIZE || n_blocks < 0, , INVALID_ARG_ERROR);
@@ -271,22 +409,24 @@ int inode_file_resize(int inode_id, int size)
         {
             nth_block_to_visit_path(block, &cur_visit_path);
             nth_block_to_visit_path(block - 1, &next_visit_path);
-            if (cur_visit_path.entry_3 != next_visit_path.entry_3)
+            // the first block of a tree of pointers frees all its levels
+            bool first_of_tree = cur_visit_path.visit_type != next_visit_path.visit_type;
+            if (cur_visit_path.visit_type >= TRIPLE_PATH && (first_of_tree || cur_visit_path.entry_3 != next_visit_path.entry_3))
             {
                 result = manipulate_entry_3_block_id(&inode, &discard_block_id, cur_visit_path, DEALLOCATE_BLOCK_ID);
                 RET_ERR_RESULT(result);
             }
-            if (cur_visit_path.entry_2 != next_visit_path.entry_2)
+            if (cur_visit_path.visit_type >= DOUBLE_PATH && (first_of_tree || cur_visit_path.entry_2 != next_visit_path.entry_2))
             {
                 result = manipulate_entry_2_block_id(&inode, &discard_block_id, cur_visit_path, DEALLOCATE_BLOCK_ID);
                 RET_ERR_RESULT(result);
             }
-            if (cur_visit_path.entry_1 != next_visit_path.entry_1)
+            if (first_of_tree || cur_visit_path.entry_1 != next_visit_path.entry_1)
             {
                 result = manipulate_entry_1_block_id(&inode, &discard_block_id, cur_visit_path, DEALLOCATE_BLOCK_ID);
                 RET_ERR_RESULT(result);
             }
-            if (cur_visit_path.visit_type != next_visit_path.visit_type)
+            if (first_of_tree)
             {
                 switch (cur_visit_path.visit_type)
                 {
@@ -315,7 +455,9 @@ int inode_file_resize(int inode_id, int size)
         {
             nth_block_to_visit_path(block - 1, &prev_visit_path);
             nth_block_to_visit_path(block, &cur_visit_path);
-            if (cur_visit_path.visit_type != prev_visit_path.visit_type)
+            // the first block of a tree of pointers allocates all its levels
+            bool first_of_tree = cur_visit_path.visit_type != prev_visit_path.visit_type;
+            if (first_of_tree)
             {
                 switch (cur_visit_path.visit_type)
                 {
@@ -332,17 +474,17 @@ int inode_file_resize(int inode_id, int size)
                 }
                 RET_ERR_RESULT(result);
             }
-            if (cur_visit_path.entry_1 != prev_visit_path.entry_1)
+            if (first_of_tree || cur_visit_path.entry_1 != prev_visit_path.entry_1)
             {
                 result = manipulate_entry_1_block_id(&inode, &new_block_id, cur_visit_path, ALLOCATE_BLOCK_ID);
                 RET_ERR_RESULT(result);
             }
-            if (cur_visit_path.entry_2 != prev_visit_path.entry_2)
+            if (cur_visit_path.visit_type >= DOUBLE_PATH && (first_of_tree || cur_visit_path.entry_2 != prev_visit_path.entry_2))
             {
                 result = manipulate_entry_2_block_id(&inode, &new_block_id, cur_visit_path, ALLOCATE_BLOCK_ID);
                 RET_ERR_RESULT(result);
             }
-            if (cur_visit_path.entry_3 != prev_visit_path.entry_3)
+            if (cur_visit_path.visit_type >= TRIPLE_PATH && (first_of_tree || cur_visit_path.entry_3 != prev_visit_path.entry_3))
             {
                 result = manipulate_entry_3_block_id(&inode, &new_block_id, cur_visit_path, ALLOCATE_BLOCK_ID);
                 RET_ERR_RESULT(result);
@@ -366,36 +508,26 @@ int inode_file_read(int inode_id, char *buffer, int start, int size)
     struct inode_t inode;
     result = read_inode(inode_id, &inode);
     RET_ERR_RESULT(result);
+    struct readahead_t *stream = (size > 0) ? readahead_start(inode_id, start, size) : NULL;
 
-    int block_buffer_id;
+    // one block at a time, its pointers are looked up once
     char block_buffer[BLOCK_SIZE];
-
-    struct visit_path_t visit_path;
-    nth_block_to_visit_path(start / BLOCK_SIZE, &visit_path);
-    result = visit_path_to_block_id(&inode, &block_buffer_id, visit_path);
-    RET_ERR_RESULT(result);
-
-    result = read_block(block_buffer_id, block_buffer);
-    RET_ERR_RESULT(result);
-
-    int block_id;
-    for (int addr = start; addr < start + size; addr++)
+    for (int addr = start; addr < start + size;)
     {
         int nth_block = addr / BLOCK_SIZE;
+        int offset = addr % BLOCK_SIZE;
+        int n_bytes = (BLOCK_SIZE - offset < start + size - addr) ? BLOCK_SIZE - offset : start + size - addr;
+        if (stream != NULL)
+            inode_readahead(stream, &inode, nth_block);
         struct visit_path_t visit_path;
         nth_block_to_visit_path(nth_block, &visit_path);
+        int block_id;
         result = visit_path_to_block_id(&inode, &block_id, visit_path);
         RET_ERR_RESULT(result);
-
-        // The block_id to be accessed is not the block_id of the block stored
-        // in the buffer.
-        if (block_buffer_id != block_id)
-        {
-            result = read_block(block_id, block_buffer);
-            RET_ERR_RESULT(result);
-            block_buffer_id = block_id;
-        }
-        buffer[addr - start] = block_buffer[addr % BLOCK_SIZE];
+        result = read_block(block_id, block_buffer);
+        RET_ERR_RESULT(result);
+        memcpy(buffer + addr - start, block_buffer + offset, n_bytes);
+        addr += n_bytes;
     }
 
     inode.atime = time(NULL);
@@ -444,7 +576,7 @@ int inode_file_write(int inode_id, const char *buffer, int start, int size)
         }
         block_buffer[addr % BLOCK_SIZE] = buffer[addr - start];
     }
-    result = write_block(block_id, block_buffer);
+    result = write_block(block_buffer_id, block_buffer);
     RET_ERR_RESULT(result);
 
     inode.atime = time(NULL);
@@ -2,12 +2,15 @@
 #define BLOCKS_H
 
 #include "fsconfig.h"
+#include "disk.h"
 
 void blocks_close();
 
 int blocks_format();
 
-void blocks_init(const char *server_ip, int port);
+void blocks_init(const struct disk_config_t *config);
+
+int blocks_sync();
 
 int deallocate_inode(int inode_id);
 
@@ -23,6 +26,8 @@ int allocate_block(int *block_id);
 
 int read_block(int block_id, char block[BLOCK_SIZE]);
 
+int readahead_blocks(const int *block_ids, int count);
+
 int write_block(int block_id, const char block[BLOCK_SIZE]);
 
 #endif
\ No newline at end of file
@@ -4,10 +4,14 @@
 
 typedef int (*get_request_t)(char *req_buffer, int *req_size, int max_req_size, int cycle);
 
-typedef int (*handle_response_t)(const char *res_buffer, int res_size, int cycle);
+// A response sent in chunks is handled chunk by chunk, more is set on every
+// chunk but the last one.
+typedef int (*handle_response_t)(const char *res_buffer, int res_size, int cycle, bool more);
 
 void simple_client(const char *server_ip, int port, get_request_t get_request, handle_response_t handle_response);
 
+void client_set_compression(bool on);
+
 void custom_client_init(const char *server_ip, int port, response_t *response);
 
 void custom_client_close();
@@ -0,0 +1,10 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "common.h"
+
+long now_us();
+
+void sleep_until_us(long deadline_us);
+
+#endif
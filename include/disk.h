@@ -2,10 +2,59 @@
 #define DISK_H
 
 #include "fsconfig.h"
+#include "protocol.h"
 
-#define CACHE_SIZE 1024
+#define DISK_DEFAULT_CACHE_SIZE 1024 // blocks
+#define DISK_MAX_CACHE_SIZE (1 << 26)
+#define DISK_CACHE_SHARDS 16 // locked independently, a power of two
+#define DISK_CACHE_SHARD_RUN 16 // consecutive blocks in the same shard, a power of two
+#define DISK_DIRTY_BACKGROUND_RATIO 10 // % of the cache dirty before the flusher writes back
+#define DISK_DIRTY_RATIO 40            // % of the cache dirty before writers wait
+#define DISK_DIRTY_EXPIRE_US 5000000   // age at which a dirty block is written back
+#define DISK_FLUSH_INTERVAL_US 1000000
+#define DISK_READAHEAD_QUEUE 1024 // blocks waiting to be read ahead
+#define DISK_EVICT_BATCH 32       // blocks looked at to write back with a dirty victim
+#define DISK_WRITEBACK_BATCH 64   // blocks written back at least past the background ratio
 
-void disk_init(const char *server_ip, int port);
+#define DISK_MAX_SERVERS 16
+#define DISK_DEFAULT_STRIPE_UNIT 32
+#define DISK_MIRROR_REGION_SIZE 1024
+#define DISK_MIRROR_RETRY_US 1000000
+#define DISK_MIRROR_MIN_SPLIT 8
+#define DISK_MAX_INFLIGHT 256       // requests in flight to all servers
+#define DISK_MAX_SERVER_INFLIGHT 16 // requests in flight to one server
+#define DISK_MAX_ASYNC 64
+
+struct disk_endpoint_t
+{
+    const char *ip;
+    int port;
+};
+
+// How reads are routed when the disk servers mirror each other.
+enum disk_mirror_t
+{
+    DISK_MIRROR_NONE,    // not mirrored, striped
+    DISK_MIRROR_NEAREST, // replica whose arm is closest to the target cylinder
+    DISK_MIRROR_LOAD,    // replica that has served the fewest blocks
+};
+
+// The logical blocks are striped across the disk servers in units of
+// stripe_unit blocks: unit k is stored on server k % n_servers. If mirror is
+// set, every server holds a full copy of the disk instead. The cache holds
+// cache_size blocks, or DISK_DEFAULT_CACHE_SIZE if it is 0.
+struct disk_config_t
+{
+    int n_servers;
+    struct disk_endpoint_t servers[DISK_MAX_SERVERS];
+    int stripe_unit;
+    enum disk_mirror_t mirror;
+    int cache_size;
+};
+
+int parse_disk_mirror(const char *name, enum disk_mirror_t *p_mirror);
+
+void disk_init(const struct disk_config_t *config);
 
 void disk_close();
 
@@ -15,4 +64,30 @@ int disk_read(char buffer[BLOCK_SIZE], int block);
 
 int disk_write(const char buffer[BLOCK_SIZE], int block);
 
+int disk_zero(int block, int count);
+
+int disk_copy(int dst_block, int src_block, int count);
+
+int disk_discard(const struct disk_extent_t *extents, int n_extents);
+
+void disk_invalidate(int block, int count);
+
+int disk_readahead(const int *blocks, int n_blocks);
+
+int disk_flush();
+
+int disk_barrier();
+
+// Asynchronous transfers below the cache: every request is sent with a tag
+// and the servers may complete them in any order, so that many requests are
+// in flight at once. A transfer returns a handle, and disk_wait() returns its
+// result. The cached copies of the blocks are not looked at.
+int disk_read_async(char *buffer, int block, int count);
+
+int disk_write_async(const char *buffer, int block, int count);
+
+bool disk_poll(int handle);
+
+int disk_wait(int handle);
+
 #endif
\ No newline at end of file
@@ -98,7 +98,7 @@
 #define NOT_FOUND -9
 #define ALREADY_EXISTS -10
 
-#define IS_ERROR(result) result < 0
+#define IS_ERROR(result) ((result) < 0)
 
 #define RET_ERR_RESULT(result) RET_ERR_IF(IS_ERROR(result), , result);
 
@@ -6,10 +6,15 @@
 #define MAX_PASSWORD_LEN 248
 
 #include "common.h"
+#include "disk.h"
+
+// Held while a request is answered, and released by a response that is
+// streamed while it sends a chunk.
+extern sem_t response_mutex;
 
 void fs_close();
 
-void fs_init(const char *server_ip, int port);
+void fs_init(const struct disk_config_t *config);
 
 int fs_format();
 
@@ -79,6 +84,8 @@ typedef int (*fs_op_t)(struct response_arg_t arg, int *p_n_entries, struct dir_e
 
 int fs_operation_wrapper(fs_op_t fs_op, struct response_arg_t arg, enum auth_t auth);
 
+int fs_sync(struct response_arg_t arg);
+
 int list(struct response_arg_t arg, int *p_n_entries, struct dir_entry_t **entries);
 
 int make_file(struct response_arg_t arg, int *p_n_entries, struct dir_entry_t **p_entries);
@@ -3,6 +3,12 @@
 
 #include "common.h"
 #include "fsconfig.h"
+#include "disk.h"
+
+#define INODE_READAHEAD_STREAMS 16 // files whose reads are followed
+#define INODE_READAHEAD_MIN 8      // blocks
+#define INODE_READAHEAD_MAX 128
+#define INODE_READAHEAD_BATCH 64   // blocks queued at once
 
 /* This structure is similar to a clock, where
  * entry_1, entry_2, entry_3 are hours, minutes,
@@ -52,10 +58,12 @@ enum op_t
 
 void inodes_close();
 
-void inodes_init(const char *server_ip, int port);
+void inodes_init(const struct disk_config_t *config);
 
 int inodes_format();
 
+int inodes_sync();
+
 int create_inode(int *inode_id, u_int16_t mode, u_int16_t uid, u_int16_t gid);
 
 int delete_inode(int inode_id);
@@ -0,0 +1,59 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "common.h"
+
+/*
+ *  Asynchronous logging:
+ *
+ *  - Every thread formats its messages into a ring of its own, which it owns
+ *    alone, so logging takes no lock and does no I/O.
+ *  - A background writer drains the rings in the order the messages were
+ *    logged and writes them to stdout in batches.
+ *  - If the ring of a thread is full, its messages are dropped and counted
+ *    instead of blocking the thread.
+ *
+ *  Messages above LOG_COMPILE_LEVEL are compiled out, and messages above the
+ *  runtime level are skipped before they are formatted.
+ */
+
+enum log_level_t
+{
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SIZE 1024 // messages, a power of 2
+#define LOG_MESSAGE_SIZE 128
+#define LOG_WRITER_INTERVAL_US 10000
+
+extern enum log_level_t log_level;
+
+#define LOG(level, format, ...)                                          \
+    do                                                                   \
+    {                                                                    \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level)        \
+            log_write(format, ##__VA_ARGS__);                            \
+    }                                                                    \
+    while (0)
+
+#define LOG_ERROR(format, ...) LOG(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+int parse_log_level(const char *name, enum log_level_t *p_level);
+
+void log_init(enum log_level_t level);
+
+void log_close();
+
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void log_flush();
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include "common.h"
+
+/*
+ *  A small LZ77 codec in the block format of LZ4: a sequence is a token with
+ *  the number of literals and the length of the match, the literals, and the
+ *  offset of the match as two bytes in little endian. Lengths that do not fit
+ *  in the token go on in bytes of 255. Matches are found with a hash table of
+ *  4-byte prefixes, so compression makes one pass and decompression only
+ *  copies bytes.
+ *
+ *  lz_compress returns BUFFER_OVERFLOW if the compressed block does not fit,
+ *  which tells incompressible data apart. lz_decompress checks every length
+ *  and offset against both buffers, so corrupted data gives READ_ERROR.
+ */
+
+#define LZ_MAX_COMPRESSED_SIZE(size) ((size) + (size) / 255 + 16)
+
+int lz_compress(const char *src, int src_size, char *dst, int max_dst_size);
+
+int lz_decompress(const char *src, int src_size, char *dst, int max_dst_size);
+
+#endif
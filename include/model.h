@@ -0,0 +1,31 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include "common.h"
+
+/*
+ *  Timing model of the basic disk server:
+ *
+ *  - Seek: delay microseconds per cylinder the arm moves over.
+ *  - Rotation (optional, rpm > 0): the platter spins at rpm, and its position
+ *    is derived from the clock. After a seek, the head waits until the first
+ *    sector of the request passes under it, then the sectors are transferred
+ *    at the speed they pass under the head.
+ *  - Track buffer (optional, n_track_buffers > 0): each read leaves the whole
+ *    track of its cylinders in an LRU buffer of n_track_buffers tracks, so
+ *    later reads of buffered tracks are served without any delay and without
+ *    moving the arm. Writes go through to the platter.
+ *
+ *  The model keeps the position of the arm, so it must only be used by the
+ *  owner of the arm.
+ */
+
+void model_init(int n_sectors, int delay, int rpm, int n_track_buffers);
+
+void model_close();
+
+long model_access(bool read, long lba, int count, long start_us);
+
+void model_print_stats();
+
+#endif
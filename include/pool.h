@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "common.h"
+
+/*
+ *  Pool of buffers in size classes of powers of two, from 2^POOL_MIN_SHIFT to
+ *  2^POOL_MAX_SHIFT bytes. A freed buffer is kept for reuse, first in a small
+ *  cache of the thread, which takes no lock, then in a shared list of its
+ *  class. Both are last in, first out, so the buffer handed out is the one
+ *  touched last. Larger buffers are allocated and freed directly.
+ *
+ *  A pool_buffer_t is a buffer that grows on demand, held by a connection
+ *  across its requests and given back to the pool when the connection ends.
+ */
+
+#define POOL_MIN_SHIFT 8         // 256 bytes
+#define POOL_MAX_SHIFT 17        // 128 KB
+#define POOL_THREAD_CACHE_SIZE 4 // buffers of a class cached by a thread
+#define POOL_SHARED_SIZE 64      // buffers of a class kept in the shared list
+
+struct pool_buffer_t
+{
+    char *data;
+    int capacity;
+};
+
+void *pool_alloc(int size);
+
+void pool_free(void *buffer);
+
+int pool_capacity(const void *buffer);
+
+int pool_reserve(struct pool_buffer_t *buffer, int size);
+
+void pool_release(struct pool_buffer_t *buffer);
+
+#endif
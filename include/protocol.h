@@ -0,0 +1,126 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "common.h"
+
+/*
+ *  Binary disk protocol:
+ *
+ *  Request:
+ *  | magic | opcode | flags | lba | count | arg | payload |
+ *      1       1       2      4      4      4     ...
+ *
+ *  Response:
+ *  | magic | opcode | flags | status | count | payload |
+ *      1       1       2       4        4      ...
+ *
+ *  - magic: DISK_MAGIC, never a printable character, so binary requests and
+ *           the text requests of BDC_command ("I", "R", "W") can be served on
+ *           the same port.
+ *  - lba: logical sector address, cylinder * n_sectors + sector.
+ *  - count: number of sectors (READ, WRITE, COPY, ZERO) or number of extents
+ *           (READV, WRITEV).
+ *  - arg: source lba of COPY, unused otherwise.
+ *  - status: SUCCESS or an error code of error_type.h.
+ *  - All fields are in network byte order.
+ *
+ *  Opcodes:
+ *  - INFO: payload of the response is n_cylinders and n_sectors (2 x u32).
+ *  - READ: reads count sectors starting at lba.
+ *  - WRITE: writes count sectors starting at lba, data in the payload.
+ *  - READV: reads count extents, the payload is an array of disk_extent_t.
+ *  - WRITEV: writes count extents, the payload is an array of disk_extent_t
+ *            followed by the data of all extents.
+ *  - COPY: copies count sectors from arg to lba on the server side.
+ *  - ZERO: fills count sectors starting at lba with zeros.
+ *  - DISCARD: discards count extents, the payload is an array of
+ *             disk_extent_t. Discarded sectors read as zeros, and their space
+ *             is returned to the host file system where possible.
+ *  - FLUSH: returns once all writes completed before the request are durable.
+ *           The syncs of concurrent flushes are grouped. With
+ *           DISK_FLAG_BARRIER, the writes in progress are drained first, and
+ *           later writes only start once the flush is over.
+ */
+
+#define DISK_MAGIC 0xD5
+
+#define DISK_OP_INFO 1
+#define DISK_OP_READ 2
+#define DISK_OP_WRITE 3
+#define DISK_OP_READV 4
+#define DISK_OP_WRITEV 5
+#define DISK_OP_COPY 6
+#define DISK_OP_ZERO 7
+#define DISK_OP_FLUSH 8
+#define DISK_OP_DISCARD 9
+
+#define DISK_FLAG_BARRIER 0x1
+
+#define DISK_SECTOR_SIZE 256
+
+// transfer limits of a single request, so that both the request and the
+// response fit in DEFAULT_BUFFER_CAPACITY
+#define DISK_MAX_SECTORS 128
+#define DISK_MAX_EXTENTS 64
+
+#pragma pack(1)
+struct disk_req_header_t
+{
+    u_int8_t magic;
+    u_int8_t opcode;
+    u_int16_t flags;
+    u_int32_t lba;
+    u_int32_t count;
+    u_int32_t arg;
+};
+
+struct disk_res_header_t
+{
+    u_int8_t magic;
+    u_int8_t opcode;
+    u_int16_t flags;
+    int32_t status;
+    u_int32_t count;
+};
+
+struct disk_extent_t
+{
+    u_int32_t lba;
+    u_int32_t count;
+};
+#pragma pack()
+
+#define DISK_REQ_HEADER_SIZE ((int)sizeof(struct disk_req_header_t))
+#define DISK_RES_HEADER_SIZE ((int)sizeof(struct disk_res_header_t))
+
+// Decoded request or response, in host byte order. The payload points into
+// the message buffer.
+struct disk_msg_t
+{
+    int opcode;
+    int flags;
+    int status;
+    u_int32_t lba;
+    u_int32_t count;
+    u_int32_t arg;
+    const char *payload;
+    int payload_size;
+};
+
+bool is_disk_message(const char *buffer, int size);
+
+void disk_pack_request_header(char buffer[DISK_REQ_HEADER_SIZE], const struct disk_msg_t *msg);
+
+int disk_pack_request(char *buffer, int *p_size, int max_size, const struct disk_msg_t *msg);
+
+int disk_unpack_request(const char *buffer, int size, struct disk_msg_t *msg);
+
+int disk_pack_response(char *buffer, int *p_size, int max_size, const struct disk_msg_t *msg);
+
+int disk_unpack_response(const char *buffer, int size, struct disk_msg_t *msg);
+
+void disk_pack_extents(char *buffer, const struct disk_extent_t *extents, int n_extents);
+
+void disk_unpack_extents(const char *buffer, struct disk_extent_t *extents, int n_extents);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "common.h"
+
+/*
+ *  Request scheduler of the basic disk server:
+ *
+ *  Requests of all connections are queued, and a single dispatcher thread
+ *  decides in which order the arm serves them:
+ *  - none: no queue, requests race for the disk mutex.
+ *  - fifo: arrival order.
+ *  - sstf: shortest seek time first.
+ *  - scan: elevator, sweeps up and down the cylinders.
+ *  - clook: circular LOOK, sweeps up and jumps back to the lowest pending
+ *           cylinder.
+ *
+ *  Queued reads (or writes) whose sector ranges are adjacent are merged into
+ *  one batch and served by a single sweep of the arm. A request that has
+ *  waited longer than max_wait_us is served next regardless of the policy.
+ *
+ *  With exclusive batches, the next batch is only dispatched once all
+ *  requests of the current one are completed. Otherwise the callers protect
+ *  their transfers themselves, and the arm moves on as soon as it is free.
+ */
+
+enum sched_policy_t
+{
+    SCHED_POLICY_NONE,
+    SCHED_POLICY_FIFO,
+    SCHED_POLICY_SSTF,
+    SCHED_POLICY_SCAN,
+    SCHED_POLICY_CLOOK,
+};
+
+enum sched_op_t
+{
+    SCHED_OP_READ,
+    SCHED_OP_WRITE,
+    SCHED_OP_OTHER,   // never merged
+    SCHED_OP_DISCARD, // does not move the arm
+};
+
+#define SCHED_MAX_BATCH 64
+#define SCHED_DEFAULT_MAX_WAIT_US 100000
+
+struct sched_req_t;
+
+// Moves the arm over the sectors of the request, paying the service time.
+typedef void (*arm_serve_t)(const struct sched_req_t *req);
+
+struct sched_req_t
+{
+    enum sched_op_t op;
+    long lba;     // first sector
+    int count;    // number of sectors
+    long src_lba; // first source sector of a copy, -1 otherwise
+
+    // the request arrives at arrive_us, and the arm starts serving it at
+    // start_us
+    long arrive_us;
+    long start_us;
+
+    // internal
+    long enqueue_us;
+    sem_t granted;
+    struct sched_req_t *prev;
+    struct sched_req_t *next;
+};
+
+int parse_sched_policy(const char *name, enum sched_policy_t *p_policy);
+
+const char *sched_policy_name(enum sched_policy_t policy);
+
+void sched_init(enum sched_policy_t policy, int n_sectors, int max_wait_us, arm_serve_t arm_serve, bool exclusive_batches);
+
+void sched_close();
+
+void sched_submit(struct sched_req_t *req);
+
+void sched_complete(struct sched_req_t *req);
+
+void sched_print_stats();
+
+#endif
@@ -1,11 +1,48 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "common.h"
+
 typedef int (*response_t)(int sockfd, const char *req_buffer, int req_size, char *res_buffer, int *p_res_size, int max_res_size);
 
-#define MAX_CLIENTS FD_SETSIZE
+// connections are refused if their socket is not below MAX_CLIENTS, so that
+// per-connection state can be indexed by socket
+#define MAX_CLIENTS 65536
 #define DEFAULT_MAX_MESSAGE_LEN 16384
+#define SERVER_SEND_TIMEOUT_US 10000000 // a client taking no data for that long is dropped
+
+/*
+ *  Two ways to serve the clients:
+ *
+ *  - simple_server: one thread per connection, which receives a request,
+ *    calls response and sends the response back in turn.
+ *  - reactor_server: one thread waits for all connections with epoll and
+ *    reads their requests without blocking, and n_workers threads call
+ *    response and send the responses. A connection takes no thread and no
+ *    buffer while it is idle. Its untagged requests are answered one at a
+ *    time and in order, its tagged requests (see socket.h) are answered
+ *    concurrently and the responses are sent as they complete.
+ *
+ *  Both send the response of a tagged request with the tag of the request.
+ *
+ *  A response function whose response does not fit in res_buffer can send it
+ *  in chunks: it fills res_buffer, hands it to server_send_chunk and starts
+ *  over, and returns the last chunk as usual. server_send_chunk blocks while
+ *  the client has not taken the previous chunks, so a large response is never
+ *  held whole by the server, but fails after SERVER_SEND_TIMEOUT_US, and the
+ *  connection is dropped.
+ */
 
 int simple_server(int port, response_t response);
 
-#endif
\ No newline at end of file
+int reactor_server(int port, response_t response, int n_workers);
+
+bool server_register_connection(int sockfd);
+
+long server_connection_id(int sockfd);
+
+void server_set_nodelay(bool on);
+
+int server_send_chunk(const char *buffer, int size);
+
+#endif
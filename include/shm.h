@@ -0,0 +1,46 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "common.h"
+#include "server.h"
+
+/*
+ *  Shared-memory transport between a client and a server on the same host.
+ *
+ *  The client creates a region with a submission ring, a completion ring and
+ *  an arena of SHM_SLOTS slots, and passes it to the server over a
+ *  Unix-domain socket, which afterwards only tells either side that the other
+ *  one is gone. The client writes a request in place into the request half
+ *  of a slot and submits the slot with a tag, the server calls the response
+ *  function on it and writes the response into the response half of the same
+ *  slot. No message goes through the kernel or is copied on the way. A side
+ *  that finds its ring empty sleeps on a futex in the region.
+ *
+ *  Every ring has one producer and one consumer: the client must not be used
+ *  by several threads at once, and the server serves a channel with one
+ *  thread, in order.
+ */
+
+#define SHM_SLOTS 32
+#define SHM_SLOT_SIZE DEFAULT_BUFFER_CAPACITY
+#define SHM_CHECK_INTERVAL_MS 100 // how often a waiting side checks its peer
+
+struct shm_channel_t;
+
+int shm_connect(const char *path, struct shm_channel_t **p_chan);
+
+void shm_close(struct shm_channel_t *chan);
+
+int shm_reserve(struct shm_channel_t *chan, char **p_buffer);
+
+int shm_submit(struct shm_channel_t *chan, int slot, uint32_t tag, int size);
+
+bool shm_ready(struct shm_channel_t *chan);
+
+int shm_receive(struct shm_channel_t *chan, uint32_t *p_tag, int *p_slot, const char **p_buffer, int *p_size);
+
+void shm_release(struct shm_channel_t *chan, int slot);
+
+void shm_server(const char *path, response_t response);
+
+#endif
@@ -2,9 +2,36 @@
 #define SOCKET_H
 
 #include "common.h"
+#include "pool.h"
+#include <sys/uio.h>
 
 #define MAX_READ_TIMES 1024
 
+/*
+ *  A message is sent as its length in network order followed by its bytes. If
+ *  the top bit of the length is set, the length is followed by a tag in
+ *  network order, which the peer copies into the response, so that a client
+ *  can keep many requests in flight on one connection and match the
+ *  responses that come back in any order. Tag 0 is never sent.
+ *
+ *  A response too large for one message is sent as a sequence of chunks with
+ *  the same tag. The second bit of the length is set on every chunk but the
+ *  last one. Only recv_message_chunk accepts chunks.
+ *
+ *  A client can offer compression with an empty message that has the third
+ *  bit of the length set, before any other message, and the server accepts it
+ *  by answering the same. From then on, either side compresses the messages
+ *  of at least SOCKET_COMPRESS_THRESHOLD bytes that shrink with the LZ codec
+ *  (lz.h), sets the third bit on them and puts the original size in front of
+ *  the compressed data. The receive functions decompress them on the way.
+ */
+#define MESSAGE_TAGGED 0x80000000u
+#define MESSAGE_MORE 0x40000000u
+#define MESSAGE_COMPRESSED 0x20000000u
+#define SOCKET_MAX_IOVECS 8
+#define SOCKET_MAX_FDS 65536
+#define SOCKET_COMPRESS_THRESHOLD 1024
+
 int create_socket();
 
 void bind_socket(int sockfd, uint16_t port);
@@ -15,10 +42,40 @@ int wait_for_client(int sockfd);
 
 void connect_to_server(int sockfd, const char* ip, uint16_t port);
 
+int try_connect_to_server(const char *ip, uint16_t port);
+
+void socket_set_nodelay(int sockfd, bool on);
+
+void socket_set_cork(int sockfd, bool on);
+
 int send_message(int sockfd, const char *buffer, int size);
 
 int recv_message(int sockfd, char *buffer, int *p_size, int max_size);
 
+int send_tagged_message(int sockfd, uint32_t tag, const char *buffer, int size);
+
+int send_tagged_messagev(int sockfd, uint32_t tag, const struct iovec *data, int n_data);
+
+int recv_tagged_message(int sockfd, uint32_t *p_tag, char *buffer, int *p_size, int max_size);
+
+int send_message_chunk(int sockfd, uint32_t tag, const char *buffer, int size, bool more);
+
+int recv_message_chunk(int sockfd, uint32_t *p_tag, char *buffer, int *p_size, int max_size, bool *p_more);
+
+int recv_pooled_message(int sockfd, uint32_t *p_tag, struct pool_buffer_t *buffer, int *p_size, int max_size);
+
+void socket_set_compression(int sockfd, bool on);
+
+bool socket_compression(int sockfd);
+
+int socket_offer_compression(int sockfd);
+
+int compress_message(const char *data, int size, char **p_buffer);
+
+int decompressed_size(const char *data, int size);
+
+int decompress_message(const char *data, int size, char *buffer, int max_size);
+
 void sigpipe_handler(int sig);
 
 #endif
\ No newline at end of file
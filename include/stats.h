@@ -0,0 +1,41 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "common.h"
+#include "scheduler.h"
+
+/*
+ *  Statistics of the basic disk server, returned by the S command:
+ *
+ *  - Requests: reads, writes and other requests (copy, zero, discard), and the
+ *    sectors they cover, in total and for every client.
+ *  - Histograms of the seek distance of every access of the arm, of the time
+ *    requests wait before the arm starts serving them, and of their service
+ *    time, summarized as p50/p99/p999. The buckets are logarithmic with 8
+ *    linear steps each, so a percentile is at most 12.5% above the truth.
+ *  - Heatmap: the accesses to every cylinder, summed over at most
+ *    STATS_HEATMAP_BANDS bands of cylinders.
+ *
+ *  All counters are updated atomically, so they can be recorded by any
+ *  thread. With a dump file, the statistics are also written to it every
+ *  STATS_DUMP_INTERVAL_US.
+ */
+
+#define STATS_MAX_CLIENTS 64 // clients beyond are counted as "other"
+#define STATS_HISTOGRAM_BUCKETS 512
+#define STATS_HEATMAP_BANDS 64
+#define STATS_DUMP_INTERVAL_US 1000000
+
+void stats_init(int n_cylinders, int n_sectors, const char *dump_filename);
+
+void stats_close();
+
+void stats_set_client(int sockfd);
+
+void stats_record_seek(int distance);
+
+void stats_record_request(const struct sched_req_t *req, long wait_us, long service_us);
+
+int stats_format(char *buffer, int max_size);
+
+#endif
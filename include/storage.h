@@ -0,0 +1,62 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "common.h"
+
+/*
+ *  Storage backends of the basic disk server:
+ *
+ *  - mmap: the whole disk file is mapped, and requests are served by copying
+ *          from or to the mapping. Durability needs msync.
+ *  - direct: the disk file is opened with O_DIRECT and accessed with
+ *            pread/pwrite, bypassing the page cache.
+ *  - uring: like direct, but the reads and writes are submitted through an
+ *           io_uring owned by the calling thread. Falls back to direct if
+ *           io_uring is not available.
+ *
+ *  O_DIRECT transfers must be aligned to STORAGE_ALIGN, so the direct backends
+ *  go through aligned bounce buffers taken from a fixed pool, which are also
+ *  registered with the io_urings. Unaligned writes read the partial blocks at
+ *  their edges first, under a lock striped by block. If the file system does
+ *  not support O_DIRECT, the file is opened without it.
+ *
+ *  Discarded ranges are punched out of the file where they cover whole
+ *  aligned blocks, and zeroed otherwise.
+ *
+ *  Offsets and sizes are in bytes.
+ */
+
+enum storage_backend_t
+{
+    STORAGE_BACKEND_MMAP,
+    STORAGE_BACKEND_DIRECT,
+    STORAGE_BACKEND_URING,
+};
+
+#define STORAGE_ALIGN 4096
+#define STORAGE_CHUNK_SIZE (128 * 256)
+#define STORAGE_POOL_SIZE 32
+#define STORAGE_EDGE_LOCKS 256
+#define STORAGE_URING_DEPTH 8
+
+int parse_storage_backend(const char *name, enum storage_backend_t *p_backend);
+
+const char *storage_backend_name(enum storage_backend_t backend);
+
+void storage_init(const char *filename, long size, enum storage_backend_t backend);
+
+void storage_close();
+
+int storage_read(char *buffer, long offset, long size);
+
+int storage_write(const char *buffer, long offset, long size);
+
+int storage_copy(long dst_offset, long src_offset, long size);
+
+int storage_zero(long offset, long size);
+
+int storage_discard(long offset, long size);
+
+int storage_sync();
+
+#endif
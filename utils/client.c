@@ -3,8 +3,16 @@
 #include "socket.h"
 #include "error_type.h"
 #include "server.h"
+#include "pool.h"
 
 static int client_sockfd;
+static bool client_compression = false;
+
+// Makes the next connections offer compression to the server.
+void client_set_compression(bool on)
+{
+    client_compression = on;
+}
 
 int custom_client_response(int sockfd, const char *req_buffer, int req_size, char *res_buffer, int *p_res_size, int max_res_size)
 {
@@ -23,6 +31,8 @@ void custom_client_init(const char *server_ip, int port, response_t *response)
 {
     int sockfd = create_socket();
     connect_to_server(sockfd, server_ip, port);
+    if (client_compression)
+        EXIT_IF(IS_ERROR(socket_offer_compression(sockfd)), close(sockfd), "Error: Could not negotiate compression.\n");
     client_sockfd = sockfd;
     *response = custom_client_response;
 }
@@ -37,23 +47,39 @@ void simple_client(const char *server_ip, int port, get_request_t get_request, h
     response_t response;
     custom_client_init(server_ip, port, &response);
 
+    // both buffers come from the pool and are reused for every request
+    struct pool_buffer_t req_buffer = {NULL, 0};
+    struct pool_buffer_t res_buffer = {NULL, 0};
+    int result = pool_reserve(&req_buffer, DEFAULT_BUFFER_CAPACITY);
+    EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Bad alloc.\n");
+    result = pool_reserve(&res_buffer, DEFAULT_BUFFER_CAPACITY);
+    EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Bad alloc.\n");
+
     int cycle = 0;
-    int result;
     while (true)
     {
-        char req_buffer[DEFAULT_BUFFER_CAPACITY];
         int req_size = 0;
-        result = get_request(req_buffer, &req_size, DEFAULT_BUFFER_CAPACITY, cycle);
+        result = get_request(req_buffer.data, &req_size, DEFAULT_BUFFER_CAPACITY, cycle);
         EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Could not get request.\n");
 
-        char res_buffer[DEFAULT_BUFFER_CAPACITY];
-        int res_size = 0;
-        result = response(client_sockfd, req_buffer, req_size, res_buffer, &res_size, DEFAULT_BUFFER_CAPACITY);
+        result = send_message(client_sockfd, req_buffer.data, req_size);
         EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Could not get response.\n");
-        
-        result = handle_response(res_buffer, res_size, cycle);
-        EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Could not receive response.\n");
+
+        // a large response comes in chunks, each one is handled as it arrives
+        bool more = true;
+        while (more)
+        {
+            int res_size = 0;
+            uint32_t tag = 0;
+            result = recv_message_chunk(client_sockfd, &tag, res_buffer.data, &res_size, DEFAULT_BUFFER_CAPACITY, &more);
+            EXIT_IF(IS_ERROR(result) || tag != 0, custom_client_close(), "Error: Could not get response.\n");
+
+            result = handle_response(res_buffer.data, res_size, cycle, more);
+            EXIT_IF(IS_ERROR(result), custom_client_close(), "Error: Could not receive response.\n");
+        }
         cycle++;
     }
+    pool_release(&req_buffer);
+    pool_release(&res_buffer);
     custom_client_close();
 }
\ No newline at end of file
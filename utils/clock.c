@@ -0,0 +1,22 @@
+#include "clock.h"
+#include "common.h"
+#include <time.h>
+
+// Returns the time of a monotonic clock in microseconds.
+long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+
+// Sleeps until the monotonic clock reaches deadline_us.
+void sleep_until_us(long deadline_us)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline_us / 1000000L;
+    ts.tv_nsec = (deadline_us % 1000000L) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
@@ -0,0 +1,211 @@
+#include "log.h"
+#include "common.h"
+#include "clock.h"
+#include "error_type.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+
+struct log_entry_t
+{
+    long seq; // order of the message among all threads
+    char text[LOG_MESSAGE_SIZE];
+};
+
+// ring of the messages of one thread, written by the thread and read by the
+// writer
+struct log_ring_t
+{
+    struct log_entry_t entries[LOG_RING_SIZE];
+    atomic_long head; // next entry to fill, moved by the thread
+    atomic_long tail; // next entry to write out, moved by the writer
+    atomic_long n_dropped;
+    long n_reported_drops;
+    atomic_bool closed; // the thread has exited
+    struct log_ring_t *next;
+};
+
+enum log_level_t log_level = LOG_LEVEL_INFO;
+
+// rings of all threads, new rings are pushed at the front
+static _Atomic(struct log_ring_t *) rings = NULL;
+static atomic_long next_seq = 0;
+static __thread struct log_ring_t *thread_ring = NULL;
+static pthread_key_t ring_key;
+
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer_thread;
+static atomic_bool running = false;
+
+static const char *level_names[] = {"error", "info", "debug"};
+
+int parse_log_level(const char *name, enum log_level_t *p_level)
+{
+    for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (strcmp(name, level_names[i]) == 0)
+        {
+            *p_level = i;
+            return SUCCESS;
+        }
+    }
+    return INVALID_ARG_ERROR;
+}
+
+static void ring_release(void *arg)
+{
+    struct log_ring_t *ring = (struct log_ring_t *)arg;
+    atomic_store(&ring->closed, true);
+}
+
+// Returns the ring of the calling thread, created on its first message.
+static struct log_ring_t *ring_get()
+{
+    if (thread_ring != NULL)
+        return thread_ring;
+    struct log_ring_t *ring = (struct log_ring_t *)calloc(1, sizeof(struct log_ring_t));
+    if (ring == NULL)
+        return NULL;
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+        ;
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+// Writes out all messages logged so far, oldest first, and frees the rings
+// of the threads that have exited. Must be called with drain_mutex held.
+static void drain()
+{
+    while (true)
+    {
+        struct log_ring_t *oldest = NULL;
+        long oldest_seq = 0;
+        for (struct log_ring_t *ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+        {
+            long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+                continue;
+            long seq = ring->entries[tail & (LOG_RING_SIZE - 1)].seq;
+            if (oldest == NULL || seq < oldest_seq)
+            {
+                oldest = ring;
+                oldest_seq = seq;
+            }
+        }
+        if (oldest == NULL)
+            break;
+        long tail = atomic_load_explicit(&oldest->tail, memory_order_relaxed);
+        fputs(oldest->entries[tail & (LOG_RING_SIZE - 1)].text, stdout);
+        atomic_store_explicit(&oldest->tail, tail + 1, memory_order_release);
+    }
+
+    struct log_ring_t *prev = NULL;
+    struct log_ring_t *ring = atomic_load(&rings);
+    while (ring != NULL)
+    {
+        struct log_ring_t *next = ring->next;
+        long n_dropped = atomic_load(&ring->n_dropped);
+        if (n_dropped > ring->n_reported_drops)
+        {
+            printf("log: %ld messages dropped\n", n_dropped - ring->n_reported_drops);
+            ring->n_reported_drops = n_dropped;
+        }
+        if (!atomic_load(&ring->closed) || atomic_load(&ring->tail) != atomic_load(&ring->head))
+        {
+            prev = ring;
+            ring = next;
+            continue;
+        }
+
+        // threads only push at the front, so only the front may have moved
+        struct log_ring_t *front = ring;
+        if (prev == NULL && !atomic_compare_exchange_strong(&rings, &front, next))
+        {
+            prev = front;
+            while (prev->next != ring)
+                prev = prev->next;
+        }
+        if (prev != NULL)
+            prev->next = next;
+        free(ring);
+        ring = next;
+    }
+    fflush(stdout);
+}
+
+static void *writer(void *arg)
+{
+    // the signal handlers exit through log_close(), which joins this thread
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (atomic_load(&running))
+    {
+        sleep_until_us(now_us() + LOG_WRITER_INTERVAL_US);
+        pthread_mutex_lock(&drain_mutex);
+        drain();
+        pthread_mutex_unlock(&drain_mutex);
+    }
+    return NULL;
+}
+
+void log_init(enum log_level_t level)
+{
+    log_level = level;
+    int result = pthread_key_create(&ring_key, ring_release);
+    EXIT_IF(result != 0, , "Error: Could not create the log key.\n");
+    atomic_store(&running, true);
+    result = pthread_create(&writer_thread, NULL, writer, NULL);
+    EXIT_IF(result != 0, , "Error: Could not create the log writer thread.\n");
+    atexit(log_close);
+}
+
+// Stops the writer and writes out the remaining messages. Messages logged
+// afterwards are printed directly.
+void log_close()
+{
+    if (!atomic_exchange(&running, false))
+        return;
+    pthread_join(writer_thread, NULL);
+    log_flush();
+}
+
+// Logs a message. Falls back to printf if the writer is not running or the
+// ring cannot be allocated.
+void log_write(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    struct log_ring_t *ring = atomic_load(&running) ? ring_get() : NULL;
+    if (ring == NULL)
+    {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&ring->n_dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    struct log_entry_t *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    int length = vsnprintf(entry->text, LOG_MESSAGE_SIZE, format, args);
+    va_end(args);
+    if (length >= LOG_MESSAGE_SIZE)
+        entry->text[LOG_MESSAGE_SIZE - 2] = '\n';
+    entry->seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Writes out all messages logged so far.
+void log_flush()
+{
+    pthread_mutex_lock(&drain_mutex);
+    drain();
+    pthread_mutex_unlock(&drain_mutex);
+}
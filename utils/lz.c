@@ -0,0 +1,157 @@
+#include "lz.h"
+#include "error_type.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // the last bytes of a block are always literals
+#define LZ_MATCH_LIMIT 12  // no match starts closer to the end of a block
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_SHIFT 6 // the search speeds up over data that does not match
+
+static uint32_t read32(const char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static int hash32(uint32_t value)
+{
+    return (int)((value * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+// Writes the part of a length that does not fit in the token.
+static char *write_length(char *op, int length)
+{
+    while (length >= 255)
+    {
+        *op++ = (char)255;
+        length -= 255;
+    }
+    *op++ = (char)length;
+    return op;
+}
+
+// Writes a sequence of literals followed by a match, or the last literals if
+// match_length is 0. Returns NULL if it does not fit.
+static char *write_sequence(char *op, char *oend, const char *literals, int n_literals, int offset, int match_length)
+{
+    int max_size = 1 + n_literals / 255 + 1 + n_literals + 2 + match_length / 255 + 1;
+    if (max_size > oend - op)
+        return NULL;
+    char *token = op++;
+    int token_literals = (n_literals < 15) ? n_literals : 15;
+    if (n_literals >= 15)
+        op = write_length(op, n_literals - 15);
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+    int token_match = 0;
+    if (match_length > 0)
+    {
+        *op++ = (char)(offset & 0xff);
+        *op++ = (char)(offset >> 8);
+        int length = match_length - LZ_MIN_MATCH;
+        token_match = (length < 15) ? length : 15;
+        if (length >= 15)
+            op = write_length(op, length - 15);
+    }
+    *token = (char)((token_literals << 4) | token_match);
+    return op;
+}
+
+// Compresses src into dst. Returns the size of the compressed block.
+int lz_compress(const char *src, int src_size, char *dst, int max_dst_size)
+{
+    RET_ERR_IF(src == NULL || dst == NULL || src_size < 0 || max_dst_size < 0, , INVALID_ARG_ERROR);
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    char *op = dst;
+    char *oend = dst + max_dst_size;
+    int anchor = 0;
+    int pos = 0;
+    while (pos + LZ_MATCH_LIMIT <= src_size)
+    {
+        uint32_t sequence = read32(src + pos);
+        int h = hash32(sequence);
+        int ref = table[h];
+        table[h] = pos;
+        if (ref < 0 || pos - ref > LZ_MAX_OFFSET || read32(src + ref) != sequence)
+        {
+            pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        int length = LZ_MIN_MATCH;
+        while (pos + length < src_size - LZ_LAST_LITERALS && src[ref + length] == src[pos + length])
+            length++;
+        op = write_sequence(op, oend, src + anchor, pos - anchor, pos - ref, length);
+        if (op == NULL)
+            return BUFFER_OVERFLOW;
+        pos += length;
+        anchor = pos;
+    }
+    op = write_sequence(op, oend, src + anchor, src_size - anchor, 0, 0);
+    if (op == NULL)
+        return BUFFER_OVERFLOW;
+    return op - dst;
+}
+
+// Reads the part of a length that does not fit in the token.
+static int read_length(const unsigned char **p_ip, const unsigned char *iend, int *p_length)
+{
+    unsigned char byte;
+    do
+    {
+        RET_ERR_IF(*p_ip >= iend, , READ_ERROR);
+        byte = *(*p_ip)++;
+        *p_length += byte;
+    } while (byte == 255);
+    return SUCCESS;
+}
+
+// Decompresses src into dst. Returns the size of the decompressed data.
+int lz_decompress(const char *src, int src_size, char *dst, int max_dst_size)
+{
+    RET_ERR_IF(src == NULL || dst == NULL || src_size < 0 || max_dst_size < 0, , INVALID_ARG_ERROR);
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + src_size;
+    char *op = dst;
+    char *oend = dst + max_dst_size;
+    while (ip < iend)
+    {
+        int token = *ip++;
+        int n_literals = token >> 4;
+        int result = (n_literals == 15) ? read_length(&ip, iend, &n_literals) : SUCCESS;
+        RET_ERR_RESULT(result);
+        RET_ERR_IF(n_literals > iend - ip || n_literals > oend - op, , READ_ERROR);
+        memcpy(op, ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+        if (ip == iend) // the last sequence has no match
+            break;
+
+        RET_ERR_IF(iend - ip < 2, , READ_ERROR);
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        RET_ERR_IF(offset == 0 || offset > op - dst, , READ_ERROR);
+        int length = token & 15;
+        result = (length == 15) ? read_length(&ip, iend, &length) : SUCCESS;
+        RET_ERR_RESULT(result);
+        length += LZ_MIN_MATCH;
+        RET_ERR_IF(length > oend - op, , READ_ERROR);
+
+        // a match may overlap the bytes it produces
+        const char *ref = op - offset;
+        if (offset >= length)
+            memcpy(op, ref, length);
+        else
+        {
+            for (int i = 0; i < length; i++)
+                op[i] = ref[i];
+        }
+        op += length;
+    }
+    return op - dst;
+}
@@ -0,0 +1,176 @@
+#include "pool.h"
+#include "common.h"
+#include "error_type.h"
+#include <stddef.h>
+
+#define POOL_N_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_LARGE -1
+
+// Put in front of every buffer, the size keeps the data aligned for any type.
+union pool_header_t
+{
+    struct
+    {
+        int size_class; // or POOL_LARGE
+        int capacity;
+    };
+    union pool_header_t *next; // in a free list
+    max_align_t align;
+};
+
+struct pool_thread_cache_t
+{
+    union pool_header_t *buffers[POOL_N_CLASSES][POOL_THREAD_CACHE_SIZE];
+    int n_buffers[POOL_N_CLASSES];
+};
+
+static union pool_header_t *shared[POOL_N_CLASSES];
+static int n_shared[POOL_N_CLASSES];
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct pool_thread_cache_t *thread_cache = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// Gives a buffer to the shared list of its class, or back to the system if
+// the list is full.
+static void shared_put(union pool_header_t *header, int size_class)
+{
+    pthread_mutex_lock(&shared_mutex);
+    if (n_shared[size_class] < POOL_SHARED_SIZE)
+    {
+        header->next = shared[size_class];
+        shared[size_class] = header;
+        n_shared[size_class]++;
+        header = NULL;
+    }
+    pthread_mutex_unlock(&shared_mutex);
+    if (header != NULL)
+        free(header);
+}
+
+static union pool_header_t *shared_get(int size_class)
+{
+    pthread_mutex_lock(&shared_mutex);
+    union pool_header_t *header = shared[size_class];
+    if (header != NULL)
+    {
+        shared[size_class] = header->next;
+        n_shared[size_class]--;
+    }
+    pthread_mutex_unlock(&shared_mutex);
+    return header;
+}
+
+// Hands the cache of an exiting thread over to the shared lists.
+static void cache_release(void *arg)
+{
+    struct pool_thread_cache_t *cache = (struct pool_thread_cache_t *)arg;
+    for (int c = 0; c < POOL_N_CLASSES; c++)
+    {
+        for (int i = 0; i < cache->n_buffers[c]; i++)
+            shared_put(cache->buffers[c][i], c);
+    }
+    free(cache);
+}
+
+static void cache_key_create()
+{
+    pthread_key_create(&cache_key, cache_release);
+}
+
+// Returns the cache of the calling thread, created on its first use.
+static struct pool_thread_cache_t *cache_get()
+{
+    if (thread_cache != NULL)
+        return thread_cache;
+    pthread_once(&cache_key_once, cache_key_create);
+    thread_cache = (struct pool_thread_cache_t *)calloc(1, sizeof(struct pool_thread_cache_t));
+    if (thread_cache != NULL)
+        pthread_setspecific(cache_key, thread_cache);
+    return thread_cache;
+}
+
+// Returns the smallest class that holds size bytes, or POOL_LARGE.
+static int size_class_of(int size)
+{
+    int size_class = 0;
+    while (size_class < POOL_N_CLASSES && (1 << (size_class + POOL_MIN_SHIFT)) < size)
+        size_class++;
+    return (size_class < POOL_N_CLASSES) ? size_class : POOL_LARGE;
+}
+
+// Allocates a buffer of at least size bytes. Returns NULL on failure.
+void *pool_alloc(int size)
+{
+    if (size < 0)
+        return NULL;
+    int size_class = size_class_of(size);
+    union pool_header_t *header = NULL;
+    if (size_class != POOL_LARGE)
+    {
+        struct pool_thread_cache_t *cache = cache_get();
+        if (cache != NULL && cache->n_buffers[size_class] > 0)
+            header = cache->buffers[size_class][--cache->n_buffers[size_class]];
+        if (header == NULL)
+            header = shared_get(size_class);
+    }
+    if (header == NULL)
+    {
+        int capacity = (size_class != POOL_LARGE) ? 1 << (size_class + POOL_MIN_SHIFT) : size;
+        header = (union pool_header_t *)malloc(sizeof(union pool_header_t) + capacity);
+        if (header == NULL)
+            return NULL;
+    }
+    header->size_class = size_class;
+    header->capacity = (size_class != POOL_LARGE) ? 1 << (size_class + POOL_MIN_SHIFT) : size;
+    return header + 1;
+}
+
+// Gives a buffer back for reuse. NULL is ignored.
+void pool_free(void *buffer)
+{
+    if (buffer == NULL)
+        return;
+    union pool_header_t *header = (union pool_header_t *)buffer - 1;
+    int size_class = header->size_class;
+    if (size_class == POOL_LARGE)
+    {
+        free(header);
+        return;
+    }
+    struct pool_thread_cache_t *cache = cache_get();
+    if (cache != NULL && cache->n_buffers[size_class] < POOL_THREAD_CACHE_SIZE)
+    {
+        cache->buffers[size_class][cache->n_buffers[size_class]++] = header;
+        return;
+    }
+    shared_put(header, size_class);
+}
+
+// Returns the number of bytes the buffer holds, at least the size asked for.
+int pool_capacity(const void *buffer)
+{
+    return ((const union pool_header_t *)buffer - 1)->capacity;
+}
+
+// Makes the buffer hold at least size bytes. Its content is not kept when it
+// grows.
+int pool_reserve(struct pool_buffer_t *buffer, int size)
+{
+    if (buffer->data != NULL && buffer->capacity >= size)
+        return SUCCESS;
+    char *data = (char *)pool_alloc(size);
+    RET_ERR_IF(data == NULL, , BAD_ALLOC_ERROR);
+    pool_free(buffer->data);
+    buffer->data = data;
+    buffer->capacity = pool_capacity(data);
+    return SUCCESS;
+}
+
+void pool_release(struct pool_buffer_t *buffer)
+{
+    pool_free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+}
@@ -0,0 +1,125 @@
+#include "protocol.h"
+#include "common.h"
+#include "error_type.h"
+
+// Returns whether the buffer holds a binary disk message rather than a text
+// command.
+bool is_disk_message(const char *buffer, int size)
+{
+    return buffer != NULL && size > 0 && (u_int8_t)buffer[0] == DISK_MAGIC;
+}
+
+// Packs the header of a request, so that the payload can be sent from where
+// it is.
+void disk_pack_request_header(char buffer[DISK_REQ_HEADER_SIZE], const struct disk_msg_t *msg)
+{
+    struct disk_req_header_t header;
+    header.magic = DISK_MAGIC;
+    header.opcode = msg->opcode;
+    header.flags = htons(msg->flags);
+    header.lba = htonl(msg->lba);
+    header.count = htonl(msg->count);
+    header.arg = htonl(msg->arg);
+    memcpy(buffer, &header, DISK_REQ_HEADER_SIZE);
+}
+
+// Packs the header and the payload of a request into the buffer. If
+// msg->payload is NULL, only the header is written and the caller is expected
+// to fill in msg->payload_size bytes right after it.
+// Returns the size of the message on success.
+int disk_pack_request(char *buffer, int *p_size, int max_size, const struct disk_msg_t *msg)
+{
+    RET_ERR_IF(buffer == NULL || msg == NULL || msg->payload_size < 0, , INVALID_ARG_ERROR);
+    int size = DISK_REQ_HEADER_SIZE + msg->payload_size;
+    RET_ERR_IF(size > max_size, , BUFFER_OVERFLOW);
+
+    disk_pack_request_header(buffer, msg);
+    if (msg->payload != NULL)
+        memcpy(buffer + DISK_REQ_HEADER_SIZE, msg->payload, msg->payload_size);
+
+    *p_size = size;
+    return size;
+}
+
+// Unpacks a request. Returns the size of the payload on success.
+int disk_unpack_request(const char *buffer, int size, struct disk_msg_t *msg)
+{
+    RET_ERR_IF(!is_disk_message(buffer, size) || msg == NULL, , INVALID_ARG_ERROR);
+    RET_ERR_IF(size < DISK_REQ_HEADER_SIZE, , READ_ERROR);
+
+    struct disk_req_header_t header;
+    memcpy(&header, buffer, DISK_REQ_HEADER_SIZE);
+    msg->opcode = header.opcode;
+    msg->flags = ntohs(header.flags);
+    msg->status = SUCCESS;
+    msg->lba = ntohl(header.lba);
+    msg->count = ntohl(header.count);
+    msg->arg = ntohl(header.arg);
+    msg->payload = buffer + DISK_REQ_HEADER_SIZE;
+    msg->payload_size = size - DISK_REQ_HEADER_SIZE;
+    return msg->payload_size;
+}
+
+// Packs the header and the payload of a response into the buffer, with the
+// same convention for a NULL payload as disk_pack_request().
+// Returns the size of the message on success.
+int disk_pack_response(char *buffer, int *p_size, int max_size, const struct disk_msg_t *msg)
+{
+    RET_ERR_IF(buffer == NULL || msg == NULL || msg->payload_size < 0, , INVALID_ARG_ERROR);
+    int size = DISK_RES_HEADER_SIZE + msg->payload_size;
+    RET_ERR_IF(size > max_size, , BUFFER_OVERFLOW);
+
+    struct disk_res_header_t header;
+    header.magic = DISK_MAGIC;
+    header.opcode = msg->opcode;
+    header.flags = htons(msg->flags);
+    header.status = htonl(msg->status);
+    header.count = htonl(msg->count);
+    memcpy(buffer, &header, DISK_RES_HEADER_SIZE);
+    if (msg->payload != NULL)
+        memcpy(buffer + DISK_RES_HEADER_SIZE, msg->payload, msg->payload_size);
+
+    *p_size = size;
+    return size;
+}
+
+// Unpacks a response. Returns the size of the payload on success.
+int disk_unpack_response(const char *buffer, int size, struct disk_msg_t *msg)
+{
+    RET_ERR_IF(!is_disk_message(buffer, size) || msg == NULL, , INVALID_ARG_ERROR);
+    RET_ERR_IF(size < DISK_RES_HEADER_SIZE, , READ_ERROR);
+
+    struct disk_res_header_t header;
+    memcpy(&header, buffer, DISK_RES_HEADER_SIZE);
+    msg->opcode = header.opcode;
+    msg->flags = ntohs(header.flags);
+    msg->status = (int32_t)ntohl(header.status);
+    msg->lba = 0;
+    msg->count = ntohl(header.count);
+    msg->arg = 0;
+    msg->payload = buffer + DISK_RES_HEADER_SIZE;
+    msg->payload_size = size - DISK_RES_HEADER_SIZE;
+    return msg->payload_size;
+}
+
+// Converts extents to network byte order.
+void disk_pack_extents(char *buffer, const struct disk_extent_t *extents, int n_extents)
+{
+    for (int i = 0; i < n_extents; i++)
+    {
+        struct disk_extent_t extent = {htonl(extents[i].lba), htonl(extents[i].count)};
+        memcpy(buffer + i * sizeof(struct disk_extent_t), &extent, sizeof(struct disk_extent_t));
+    }
+}
+
+// Converts extents to host byte order.
+void disk_unpack_extents(const char *buffer, struct disk_extent_t *extents, int n_extents)
+{
+    for (int i = 0; i < n_extents; i++)
+    {
+        struct disk_extent_t extent;
+        memcpy(&extent, buffer + i * sizeof(struct disk_extent_t), sizeof(struct disk_extent_t));
+        extents[i].lba = ntohl(extent.lba);
+        extents[i].count = ntohl(extent.count);
+    }
+}
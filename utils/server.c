@@ -1,33 +1,122 @@
+#define _GNU_SOURCE
 #include "socket.h"
 #include "server.h"
 #include "common.h"
 #include "error_type.h"
+#include "pool.h"
+#include "clock.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
 
-static response_t simple_server_response_functions[MAX_CLIENTS];
-static int simple_server_client_sockfds[MAX_CLIENTS];
-static pthread_t simple_server_worker_threads[MAX_CLIENTS];
-static int n_client_sockfds = 0;
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_MAX_OUTPUT (4 * DEFAULT_BUFFER_CAPACITY) // queued per connection before a stream waits
 
-void *simple_server_worker(void *p_sockfd)
+static response_t server_response = NULL;
+static bool server_started = false;
+static bool server_nodelay = false;
+
+struct connection_t;
+
+// The request the calling thread answers, so that the response function can
+// send chunks of its response. conn is NULL for the thread of a connection.
+struct stream_t
+{
+    int sockfd;
+    uint32_t tag;
+    struct connection_t *conn;
+    bool failed; // a chunk could not be sent whole, the connection is dropped
+};
+
+static __thread struct stream_t *current_stream = NULL;
+
+static int connection_send_chunk(struct connection_t *conn, uint32_t tag, const char *buffer, int size);
+
+// id of the connection on every socket, a new id is given on every accept
+static atomic_long connection_ids[MAX_CLIENTS];
+static atomic_long next_connection_id = 1;
+
+// Returns the id of the connection on the socket, which tells a new
+// connection from an old one on the same socket.
+long server_connection_id(int sockfd)
+{
+    return (sockfd >= 0 && sockfd < MAX_CLIENTS) ? atomic_load(&connection_ids[sockfd]) : 0;
+}
+
+// Registers an accepted connection. Refuses it if its socket is too high.
+bool server_register_connection(int sockfd)
+{
+    if (sockfd >= MAX_CLIENTS)
+    {
+        fprintf(stderr, "Error: Too many clients.\n");
+        close(sockfd);
+        return false;
+    }
+    atomic_store(&connection_ids[sockfd], atomic_fetch_add(&next_connection_id, 1));
+    socket_set_compression(sockfd, false);
+    if (server_nodelay)
+        socket_set_nodelay(sockfd, true);
+    return true;
+}
+
+// Turns Nagle's algorithm off on the connections accepted from now on, for a
+// server whose clients pipeline small requests and wait for each response.
+void server_set_nodelay(bool on)
+{
+    server_nodelay = on;
+}
+
+// Sends a chunk of the response being built by the response function of the
+// calling thread, before the response is complete. What the response function
+// returns is the last chunk. Blocks while the client is behind, so a large
+// response is never held whole. Fails outside of a response function.
+int server_send_chunk(const char *buffer, int size)
 {
-    int sockfd = *(int *)p_sockfd;
-    response_t response_function = simple_server_response_functions[sockfd];
+    struct stream_t *stream = current_stream;
+    RET_ERR_IF(stream == NULL, , INVALID_ARG_ERROR);
+    if (stream->conn != NULL)
+        return connection_send_chunk(stream->conn, stream->tag, buffer, size);
+    int result = send_message_chunk(stream->sockfd, stream->tag, buffer, size, true);
+    stream->failed = stream->failed || result == WRITE_ERROR;
+    return result;
+}
+
+/*
+ * one thread per connection
+ */
+
+// The buffers of the connection come from the pool, the request buffer grows
+// to the largest request and the response buffer is reused for every
+// response.
+void *simple_server_worker(void *arg)
+{
+    int sockfd = (int)(intptr_t)arg;
     int result = 0;
     signal(SIGPIPE, sigpipe_handler);
+    // a client that takes nothing for that long fails the send and is dropped
+    struct timeval timeout = {SERVER_SEND_TIMEOUT_US / 1000000, SERVER_SEND_TIMEOUT_US % 1000000};
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    struct pool_buffer_t req_buffer = {NULL, 0};
+    struct pool_buffer_t res_buffer = {NULL, 0};
+    result = pool_reserve(&res_buffer, DEFAULT_BUFFER_CAPACITY);
+    TEXIT_IF(IS_ERROR(result), close(sockfd), "Error: Bad alloc.\n");
     while(true)
     {
-        char req_buffer[DEFAULT_BUFFER_CAPACITY];
         int req_buffer_size = 0;
-        result = recv_message(sockfd, req_buffer, &req_buffer_size, DEFAULT_BUFFER_CAPACITY);
-        TEXIT_IF(IS_ERROR(result), , "Error: Could not receive message.\n");
+        uint32_t tag = 0;
+        result = recv_pooled_message(sockfd, &tag, &req_buffer, &req_buffer_size, DEFAULT_BUFFER_CAPACITY);
+        TEXIT_IF(IS_ERROR(result), close(sockfd); pool_release(&req_buffer); pool_release(&res_buffer), "Error: Could not receive message.\n");
 
-        char res_buffer[DEFAULT_BUFFER_CAPACITY];
         int res_buffer_size = 0;
-        result = response_function(sockfd, req_buffer, req_buffer_size, res_buffer, &res_buffer_size, DEFAULT_BUFFER_CAPACITY);
-        TEXIT_IF(IS_ERROR(result), , "Error: Response error.\n");
+        struct stream_t stream = {sockfd, tag, NULL, false};
+        current_stream = &stream;
+        result = server_response(sockfd, req_buffer.data, req_buffer_size, res_buffer.data, &res_buffer_size, DEFAULT_BUFFER_CAPACITY);
+        current_stream = NULL;
+        TEXIT_IF(IS_ERROR(result), close(sockfd); pool_release(&req_buffer); pool_release(&res_buffer), "Error: Response error.\n");
+        TEXIT_IF(stream.failed, close(sockfd); pool_release(&req_buffer); pool_release(&res_buffer), "Error: Could not send message.\n");
 
-        result = send_message(sockfd, res_buffer, res_buffer_size);
-        TEXIT_IF(IS_ERROR(result), , "Error: Could not send message.\n");
+        result = send_tagged_message(sockfd, tag, res_buffer.data, res_buffer_size);
+        TEXIT_IF(IS_ERROR(result), close(sockfd); pool_release(&req_buffer); pool_release(&res_buffer), "Error: Could not send message.\n");
     }
     pthread_exit(NULL);
 }
@@ -35,21 +124,588 @@ void *simple_server_worker(void *p_sockfd)
 int simple_server(int port, response_t response)
 {
     int result;
-    EXIT_IF(n_client_sockfds != 0, , "Error: Multiple servers.");
+    EXIT_IF(server_started, , "Error: Multiple servers.");
+    server_started = true;
+    server_response = response;
     int sockfd = create_socket();
     bind_socket(sockfd, port);
     listen_socket(sockfd);
-    while (n_client_sockfds < MAX_CLIENTS)
+    while (true)
     {
         int client_sockfd = wait_for_client(sockfd);
-        simple_server_response_functions[client_sockfd] = response;
-        simple_server_client_sockfds[n_client_sockfds] = client_sockfd;
+        if (!server_register_connection(client_sockfd))
+            continue;
+
+        // the socket is passed by value, the threads are never joined
         pthread_t thread;
-        result = pthread_create(&thread, NULL, simple_server_worker, &client_sockfd);
+        result = pthread_create(&thread, NULL, simple_server_worker, (void *)(intptr_t)client_sockfd);
         EXIT_IF(result != 0, close(sockfd), "Error: Could not create a new thread.");
-        simple_server_worker_threads[n_client_sockfds] = thread;
-        n_client_sockfds++;
+        pthread_detach(thread);
     }
     close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * reactor
+ */
+
+// A response waiting for the socket to take it.
+struct output_t
+{
+    struct output_t *next;
+    int size;
+    int sent;
+    char data[];
+};
+
+// The reactor is the only thread to receive on a connection and to close it.
+// The workers send the responses, so the output, the epoll registration and
+// the reference count are guarded by the mutex of the connection. The
+// connection is freed when the reactor has closed it and no worker holds a
+// request of it any more. A worker that streams a response waits on drained
+// while more than REACTOR_MAX_OUTPUT bytes are queued.
+struct connection_t
+{
+    int sockfd;
+
+    // request being received, request is allocated once the length is known
+    char header[8];
+    int header_size;
+    uint32_t tag;
+    bool compressed;
+    char *request;
+    int request_size;
+    int received;
+
+    pthread_mutex_t mutex;
+    int refs;     // the reactor, and every request being answered
+    bool reading; // false while an untagged request is answered
+    bool failed;  // a worker could not send, the reactor should close
+    bool closed;
+    struct output_t *output_head;
+    struct output_t *output_tail;
+    int output_size;
+    pthread_cond_t drained;
+};
+
+// A request waiting for a worker.
+struct work_t
+{
+    struct connection_t *conn;
+    uint32_t tag;
+    char *request;
+    int request_size;
+    struct work_t *next;
+};
+
+static int epoll_fd = -1;
+
+static struct work_t *work_head = NULL;
+static struct work_t *work_tail = NULL;
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+static void connection_free(struct connection_t *conn)
+{
+    close(conn->sockfd);
+    pool_free(conn->request);
+    pthread_mutex_destroy(&conn->mutex);
+    pthread_cond_destroy(&conn->drained);
+    free(conn);
+}
+
+// Drops a reference with the mutex held. Returns true if it was the last one,
+// then the caller frees the connection after unlocking.
+static bool connection_unref_locked(struct connection_t *conn)
+{
+    conn->refs--;
+    return conn->refs == 0;
+}
+
+// Arms the socket for what the connection waits for, with the mutex held.
+// Nothing is armed while a worker answers an untagged request and nothing is
+// left to send.
+static void connection_arm_locked(struct connection_t *conn)
+{
+    if (conn->closed)
+        return;
+    uint32_t events = 0;
+    if (conn->reading || conn->failed)
+        events |= EPOLLIN;
+    if (conn->output_head != NULL || conn->failed)
+        events |= EPOLLOUT;
+    if (events == 0)
+        return;
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sockfd, &event) < 0)
+        conn->failed = true;
+}
+
+// Closes the connection, from the reactor only, so that no event of it is
+// handled afterwards. Frees it unless a worker still answers a request of it.
+static void connection_close(struct connection_t *conn)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->closed = true;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    while (conn->output_head != NULL)
+    {
+        struct output_t *output = conn->output_head;
+        conn->output_head = output->next;
+        pool_free(output);
+    }
+    conn->output_tail = NULL;
+    conn->output_size = 0;
+    pthread_cond_broadcast(&conn->drained);
+    bool last = connection_unref_locked(conn);
+    pthread_mutex_unlock(&conn->mutex);
+    if (last)
+        connection_free(conn);
+}
+
+// Reads into buffer what has arrived, up to size bytes in total. Returns the
+// number of bytes read, or an error if the connection is over.
+static int connection_read(int sockfd, char *buffer, int size)
+{
+    int n_read = 0;
+    while (n_read < size)
+    {
+        int n = recv(sockfd, buffer + n_read, size - n_read, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        RET_ERR_IF(n <= 0, , READ_ERROR);
+        n_read += n;
+    }
+    return n_read;
+}
+
+static void connection_write_locked(struct connection_t *conn, uint32_t tag, const char *data, int size, uint32_t flags);
+
+// Receives what has arrived of the request of the connection. Returns true
+// once the request is complete. An offer of compression is accepted on the
+// way and a compressed request is decompressed.
+static int connection_receive(struct connection_t *conn)
+{
+    if (conn->request == NULL)
+    {
+        // the length, then the tag if the length says so
+        int header_size = 4;
+        if (conn->header_size >= 4 && (ntohl(*(uint32_t *)conn->header) & MESSAGE_TAGGED))
+            header_size = 8;
+        int result = connection_read(conn->sockfd, conn->header + conn->header_size, header_size - conn->header_size);
+        RET_ERR_RESULT(result);
+        conn->header_size += result;
+        if (conn->header_size < header_size)
+            return false;
+
+        uint32_t length;
+        memcpy(&length, conn->header, 4);
+        length = ntohl(length);
+        if (header_size == 4 && (length & MESSAGE_TAGGED))
+            return connection_receive(conn);
+        if (length == MESSAGE_COMPRESSED)
+        {
+            conn->header_size = 0;
+            socket_set_compression(conn->sockfd, true);
+            pthread_mutex_lock(&conn->mutex);
+            connection_write_locked(conn, 0, "", 0, MESSAGE_COMPRESSED);
+            bool failed = conn->failed;
+            pthread_mutex_unlock(&conn->mutex);
+            RET_ERR_IF(failed, , WRITE_ERROR);
+            return connection_receive(conn);
+        }
+        conn->tag = 0;
+        if (length & MESSAGE_TAGGED)
+        {
+            memcpy(&conn->tag, conn->header + 4, 4);
+            conn->tag = ntohl(conn->tag);
+            RET_ERR_IF(conn->tag == 0, , READ_ERROR);
+            length &= ~MESSAGE_TAGGED;
+        }
+        conn->compressed = (length & MESSAGE_COMPRESSED) != 0;
+        length &= ~MESSAGE_COMPRESSED;
+        RET_ERR_IF(length > DEFAULT_BUFFER_CAPACITY, , BUFFER_OVERFLOW);
+        conn->request = (char *)pool_alloc(length);
+        RET_ERR_IF(conn->request == NULL, , BAD_ALLOC_ERROR);
+        conn->request_size = (int)length;
+        conn->received = 0;
+    }
+    int result = connection_read(conn->sockfd, conn->request + conn->received, conn->request_size - conn->received);
+    RET_ERR_RESULT(result);
+    conn->received += result;
+    if (conn->received < conn->request_size)
+        return false;
+
+    if (conn->compressed)
+    {
+        int size = decompressed_size(conn->request, conn->request_size);
+        RET_ERR_IF(IS_ERROR(size) || size > DEFAULT_BUFFER_CAPACITY, , BUFFER_OVERFLOW);
+        char *request = (char *)pool_alloc(size);
+        RET_ERR_IF(request == NULL, , BAD_ALLOC_ERROR);
+        result = decompress_message(conn->request, conn->request_size, request, size);
+        RET_ERR_IF(IS_ERROR(result), pool_free(request), result);
+        pool_free(conn->request);
+        conn->request = request;
+        conn->request_size = size;
+    }
+    return true;
+}
+
+// Sends what the socket takes of the queued responses, with the mutex held,
+// and wakes the workers that wait for the output to drain.
+static int connection_send_locked(struct connection_t *conn)
+{
+    int result = SUCCESS;
+    while (conn->output_head != NULL)
+    {
+        struct output_t *output = conn->output_head;
+        while (output->sent < output->size)
+        {
+            int n = send(conn->sockfd, output->data + output->sent, output->size - output->sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0)
+            {
+                result = WRITE_ERROR;
+                break;
+            }
+            output->sent += n;
+            conn->output_size -= n;
+        }
+        if (output->sent < output->size)
+            break;
+        conn->output_head = output->next;
+        if (conn->output_head == NULL)
+            conn->output_tail = NULL;
+        pool_free(output);
+    }
+    if (conn->output_size <= REACTOR_MAX_OUTPUT)
+        pthread_cond_broadcast(&conn->drained);
+    return result;
+}
+
+// Sends a framed message with the mutex held: directly if nothing is queued
+// before it, and what the socket does not take is copied into the output of
+// the connection. flags are added to the length. Marks the connection failed
+// on error.
+static void connection_write_framed_locked(struct connection_t *conn, uint32_t tag, const char *data, int size, uint32_t flags)
+{
+    if (conn->closed || conn->failed)
+        return;
+    uint32_t header[2];
+    header[0] = htonl(size | ((tag != 0) ? MESSAGE_TAGGED : 0) | flags);
+    header[1] = htonl(tag);
+    int header_size = (tag != 0) ? 8 : 4;
+    int total = header_size + size;
+    int sent = 0;
+    while (conn->output_head == NULL && sent < total)
+    {
+        struct iovec iov[2];
+        int n_iov = 0;
+        int data_sent = (sent > header_size) ? sent - header_size : 0;
+        if (sent < header_size)
+            iov[n_iov++] = (struct iovec){(char *)header + sent, header_size - sent};
+        if (data_sent < size)
+            iov[n_iov++] = (struct iovec){(char *)data + data_sent, size - data_sent};
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+        int n = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            conn->failed = true;
+            return;
+        }
+        sent += n;
+    }
+    if (sent == total)
+        return;
+
+    struct output_t *output = (struct output_t *)pool_alloc(sizeof(struct output_t) + total - sent);
+    if (output == NULL)
+    {
+        conn->failed = true;
+        return;
+    }
+    output->size = total - sent;
+    output->sent = 0;
+    output->next = NULL;
+    int data_sent = (sent > header_size) ? sent - header_size : 0;
+    if (sent < header_size)
+        memcpy(output->data, (char *)header + sent, header_size - sent);
+    memcpy(output->data + output->size - (size - data_sent), data + data_sent, size - data_sent);
+    if (conn->output_tail == NULL)
+        conn->output_head = conn->output_tail = output;
+    else
+    {
+        conn->output_tail->next = output;
+        conn->output_tail = output;
+    }
+    conn->output_size += output->size;
+}
+
+// Like connection_write_framed_locked, compresses the message first if the
+// client has asked for it.
+static void connection_write_locked(struct connection_t *conn, uint32_t tag, const char *data, int size, uint32_t flags)
+{
+    char *compressed = NULL;
+    if (!(flags & MESSAGE_COMPRESSED) && socket_compression(conn->sockfd))
+    {
+        int compressed_size = compress_message(data, size, &compressed);
+        if (compressed_size > 0)
+        {
+            data = compressed;
+            size = compressed_size;
+            flags |= MESSAGE_COMPRESSED;
+        }
+    }
+    connection_write_framed_locked(conn, tag, data, size, flags);
+    pool_free(compressed);
+}
+
+// Sends a chunk of a response from a worker. Waits first while the client is
+// behind, the reactor wakes the worker as the output drains.
+static int connection_send_chunk(struct connection_t *conn, uint32_t tag, const char *buffer, int size)
+{
+    RET_ERR_IF(buffer == NULL || size < 0 || size > DEFAULT_BUFFER_CAPACITY, , INVALID_ARG_ERROR);
+    pthread_mutex_lock(&conn->mutex);
+    long deadline_us = now_us() + SERVER_SEND_TIMEOUT_US;
+    struct timespec deadline = {deadline_us / 1000000L, (deadline_us % 1000000L) * 1000};
+    while (conn->output_size > REACTOR_MAX_OUTPUT && !conn->closed && !conn->failed)
+    {
+        // a client that takes nothing for that long is dropped
+        if (pthread_cond_timedwait(&conn->drained, &conn->mutex, &deadline) == ETIMEDOUT)
+            conn->failed = true;
+    }
+    connection_write_locked(conn, tag, buffer, size, MESSAGE_MORE);
+    int result = (conn->closed || conn->failed) ? WRITE_ERROR : SUCCESS;
+    connection_arm_locked(conn);
+    pthread_mutex_unlock(&conn->mutex);
+    return result;
+}
+
+static void work_push(struct work_t *work)
+{
+    work->next = NULL;
+    pthread_mutex_lock(&work_mutex);
+    if (work_tail == NULL)
+        work_head = work_tail = work;
+    else
+    {
+        work_tail->next = work;
+        work_tail = work;
+    }
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_mutex);
+}
+
+static struct work_t *work_pop()
+{
+    pthread_mutex_lock(&work_mutex);
+    while (work_head == NULL)
+        pthread_cond_wait(&work_cond, &work_mutex);
+    struct work_t *work = work_head;
+    work_head = work->next;
+    if (work_head == NULL)
+        work_tail = NULL;
+    pthread_mutex_unlock(&work_mutex);
+    return work;
+}
+
+// Answers the requests of the work queue. The response is sent directly if
+// nothing is queued before it, only what the socket does not take is copied
+// into the output of the connection.
+static void *reactor_worker(void *arg)
+{
+    char *res_buffer = (char *)pool_alloc(DEFAULT_BUFFER_CAPACITY);
+    EXIT_IF(res_buffer == NULL, , "Error: Bad alloc.\n");
+    while (true)
+    {
+        struct work_t *work = work_pop();
+        struct connection_t *conn = work->conn;
+        int res_size = 0;
+        struct stream_t stream = {conn->sockfd, work->tag, conn, false};
+        current_stream = &stream;
+        int result = server_response(conn->sockfd, work->request, work->request_size, res_buffer, &res_size, DEFAULT_BUFFER_CAPACITY);
+        current_stream = NULL;
+        pool_free(work->request);
+        if (IS_ERROR(result))
+            fprintf(stderr, "Error: Response error.\n");
+
+        pthread_mutex_lock(&conn->mutex);
+        if (IS_ERROR(result))
+            conn->failed = true;
+        else
+            connection_write_locked(conn, work->tag, res_buffer, res_size, 0);
+        if (work->tag == 0)
+            conn->reading = true;
+        connection_arm_locked(conn);
+        bool last = connection_unref_locked(conn);
+        pthread_mutex_unlock(&conn->mutex);
+        if (last)
+            connection_free(conn);
+        free(work);
+    }
+    return NULL;
+}
+
+// Accepts all pending connections and waits for their first request.
+static void reactor_accept(int sockfd)
+{
+    while (true)
+    {
+        int client_sockfd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_sockfd < 0 && errno == EINTR)
+            continue;
+        if (client_sockfd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "Error: Could not accept a client: %s\n", strerror(errno));
+            return;
+        }
+        if (!server_register_connection(client_sockfd))
+            continue;
+
+        struct connection_t *conn = (struct connection_t *)calloc(1, sizeof(struct connection_t));
+        if (conn == NULL)
+        {
+            close(client_sockfd);
+            continue;
+        }
+        conn->sockfd = client_sockfd;
+        conn->refs = 1;
+        conn->reading = true;
+        pthread_mutex_init(&conn->mutex, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&conn->drained, &attr);
+        pthread_condattr_destroy(&attr);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sockfd, &event) < 0)
+            connection_free(conn);
+    }
+}
+
+// Handles an event of a connection: queued responses can be sent, or more
+// requests have arrived. A tagged request is handed to the workers and the
+// next one is received at once, so the requests of a connection are answered
+// concurrently and their responses go out in the order they complete. After
+// an untagged request, nothing is received until it is answered.
+static void reactor_handle(struct connection_t *conn)
+{
+    pthread_mutex_lock(&conn->mutex);
+    bool failed = conn->failed || IS_ERROR(connection_send_locked(conn));
+    bool reading = conn->reading;
+    pthread_mutex_unlock(&conn->mutex);
+    if (failed)
+    {
+        connection_close(conn);
+        return;
+    }
+
+    while (reading)
+    {
+        int result = connection_receive(conn);
+        if (IS_ERROR(result))
+        {
+            connection_close(conn);
+            return;
+        }
+        if (!result)
+            break;
+
+        struct work_t *work = (struct work_t *)malloc(sizeof(struct work_t));
+        if (work == NULL)
+        {
+            connection_close(conn);
+            return;
+        }
+        work->conn = conn;
+        work->tag = conn->tag;
+        work->request = conn->request;
+        work->request_size = conn->request_size;
+        conn->request = NULL;
+        conn->header_size = 0;
+
+        pthread_mutex_lock(&conn->mutex);
+        conn->refs++;
+        if (work->tag == 0)
+            conn->reading = reading = false;
+        pthread_mutex_unlock(&conn->mutex);
+        work_push(work);
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    connection_arm_locked(conn);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+int reactor_server(int port, response_t response, int n_workers)
+{
+    EXIT_IF(server_started, , "Error: Multiple servers.");
+    EXIT_IF(n_workers <= 0, , "Error: Invalid number of workers.\n");
+    server_started = true;
+    server_response = response;
+
+    // every connection takes a file descriptor
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < MAX_CLIENTS)
+    {
+        limit.rlim_cur = (limit.rlim_max < MAX_CLIENTS) ? limit.rlim_max : MAX_CLIENTS;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int sockfd = create_socket();
+    bind_socket(sockfd, port);
+    listen_socket(sockfd);
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    EXIT_IF(flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0, close(sockfd), "Error: Could not set up the socket.\n");
+
+    epoll_fd = epoll_create1(0);
+    EXIT_IF(epoll_fd < 0, close(sockfd), "Error: Could not create epoll.\n");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // the listening socket
+    EXIT_IF(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &event) < 0, close(sockfd), "Error: Could not set up epoll.\n");
+
+    for (int i = 0; i < n_workers; i++)
+    {
+        pthread_t thread;
+        int result = pthread_create(&thread, NULL, reactor_worker, NULL);
+        EXIT_IF(result != 0, close(sockfd), "Error: Could not create a new thread.");
+        pthread_detach(thread);
+    }
+    printf("Init: reactor with %d workers.\n", n_workers);
+
+    while (true)
+    {
+        struct epoll_event events[REACTOR_MAX_EVENTS];
+        int n_events = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n_events < 0 && errno == EINTR)
+            continue;
+        EXIT_IF(n_events < 0, close(sockfd), "Error: Could not wait for events.\n");
+        for (int i = 0; i < n_events; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                reactor_accept(sockfd);
+            else
+                reactor_handle((struct connection_t *)events[i].data.ptr);
+        }
+    }
+    close(sockfd);
+    return 0;
+}
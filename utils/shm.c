@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include "shm.h"
+#include "common.h"
+#include "error_type.h"
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct shm_entry_t
+{
+    uint32_t tag;
+    int32_t slot;
+    int32_t size; // of the request, or of the response
+};
+
+// A ring never holds more entries than there are slots, so it cannot
+// overflow.
+struct shm_ring_t
+{
+    atomic_uint head;    // next entry to consume, moved by the consumer
+    atomic_uint tail;    // next entry to produce, moved by the producer
+    atomic_uint waiting; // the consumer sleeps on tail
+    struct shm_entry_t entries[SHM_SLOTS];
+};
+
+struct shm_region_t
+{
+    struct shm_ring_t submissions;
+    struct shm_ring_t completions;
+    char arena[SHM_SLOTS][2][SHM_SLOT_SIZE]; // request and response halves
+};
+
+struct shm_channel_t
+{
+    int sockfd;
+    struct shm_region_t *region;
+    bool used[SHM_SLOTS]; // slots reserved by the client
+};
+
+static void futex_wake(atomic_uint *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void futex_wait(atomic_uint *addr, unsigned int value, int timeout_ms)
+{
+    struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+// Returns false once the peer has closed its end of the socket.
+static bool peer_alive(int sockfd)
+{
+    struct pollfd fd = {sockfd, POLLIN | POLLRDHUP, 0};
+    if (poll(&fd, 1, 0) <= 0)
+        return true;
+    return !(fd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+static void ring_push(struct shm_ring_t *ring, uint32_t tag, int slot, int size)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct shm_entry_t entry = {tag, slot, size};
+    ring->entries[tail % SHM_SLOTS] = entry;
+    atomic_store(&ring->tail, tail + 1);
+    if (atomic_exchange(&ring->waiting, 0))
+        futex_wake(&ring->tail);
+}
+
+// Takes the oldest entry, sleeping while the ring is empty. Fails once the
+// peer is gone.
+static int ring_pop(struct shm_ring_t *ring, int sockfd, struct shm_entry_t *entry)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (true)
+    {
+        unsigned int tail = atomic_load(&ring->tail);
+        if (tail != head)
+            break;
+        // the producer reads waiting after it moves tail, so either it sees
+        // the flag or the check below sees the new tail
+        atomic_store(&ring->waiting, 1);
+        if (atomic_load(&ring->tail) == head)
+            futex_wait(&ring->tail, head, SHM_CHECK_INTERVAL_MS);
+        if (atomic_load(&ring->tail) == head)
+            RET_ERR_IF(!peer_alive(sockfd), , READ_ERROR);
+    }
+    *entry = ring->entries[head % SHM_SLOTS];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return SUCCESS;
+}
+
+/*
+ * client
+ */
+
+// Creates a shared region and hands it to the server listening on path.
+int shm_connect(const char *path, struct shm_channel_t **p_chan)
+{
+    int memfd = memfd_create("shm-transport", 0);
+    RET_ERR_IF(memfd < 0, , DEFAULT_ERROR);
+    RET_ERR_IF(ftruncate(memfd, sizeof(struct shm_region_t)) < 0, close(memfd), DEFAULT_ERROR);
+    struct shm_region_t *region = (struct shm_region_t *)mmap(NULL, sizeof(struct shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    RET_ERR_IF(region == MAP_FAILED, close(memfd), BAD_ALLOC_ERROR);
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int result = (sockfd < 0) ? -1 : connect(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+    RET_ERR_IF(result < 0, close(memfd); if (sockfd >= 0) close(sockfd); munmap(region, sizeof(struct shm_region_t)), DEFAULT_ERROR);
+
+    // the region goes along with one byte of data
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    result = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    RET_ERR_IF(result != 1, close(sockfd); munmap(region, sizeof(struct shm_region_t)), WRITE_ERROR);
+
+    struct shm_channel_t *chan = (struct shm_channel_t *)calloc(1, sizeof(struct shm_channel_t));
+    RET_ERR_IF(chan == NULL, close(sockfd); munmap(region, sizeof(struct shm_region_t)), BAD_ALLOC_ERROR);
+    chan->sockfd = sockfd;
+    chan->region = region;
+    *p_chan = chan;
+    return SUCCESS;
+}
+
+void shm_close(struct shm_channel_t *chan)
+{
+    close(chan->sockfd);
+    munmap(chan->region, sizeof(struct shm_region_t));
+    free(chan);
+}
+
+// Reserves a slot and returns it, with the buffer to write the request into,
+// of SHM_SLOT_SIZE bytes.
+int shm_reserve(struct shm_channel_t *chan, char **p_buffer)
+{
+    for (int i = 0; i < SHM_SLOTS; i++)
+    {
+        if (chan->used[i])
+            continue;
+        chan->used[i] = true;
+        *p_buffer = chan->region->arena[i][0];
+        return i;
+    }
+    RET_ERR_IF(true, , BUFFER_OVERFLOW);
+}
+
+// Submits the request written into a reserved slot.
+int shm_submit(struct shm_channel_t *chan, int slot, uint32_t tag, int size)
+{
+    RET_ERR_IF(slot < 0 || slot >= SHM_SLOTS || !chan->used[slot], , INVALID_ARG_ERROR);
+    RET_ERR_IF(size < 0 || size > SHM_SLOT_SIZE, , BUFFER_OVERFLOW);
+    RET_ERR_IF(!peer_alive(chan->sockfd), , WRITE_ERROR);
+    ring_push(&chan->region->submissions, tag, slot, size);
+    return SUCCESS;
+}
+
+// Returns true if a response is waiting.
+bool shm_ready(struct shm_channel_t *chan)
+{
+    struct shm_ring_t *ring = &chan->region->completions;
+    return atomic_load(&ring->tail) != atomic_load(&ring->head);
+}
+
+// Waits for the next response. The buffer stays valid until the slot is
+// released.
+int shm_receive(struct shm_channel_t *chan, uint32_t *p_tag, int *p_slot, const char **p_buffer, int *p_size)
+{
+    struct shm_entry_t entry;
+    int result = ring_pop(&chan->region->completions, chan->sockfd, &entry);
+    RET_ERR_RESULT(result);
+    RET_ERR_IF(entry.slot < 0 || entry.slot >= SHM_SLOTS || !chan->used[entry.slot], , READ_ERROR);
+    RET_ERR_IF(entry.size < 0 || entry.size > SHM_SLOT_SIZE, , READ_ERROR);
+    *p_tag = entry.tag;
+    *p_slot = entry.slot;
+    *p_buffer = chan->region->arena[entry.slot][1];
+    *p_size = entry.size;
+    return SUCCESS;
+}
+
+void shm_release(struct shm_channel_t *chan, int slot)
+{
+    if (slot >= 0 && slot < SHM_SLOTS)
+        chan->used[slot] = false;
+}
+
+/*
+ * server
+ */
+
+static response_t shm_response = NULL;
+
+// Receives the region of a new client.
+static struct shm_region_t *shm_accept_region(int sockfd)
+{
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sockfd, &msg, 0) != 1)
+        return NULL;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return NULL;
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    // a region of the wrong size is refused rather than read out of bounds
+    struct stat st;
+    struct shm_region_t *region = NULL;
+    if (fstat(memfd, &st) == 0 && st.st_size == sizeof(struct shm_region_t))
+        region = (struct shm_region_t *)mmap(NULL, sizeof(struct shm_region_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    return (region == MAP_FAILED) ? NULL : region;
+}
+
+// Serves the requests of one client in order, until it leaves.
+static void *shm_server_worker(void *arg)
+{
+    int sockfd = (int)(intptr_t)arg;
+    struct shm_region_t *region = shm_accept_region(sockfd);
+    TEXIT_IF(region == NULL, close(sockfd), "Error: Could not receive the shared region.\n");
+    while (true)
+    {
+        struct shm_entry_t entry;
+        int result = ring_pop(&region->submissions, sockfd, &entry);
+        if (IS_ERROR(result))
+            break;
+        if (entry.slot < 0 || entry.slot >= SHM_SLOTS || entry.size < 0 || entry.size > SHM_SLOT_SIZE)
+            break;
+
+        char *slot_buffer = region->arena[entry.slot][0];
+        int res_size = 0;
+        result = shm_response(sockfd, slot_buffer, entry.size, region->arena[entry.slot][1], &res_size, SHM_SLOT_SIZE);
+        if (IS_ERROR(result))
+        {
+            fprintf(stderr, "Error: Response error.\n");
+            break;
+        }
+        ring_push(&region->completions, entry.tag, entry.slot, res_size);
+    }
+    munmap(region, sizeof(struct shm_region_t));
+    close(sockfd);
+    return NULL;
+}
+
+static void *shm_server_acceptor(void *arg)
+{
+    int sockfd = (int)(intptr_t)arg;
+    while (true)
+    {
+        int client_sockfd = accept(sockfd, NULL, NULL);
+        if (client_sockfd < 0 && errno == EINTR)
+            continue;
+        TEXIT_IF(client_sockfd < 0, close(sockfd), "Error: Could not accept a shared-memory client.\n");
+        if (!server_register_connection(client_sockfd))
+            continue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, shm_server_worker, (void *)(intptr_t)client_sockfd) != 0)
+        {
+            close(client_sockfd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Serves the clients that connect to the Unix-domain socket at path, in the
+// background, with one thread per client.
+void shm_server(const char *path, response_t response)
+{
+    shm_response = response;
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    EXIT_IF(strlen(path) >= sizeof(addr.sun_path), , "Error: Socket path too long.\n");
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXIT_IF(sockfd < 0, , "Error: Could not create socket.\n");
+    unlink(path);
+    EXIT_IF(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0, close(sockfd), "Error: Could not bind socket.\n");
+    EXIT_IF(listen(sockfd, SOMAXCONN) < 0, close(sockfd), "Error: Could not listen on socket.\n");
+
+    pthread_t thread;
+    EXIT_IF(pthread_create(&thread, NULL, shm_server_acceptor, (void *)(intptr_t)sockfd) != 0, close(sockfd),
+            "Error: Could not create a new thread.\n");
+    pthread_detach(thread);
+    printf("Init: shared-memory transport at %s.\n", path);
+}
@@ -1,6 +1,13 @@
 #include "socket.h"
 #include "error_type.h"
 #include "common.h"
+#include "lz.h"
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+
+// sockets on which compression has been negotiated
+static atomic_bool compression[SOCKET_MAX_FDS];
 
 // Create a socket and return the file descriptor of the new socket.
 int create_socket()
@@ -12,6 +19,7 @@ int create_socket()
     EXIT_IF(sockfd < 0, , "Error: Could not create socket.\n");
 
     signal(SIGPIPE, SIG_IGN);
+    socket_set_compression(sockfd, false);
     return sockfd;
 }
 
@@ -23,6 +31,9 @@ void bind_socket(int sockfd, uint16_t port)
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     // INADDR_ANY - get IP address of the host automatically
     serv_addr.sin_port = htons(port);
+    // a restarted server can take its port back while old connections linger
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     int result = bind(sockfd, ((struct sockaddr *)(&serv_addr)), sizeof(serv_addr));
     EXIT_IF(result < 0, close(sockfd), "Error: Could not bind socket.\n");
 }
@@ -30,7 +41,7 @@ void bind_socket(int sockfd, uint16_t port)
 // Listen on the provided socket file descriptor.
 void listen_socket(int sockfd)
 {
-    int result = listen(sockfd, 5);
+    int result = listen(sockfd, SOMAXCONN);
     EXIT_IF(result < 0, close(sockfd), "Error: Could not listen socket.\n");
 }
 
@@ -42,6 +53,7 @@ int wait_for_client(int sockfd)
     unsigned len = sizeof(client_addr);
     client_sockfd = accept(sockfd, ((struct sockaddr *)(&client_addr)), &len);
     EXIT_IF(client_sockfd < 0, close(sockfd), "Error: Could not bind socket.\n");
+    socket_set_compression(client_sockfd, false);
     return client_sockfd;
 }
 
@@ -58,6 +70,41 @@ void connect_to_server(int sockfd, const char *ip, uint16_t port)
     EXIT_IF(result < 0, close(sockfd), "Error: Connection failed.\n");
 }
 
+// Connects a new socket to the server. Unlike connect_to_server(), a failure
+// is returned instead of exiting. Returns the socket file descriptor on success.
+int try_connect_to_server(const char *ip, uint16_t port)
+{
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    int result = inet_pton(AF_INET, ip, &server_addr.sin_addr.s_addr);
+    RET_ERR_IF(result <= 0, , INVALID_ARG_ERROR);
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    RET_ERR_IF(sockfd < 0, , DEFAULT_ERROR);
+    socket_set_compression(sockfd, false);
+    result = connect(sockfd, ((struct sockaddr *)(&server_addr)), sizeof(server_addr));
+    RET_ERR_IF(result < 0, close(sockfd), DEFAULT_ERROR);
+    return sockfd;
+}
+
+// Turns Nagle's algorithm off, so that a small request is sent at once
+// instead of waiting for the acknowledgment of the previous one. It is on for
+// no socket by default, only for those carrying small pipelined messages.
+void socket_set_nodelay(int sockfd, bool on)
+{
+    int value = on;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
+
+// While corked, the messages sent on the socket are held back and sent in
+// full packets, until the socket is uncorked.
+void socket_set_cork(int sockfd, bool on)
+{
+    int value = on;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
 // Reads data from the socket and stores it in the provided buffer and its size.
 // Returns the number of bytes read on success.
 int readn(int sockfd, char *buffer, int size)
@@ -72,6 +119,8 @@ int readn(int sockfd, char *buffer, int size)
             p += n_read;
             remain -= n_read;
         }
+        else if (n_read < 0 && errno == EINTR)
+            continue;
         else
             RET_ERR_IF(n_read <= 0, , READ_ERROR);
     }
@@ -86,51 +135,354 @@ int writen(int sockfd, const char *buffer, int size)
 
     while (remain > 0)
     {
-        int n_write = write(sockfd, buffer, remain);
+        // a peer that went away is reported as an error, not as SIGPIPE
+        int n_write = send(sockfd, buffer, remain, MSG_NOSIGNAL);
         if (n_write > 0)
         {
             buffer += n_write;
             remain -= n_write;
         }
+        else if (n_write < 0 && errno == EINTR)
+            continue;
         else
             RET_ERR_IF(n_write <= 0, , WRITE_ERROR);
     }
     return size;
 }
 
+// Writes all data of the vector to the socket, resuming after short writes.
+// The vector is consumed. Returns the number of bytes written on success.
+int writev_all(int sockfd, struct iovec *iov, int iovcnt)
+{
+    int total = 0;
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0)
+    {
+        int n_write = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (n_write < 0 && errno == EINTR)
+            continue;
+        RET_ERR_IF(n_write <= 0, , WRITE_ERROR);
+        total += n_write;
+        while (msg.msg_iovlen > 0 && (size_t)n_write >= msg.msg_iov->iov_len)
+        {
+            n_write -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n_write;
+            msg.msg_iov->iov_len -= n_write;
+        }
+    }
+    return total;
+}
+
 // Sends a message to the server using the provided socket file descriptor, buffer, and size.
 // Returns the size of the message on success.
 int send_message(int sockfd, const char *buffer, int size)
 {
-    RET_ERR_IF(sockfd < 0 || buffer == NULL || size < 0, , INVALID_ARG_ERROR);
+    return send_tagged_message(sockfd, 0, buffer, size);
+}
 
-    char *internal_buffer = (char *)malloc(size + 4);
-    EXIT_IF(internal_buffer == NULL, close(sockfd), "Error: Bad alloc.\n");
+// Sends a message with its tag, so that the peer can match the response to
+// it. A tag of 0 sends an untagged message.
+int send_tagged_message(int sockfd, uint32_t tag, const char *buffer, int size)
+{
+    RET_ERR_IF(buffer == NULL || size < 0, , INVALID_ARG_ERROR);
+    struct iovec iov = {(void *)buffer, size};
+    return send_tagged_messagev(sockfd, tag, &iov, 1);
+}
+
+// Marks whether the messages on the socket are compressed. A descriptor is
+// reused once closed, so a new socket must reset the mark.
+void socket_set_compression(int sockfd, bool on)
+{
+    if (sockfd >= 0 && sockfd < SOCKET_MAX_FDS)
+        atomic_store(&compression[sockfd], on);
+}
+
+// Returns whether the messages on the socket are compressed.
+bool socket_compression(int sockfd)
+{
+    return sockfd >= 0 && sockfd < SOCKET_MAX_FDS && atomic_load(&compression[sockfd]);
+}
+
+// Offers compression to the server, before any other message on the socket.
+// Returns SUCCESS once the server has accepted it.
+int socket_offer_compression(int sockfd)
+{
+    uint32_t offer = htonl(MESSAGE_COMPRESSED);
+    int result = writen(sockfd, (const char *)&offer, 4);
+    RET_ERR_RESULT(result);
+    uint32_t answer = 0;
+    result = readn(sockfd, (char *)&answer, 4);
+    RET_ERR_RESULT(result);
+    RET_ERR_IF(ntohl(answer) != MESSAGE_COMPRESSED, , READ_ERROR);
+    socket_set_compression(sockfd, true);
+    return SUCCESS;
+}
 
-    int big_len = htonl(size);
-    memcpy(internal_buffer, &big_len, 4);
-    memcpy(internal_buffer + 4, buffer, size);
-    int result = writen(sockfd, internal_buffer, size + 4);
-    free(internal_buffer);
+// Compresses a message of at least SOCKET_COMPRESS_THRESHOLD bytes into a
+// pooled buffer, which the caller frees: its original size in network order,
+// then the compressed data. Returns the compressed size, or 0 if the message
+// is small or would not shrink and goes as it is.
+int compress_message(const char *data, int size, char **p_buffer)
+{
+    *p_buffer = NULL;
+    if (size < SOCKET_COMPRESS_THRESHOLD)
+        return 0;
+    char *buffer = (char *)pool_alloc(size);
+    RET_ERR_IF(buffer == NULL, , BAD_ALLOC_ERROR);
+    int result = lz_compress(data, size, buffer + 4, size - 5);
+    if (IS_ERROR(result))
+    {
+        pool_free(buffer);
+        return 0;
+    }
+    uint32_t big_size = htonl(size);
+    memcpy(buffer, &big_size, 4);
+    *p_buffer = buffer;
+    return result + 4;
+}
+
+// Returns the original size of a compressed message.
+int decompressed_size(const char *data, int size)
+{
+    RET_ERR_IF(size < 4, , READ_ERROR);
+    uint32_t big_size;
+    memcpy(&big_size, data, 4);
+    RET_ERR_IF(ntohl(big_size) >= MESSAGE_COMPRESSED, , READ_ERROR);
+    return (int)ntohl(big_size);
+}
+
+// Decompresses a message into buffer. Returns its original size.
+int decompress_message(const char *data, int size, char *buffer, int max_size)
+{
+    int original_size = decompressed_size(data, size);
+    RET_ERR_RESULT(original_size);
+    RET_ERR_IF(original_size > max_size, , BUFFER_OVERFLOW);
+    int result = lz_decompress(data + 4, size - 4, buffer, original_size);
+    RET_ERR_RESULT(result);
+    RET_ERR_IF(result != original_size, , READ_ERROR);
     return result;
 }
 
+// Sends a message, or a chunk of one if more is set, whose data is gathered
+// from a vector of at most SOCKET_MAX_IOVECS buffers. The length and the tag
+// are sent along in the same call, so the data is neither copied nor sent in
+// several packets, unless it is compressed.
+static int send_chunkv(int sockfd, uint32_t tag, const struct iovec *data, int n_data, bool more)
+{
+    RET_ERR_IF(sockfd < 0 || n_data < 0 || n_data > SOCKET_MAX_IOVECS, , INVALID_ARG_ERROR);
+
+    size_t size = 0;
+    struct iovec iov[SOCKET_MAX_IOVECS + 1];
+    for (int i = 0; i < n_data; i++)
+    {
+        iov[i + 1] = data[i];
+        size += data[i].iov_len;
+    }
+    RET_ERR_IF(size >= MESSAGE_COMPRESSED, , BUFFER_OVERFLOW);
+
+    // the data is gathered into one buffer to be compressed
+    char *compressed = NULL;
+    int compressed_size = 0;
+    if (socket_compression(sockfd) && size >= SOCKET_COMPRESS_THRESHOLD)
+    {
+        char *flat = (char *)iov[1].iov_base;
+        if (n_data > 1)
+        {
+            flat = (char *)pool_alloc(size);
+            RET_ERR_IF(flat == NULL, , BAD_ALLOC_ERROR);
+            for (int i = 0, offset = 0; i < n_data; offset += data[i].iov_len, i++)
+                memcpy(flat + offset, data[i].iov_base, data[i].iov_len);
+        }
+        compressed_size = compress_message(flat, size, &compressed);
+        if (n_data > 1)
+            pool_free(flat);
+        RET_ERR_RESULT(compressed_size);
+    }
+
+    uint32_t header[2];
+    uint32_t flags = ((tag != 0) ? MESSAGE_TAGGED : 0) | (more ? MESSAGE_MORE : 0);
+    if (compressed_size > 0)
+    {
+        header[0] = htonl(compressed_size | flags | MESSAGE_COMPRESSED);
+        iov[1].iov_base = compressed;
+        iov[1].iov_len = compressed_size;
+        n_data = 1;
+    }
+    else
+        header[0] = htonl(size | flags);
+    header[1] = htonl(tag);
+    iov[0].iov_base = header;
+    iov[0].iov_len = (tag != 0) ? 8 : 4;
+    int result = writev_all(sockfd, iov, n_data + 1);
+    pool_free(compressed);
+    RET_ERR_RESULT(result);
+    return size;
+}
+
+int send_tagged_messagev(int sockfd, uint32_t tag, const struct iovec *data, int n_data)
+{
+    return send_chunkv(sockfd, tag, data, n_data, false);
+}
+
+// Sends a chunk of a message. Every chunk but the last one is sent with more
+// set.
+int send_message_chunk(int sockfd, uint32_t tag, const char *buffer, int size, bool more)
+{
+    RET_ERR_IF(buffer == NULL || size < 0, , INVALID_ARG_ERROR);
+    struct iovec iov = {(void *)buffer, size};
+    return send_chunkv(sockfd, tag, &iov, 1, more);
+}
+
 // Receives a message from the server using the provided socket file descriptor.
 // Returns the size of message on success.
 int recv_message(int sockfd, char *buffer, int *p_size, int max_size)
+{
+    uint32_t tag = 0;
+    int result = recv_tagged_message(sockfd, &tag, buffer, p_size, max_size);
+    RET_ERR_RESULT(result);
+    RET_ERR_IF(tag != 0, , READ_ERROR);
+    return result;
+}
+
+// Receives the length and the tag of a message. The tag is 0 for an untagged
+// message. A chunk of a message is refused unless p_more is given. An offer
+// of compression is accepted on the way, and the size of a compressed
+// message is the size it has on the wire.
+static int recv_message_header(int sockfd, uint32_t *p_tag, int *p_size, int max_size, bool *p_more, bool *p_compressed)
 {
     RET_ERR_IF(sockfd < 0, , INVALID_ARG_ERROR);
 
-    int size = 0;
-    readn(sockfd, (char *)&size, 4);
-    size = ntohl(size);
-    RET_ERR_IF(size < 0, , READ_ERROR);
-    RET_ERR_IF(size > max_size, , BUFFER_OVERFLOW);
+    uint32_t length = 0;
+    int result = readn(sockfd, (char *)&length, 4);
+    RET_ERR_RESULT(result);
+    length = ntohl(length);
+    if (length == MESSAGE_COMPRESSED)
+    {
+        socket_set_compression(sockfd, true);
+        uint32_t answer = htonl(MESSAGE_COMPRESSED);
+        result = writen(sockfd, (const char *)&answer, 4);
+        RET_ERR_RESULT(result);
+        return recv_message_header(sockfd, p_tag, p_size, max_size, p_more, p_compressed);
+    }
+    uint32_t tag = 0;
+    if (length & MESSAGE_TAGGED)
+    {
+        result = readn(sockfd, (char *)&tag, 4);
+        RET_ERR_RESULT(result);
+        tag = ntohl(tag);
+        RET_ERR_IF(tag == 0, , READ_ERROR);
+        length &= ~MESSAGE_TAGGED;
+    }
+    bool more = (length & MESSAGE_MORE) != 0;
+    RET_ERR_IF(more && p_more == NULL, , READ_ERROR);
+    length &= ~MESSAGE_MORE;
+    *p_compressed = (length & MESSAGE_COMPRESSED) != 0;
+    length &= ~MESSAGE_COMPRESSED;
+    RET_ERR_IF(length > (uint32_t)max_size, , BUFFER_OVERFLOW);
+    if (p_more != NULL)
+        *p_more = more;
+    *p_tag = tag;
+    *p_size = (int)length;
+    return SUCCESS;
+}
+
+// Receives size bytes of a message into a pooled buffer, which the caller
+// frees.
+static int recv_pooled_data(int sockfd, int size, char **p_data)
+{
+    char *data = (char *)pool_alloc(size);
+    RET_ERR_IF(data == NULL, , BAD_ALLOC_ERROR);
+    int result = readn(sockfd, data, size);
+    RET_ERR_IF(result != size, pool_free(data), READ_ERROR);
+    *p_data = data;
+    return SUCCESS;
+}
+
+// Receives the data of a message into buffer, decompressing it if needed.
+// Returns the size of the data.
+static int recv_message_data(int sockfd, char *buffer, int size, int max_size, bool compressed)
+{
+    int result;
+    if (!compressed)
+    {
+        result = readn(sockfd, buffer, size);
+        RET_ERR_IF(result != size, , READ_ERROR);
+        return size;
+    }
+    char *data;
+    result = recv_pooled_data(sockfd, size, &data);
+    RET_ERR_RESULT(result);
+    result = decompress_message(data, size, buffer, max_size);
+    pool_free(data);
+    return result;
+}
+
+// Receives a message, tagged or not. The tag is 0 for an untagged message.
+int recv_tagged_message(int sockfd, uint32_t *p_tag, char *buffer, int *p_size, int max_size)
+{
+    int size;
+    bool compressed;
+    int result = recv_message_header(sockfd, p_tag, &size, max_size, NULL, &compressed);
+    RET_ERR_RESULT(result);
+
+    result = recv_message_data(sockfd, buffer, size, max_size, compressed);
+    RET_ERR_RESULT(result);
 
-    int result = readn(sockfd, buffer, size);
-    RET_ERR_IF(result != size, , READ_ERROR);
+    *p_size = result;
+    return result;
+}
+
+// Receives a message or a chunk of one, more tells if other chunks follow.
+int recv_message_chunk(int sockfd, uint32_t *p_tag, char *buffer, int *p_size, int max_size, bool *p_more)
+{
+    int size;
+    bool compressed;
+    int result = recv_message_header(sockfd, p_tag, &size, max_size, p_more, &compressed);
+    RET_ERR_RESULT(result);
+
+    result = recv_message_data(sockfd, buffer, size, max_size, compressed);
+    RET_ERR_RESULT(result);
+
+    *p_size = result;
+    return result;
+}
+
+// Receives a message of at most max_size bytes into a pooled buffer, which
+// grows to the size of the message if needed.
+int recv_pooled_message(int sockfd, uint32_t *p_tag, struct pool_buffer_t *buffer, int *p_size, int max_size)
+{
+    int size;
+    bool compressed;
+    int result = recv_message_header(sockfd, p_tag, &size, max_size, NULL, &compressed);
+    RET_ERR_RESULT(result);
+    if (!compressed)
+    {
+        result = pool_reserve(buffer, size);
+        RET_ERR_RESULT(result);
+        result = readn(sockfd, buffer->data, size);
+        RET_ERR_IF(result != size, , READ_ERROR);
+        *p_size = size;
+        return result;
+    }
 
-    *p_size = size;
+    char *data;
+    result = recv_pooled_data(sockfd, size, &data);
+    RET_ERR_RESULT(result);
+    int original_size = decompressed_size(data, size);
+    RET_ERR_IF(IS_ERROR(original_size) || original_size > max_size, pool_free(data), BUFFER_OVERFLOW);
+    result = pool_reserve(buffer, original_size);
+    RET_ERR_IF(IS_ERROR(result), pool_free(data), result);
+    result = decompress_message(data, size, buffer->data, max_size);
+    pool_free(data);
+    RET_ERR_RESULT(result);
+    *p_size = result;
     return result;
 }
 